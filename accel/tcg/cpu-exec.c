@@ -409,10 +409,11 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         /* We add the TB in the virtual pc hash table for the fast lookup */
         atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     }
-#ifndef CONFIG_USER_ONLY
+#if !defined(CONFIG_USER_ONLY) && !defined(TARGET_FIXED_CODE_MAPPING)
     /* We don't take care of direct jumps when address mapping changes in
      * system emulation. So it's not safe to make a direct jump to a TB
-     * spanning two pages because the mapping for the second page can change.
+     * spanning two pages because the mapping for the second page can change,
+     * unless the target guarantees it never does.
      */
     if (tb->page_addr[1] != -1) {
         last_tb = NULL;
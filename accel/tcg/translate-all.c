@@ -364,7 +364,12 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
         assert(use_icount);
         /* Reset the cycle counter to the start of the block
            and shift if to the number of actually executed instructions */
+#ifdef TARGET_INSN_START_ICOUNT
+        /* Targets that don't charge one per insn say what's left to refund */
+        cpu->icount_decr.u16.low += data[TARGET_INSN_START_ICOUNT];
+#else
         cpu->icount_decr.u16.low += num_insns - i;
+#endif
     }
     restore_state_to_opc(env, tb, data);
 
@@ -2294,6 +2299,7 @@ struct tb_tree_stats {
     size_t host_size;
     size_t target_size;
     size_t max_target_size;
+    size_t insns;
     size_t direct_jmp_count;
     size_t direct_jmp2_count;
     size_t cross_page;
@@ -2310,6 +2316,7 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     if (tb->size > tst->max_target_size) {
         tst->max_target_size = tb->size;
     }
+    tst->insns += tb->icount;
     if (tb->page_addr[1] != -1) {
         tst->cross_page++;
     }
@@ -2343,6 +2350,8 @@ void dump_exec_info(void)
     qemu_printf("TB avg target size  %zu max=%zu bytes\n",
                 nb_tbs ? tst.target_size / nb_tbs : 0,
                 tst.max_target_size);
+    qemu_printf("TB avg insns        %0.1f\n",
+                nb_tbs ? (double)tst.insns / nb_tbs : 0);
     qemu_printf("TB avg host size    %zu bytes (expansion ratio: %0.1f)\n",
                 nb_tbs ? tst.host_size / nb_tbs : 0,
                 tst.target_size ? (double)tst.host_size / tst.target_size : 0);
@@ -1254,6 +1254,42 @@ STEXI
 @item migration_mode @var{mode}
 @findex migration_mode
 Enables or disables migration mode.
+ETEXI
+
+#if defined(TARGET_AVR)
+    {
+        .name       = "avr_snapshot_save",
+        .args_type  = "",
+        .params     = "",
+        .help       = "save the AVR machine state in memory",
+        .cmd        = hmp_avr_snapshot_save,
+    },
+#endif
+
+STEXI
+@item avr_snapshot_save
+@findex avr_snapshot_save
+Save the CPU, device and memory state of an AVR machine in QEMU's memory,
+replacing the previous snapshot.  This is meant for fuzzing, the snapshot is
+not written anywhere and doesn't survive QEMU exiting.
+ETEXI
+
+#if defined(TARGET_AVR)
+    {
+        .name       = "avr_snapshot_load",
+        .args_type  = "",
+        .params     = "",
+        .help       = "restore the state saved by avr_snapshot_save",
+        .cmd        = hmp_avr_snapshot_load,
+    },
+#endif
+
+STEXI
+@item avr_snapshot_load
+@findex avr_snapshot_load
+Restore the state saved by @code{avr_snapshot_save}.  Only memory pages written
+since the last save or load are copied back, and translated code is kept
+unless the firmware rewrote its flash page.
 ETEXI
 
     {
@@ -0,0 +1,278 @@
+/*
+ * AVR MCU descriptions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "hw/avr/mcu.h"
+
+/* Used when the board isn't given a description */
+static const char avr_mcu_atmega2560[] =
+    "[mcu]\n"
+    "cpu=avr6\n"
+    "flash-size=0x40000\n"
+    "sram-size=0x2200\n"
+    "num-irq=57\n"
+    "\n"
+    "[usart0]\n"
+    "type=avr-usart\n"
+    "base=0xc0\n"
+    "irq=24;25;26\n"
+    "prr=0x64;0x02\n"
+    "\n"
+    "[timer1]\n"
+    "type=avr-timer16\n"
+    "base=0x80;0x6f;0x36\n"
+    "irq=15;16;17;18;19\n"
+    "prr=0x64;0x40\n"
+    "\n"
+    "[eeprom]\n"
+    "type=avr-eeprom\n"
+    "base=0x3f\n"
+    "irq=29\n"
+    "size=4096\n"
+    "\n"
+    "[wdt]\n"
+    "type=avr-wdt\n"
+    "base=0x54;0x60\n"
+    "irq=11\n"
+    "\n"
+    "[gpio]\n"
+    "type=avr-gpio\n"
+    "base=0x20;0x23;0x26;0x29;0x2c;0x2f;0x32;0x100;0x103;0x106;0x109\n"
+    "num-ports=11\n";
+
+/* Descriptions parsed so far, by file name, "" for the built-in one */
+static GHashTable *avr_mcu_descs;
+
+/* Parse the numbers in @key of @group, there may be no more than @max */
+static bool avr_mcu_get_numbers(GKeyFile *kf, const char *group,
+                                const char *key, uint64_t *values,
+                                uint32_t max, uint32_t *count, Error **errp)
+{
+    gchar **list;
+    gsize len;
+    gsize i;
+    bool ok = true;
+
+    list = g_key_file_get_string_list(kf, group, key, &len, NULL);
+    if (!list) {
+        *count = 0;
+        return true;
+    }
+    if (len > max) {
+        error_setg(errp, "[%s] has more than %u %s values", group, max, key);
+        ok = false;
+    }
+    for (i = 0; ok && i < len; i++) {
+        if (qemu_strtou64(g_strstrip(list[i]), NULL, 0, &values[i]) < 0) {
+            error_setg(errp, "[%s] %s: '%s' isn't a number", group, key,
+                       list[i]);
+            ok = false;
+        }
+    }
+    *count = len;
+    g_strfreev(list);
+    return ok;
+}
+
+static bool avr_mcu_get_number(GKeyFile *kf, const char *group,
+                               const char *key, uint64_t *value,
+                               Error **errp)
+{
+    uint32_t count;
+
+    if (!avr_mcu_get_numbers(kf, group, key, value, 1, &count, errp)) {
+        return false;
+    }
+    if (count == 0) {
+        error_setg(errp, "[%s] has no %s", group, key);
+        return false;
+    }
+    return true;
+}
+
+static bool avr_mcu_parse_periph(GKeyFile *kf, const char *group,
+                                 AVRMcuDesc *desc, AVRPeriphDesc *p,
+                                 Error **errp)
+{
+    uint64_t values[AVR_MCU_MAX_REGIONS];
+    GPtrArray *props;
+    gchar **keys;
+    uint32_t count;
+    uint32_t i;
+
+    p->name = g_strdup(group);
+    p->type = g_key_file_get_string(kf, group, "type", NULL);
+    if (!p->type) {
+        error_setg(errp, "[%s] has no type", group);
+        goto fail;
+    }
+
+    if (!avr_mcu_get_numbers(kf, group, "base", values, AVR_MCU_MAX_REGIONS,
+                             &p->num_base, errp)) {
+        goto fail;
+    }
+    for (i = 0; i < p->num_base; i++) {
+        p->base[i] = values[i];
+    }
+
+    if (!avr_mcu_get_numbers(kf, group, "irq", values, AVR_MCU_MAX_IRQS,
+                             &p->num_irq, errp)) {
+        goto fail;
+    }
+    for (i = 0; i < p->num_irq; i++) {
+        if (values[i] >= desc->num_irq) {
+            error_setg(errp, "[%s] irq %" PRIu64 " is past num-irq", group,
+                       values[i]);
+            goto fail;
+        }
+        p->irq[i] = values[i];
+    }
+
+    if (!avr_mcu_get_numbers(kf, group, "prr", values, 2, &count, errp)) {
+        goto fail;
+    }
+    if (count == 1) {
+        error_setg(errp, "[%s] prr needs an address and a mask", group);
+        goto fail;
+    }
+    if (count == 2) {
+        p->prr_address = values[0];
+        p->prr_mask = values[1];
+    }
+
+    props = g_ptr_array_new();
+    keys = g_key_file_get_keys(kf, group, NULL, NULL);
+    for (i = 0; keys[i]; i++) {
+        if (!strcmp(keys[i], "type") || !strcmp(keys[i], "base") ||
+            !strcmp(keys[i], "irq") || !strcmp(keys[i], "prr")) {
+            continue;
+        }
+        g_ptr_array_add(props, g_strdup(keys[i]));
+        g_ptr_array_add(props, g_key_file_get_string(kf, group, keys[i],
+                                                     NULL));
+    }
+    g_strfreev(keys);
+    g_ptr_array_add(props, NULL);
+    p->props = (char **)g_ptr_array_free(props, false);
+    return true;
+
+fail:
+    g_free(p->name);
+    g_free(p->type);
+    memset(p, 0, sizeof(*p));
+    return false;
+}
+
+static void avr_mcu_desc_free(AVRMcuDesc *desc)
+{
+    uint32_t i;
+
+    for (i = 0; i < desc->num_periph; i++) {
+        g_free(desc->periph[i].name);
+        g_free(desc->periph[i].type);
+        g_strfreev(desc->periph[i].props);
+    }
+    g_free(desc->periph);
+    g_free(desc->cpu_type);
+    g_free(desc);
+}
+
+static AVRMcuDesc *avr_mcu_parse(GKeyFile *kf, Error **errp)
+{
+    AVRMcuDesc *desc = g_new0(AVRMcuDesc, 1);
+    uint64_t value;
+    gchar **groups = NULL;
+    gsize len;
+    gsize i;
+
+    desc->cpu_type = g_key_file_get_string(kf, "mcu", "cpu", NULL);
+    if (!desc->cpu_type) {
+        error_setg(errp, "[mcu] has no cpu");
+        goto fail;
+    }
+    if (!avr_mcu_get_number(kf, "mcu", "flash-size", &value, errp)) {
+        goto fail;
+    }
+    desc->flash_size = value;
+    if (!avr_mcu_get_number(kf, "mcu", "sram-size", &value, errp)) {
+        goto fail;
+    }
+    desc->sram_size = value;
+    if (!avr_mcu_get_number(kf, "mcu", "num-irq", &value, errp)) {
+        goto fail;
+    }
+    desc->num_irq = value;
+
+    groups = g_key_file_get_groups(kf, &len);
+    desc->periph = g_new0(AVRPeriphDesc, len);
+    for (i = 0; i < len; i++) {
+        if (!strcmp(groups[i], "mcu")) {
+            continue;
+        }
+        if (!avr_mcu_parse_periph(kf, groups[i], desc,
+                                  &desc->periph[desc->num_periph], errp)) {
+            goto fail;
+        }
+        desc->num_periph++;
+    }
+    g_strfreev(groups);
+    return desc;
+
+fail:
+    g_strfreev(groups);
+    avr_mcu_desc_free(desc);
+    return NULL;
+}
+
+const AVRMcuDesc *avr_mcu_desc_get(const char *filename, Error **errp)
+{
+    const char *key = filename ? filename : "";
+    const char *name = filename ? filename : "(built-in)";
+    AVRMcuDesc *desc;
+    GKeyFile *kf;
+    GError *gerr = NULL;
+    Error *local_err = NULL;
+    bool loaded;
+
+    if (!avr_mcu_descs) {
+        avr_mcu_descs = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    desc = g_hash_table_lookup(avr_mcu_descs, key);
+    if (desc) {
+        return desc;
+    }
+
+    kf = g_key_file_new();
+    if (filename) {
+        loaded = g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE,
+                                           &gerr);
+    } else {
+        loaded = g_key_file_load_from_data(kf, avr_mcu_atmega2560, -1,
+                                           G_KEY_FILE_NONE, &gerr);
+    }
+    if (!loaded) {
+        error_setg(errp, "Failed to read MCU description %s: %s",
+                   name, gerr->message);
+        g_error_free(gerr);
+        desc = NULL;
+        goto out;
+    }
+
+    desc = avr_mcu_parse(kf, &local_err);
+    if (!desc) {
+        error_propagate_prepend(errp, local_err, "MCU description %s: ",
+                                name);
+        goto out;
+    }
+    g_hash_table_insert(avr_mcu_descs, g_strdup(key), desc);
+
+out:
+    g_key_file_free(kf);
+    return desc;
+}
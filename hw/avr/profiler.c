@@ -0,0 +1,436 @@
+/*
+ * AVR sampling profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  -object avr-profiler,id=prof,flat=FILE,folded=FILE[,interval=NS]
+ *
+ *  Every interval of virtual time, with icount that is a number of AVR clock
+ *  cycles, the CPU is asked to record its PC and call stack the next time it
+ *  leaves a TB.  When QEMU exits the samples are written out against the
+ *  function symbols load_elf() read from the firmware:
+ *
+ *  - flat: the share of samples each function was running in, most first
+ *  - folded: one "outer;...;inner count" line per call stack, the input
+ *    format of flamegraph.pl
+ *
+ *  AVR code has no frame pointers or unwind tables, so the call stack is
+ *  found by scanning the stack for values that point just past a CALL,
+ *  RCALL, ICALL or EICALL.  Saved data that happens to look like that shows
+ *  up as an extra frame.
+ *
+ *  Only the first CPU is sampled.  With -smp N that is the first of the
+ *  board's independent systems, the one the monitor looks at.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qom/object_interfaces.h"
+#include "sysemu/sysemu.h"
+#include "disas/disas.h"
+#include "cpu.h"
+
+#define TYPE_AVR_PROFILER "avr-profiler"
+#define AVR_PROFILER(obj) \
+    OBJECT_CHECK(AVRProfiler, (obj), TYPE_AVR_PROFILER)
+
+/* Deepest call stack recorded, including the sampled PC */
+#define AVR_PROFILER_MAX_FRAMES 32
+
+typedef struct AVRProfiler {
+    Object parent_obj;
+
+    /* Properties */
+    uint64_t interval_ns;
+    uint32_t stack_bytes; /* how far above SP to look for return addresses */
+    char *flat;
+    char *folded;
+
+    QEMUTimer *timer;
+    Notifier exit_notifier;
+    uint8_t *stack;
+    uint64_t samples;
+    /*
+     * Sample counts by call stack.  Keys are arrays of flash byte addresses,
+     * the sampled PC first followed by the call sites, innermost first.
+     */
+    GHashTable *stacks;
+} AVRProfiler;
+
+/* Is the instruction before word address @ret one that calls? */
+static bool avr_profiler_is_return(CPUState *cs, uint32_t ret)
+{
+    uint8_t buf[4];
+    uint16_t call;
+    uint16_t insn;
+
+    if (ret < 2) {
+        return false;
+    }
+    if (address_space_read(cs->as,
+                           OFFSET_CODE + (ret - 2) * 2,
+                           MEMTXATTRS_UNSPECIFIED, buf, 4) != MEMTX_OK) {
+        return false;
+    }
+    call = lduw_le_p(buf); /* first word of a 32 bit CALL */
+    insn = lduw_le_p(buf + 2);
+
+    return (call & 0xfe0e) == 0x940e ||
+           (insn & 0xf000) == 0xd000 || /* RCALL */
+           insn == 0x9509 || /* ICALL */
+           insn == 0x9519; /* EICALL */
+}
+
+/*
+ *  Copy up to stack_bytes of the stack of @cs to p->stack, as far as it is
+ *  RAM.  Reading MMIO could have side effects on the devices mapped there.
+ *  The rest is zeros, which are never taken for return addresses.
+ */
+static void avr_profiler_read_stack(AVRProfiler *p, CPUState *cs)
+{
+    hwaddr addr = OFFSET_DATA + AVR_CPU(cs)->env.sp + 1;
+    MemoryRegionSection section;
+    uint64_t size = 0;
+
+    section = memory_region_find(cs->as->root, addr, p->stack_bytes);
+    if (section.mr) {
+        if (memory_region_is_ram(section.mr) &&
+            section.offset_within_address_space == addr) {
+            size = int128_get64(section.size);
+        }
+        memory_region_unref(section.mr);
+    }
+
+    memset(p->stack, 0, p->stack_bytes);
+    if (size) {
+        address_space_read(cs->as, addr, MEMTXATTRS_UNSPECIFIED, p->stack,
+                           size);
+    }
+}
+
+static unsigned avr_profiler_unwind(AVRProfiler *p, CPUState *cs,
+                                    uint32_t *frames, unsigned max)
+{
+    CPUAVRState *env = &AVR_CPU(cs)->env;
+    unsigned pc_bytes = avr_feature(env, AVR_FEATURE_3_BYTE_PC) ? 3 : 2;
+    uint8_t *s = p->stack;
+    unsigned n = 0;
+    uint32_t ret;
+    uint32_t i;
+
+    avr_profiler_read_stack(p, cs);
+
+    /* Return addresses are pushed low byte first, so they read big endian */
+    for (i = 0; i + pc_bytes <= p->stack_bytes && n < max; ) {
+        if (pc_bytes == 3) {
+            ret = (s[i] << 16) | (s[i + 1] << 8) | s[i + 2];
+        } else {
+            ret = (s[i] << 8) | s[i + 1];
+        }
+        if (avr_profiler_is_return(cs, ret)) {
+            frames[n++] = (ret - 1) * 2;
+            i += pc_bytes;
+        } else {
+            i++;
+        }
+    }
+    return n;
+}
+
+/* Runs on the CPU thread between TBs, when pc_w is up to date */
+static void avr_profiler_sample(CPUState *cs, run_on_cpu_data data)
+{
+    AVRProfiler *p = data.host_ptr;
+    CPUAVRState *env = &AVR_CPU(cs)->env;
+    uint32_t frames[AVR_PROFILER_MAX_FRAMES];
+    unsigned n;
+    GBytes *key;
+    guint count;
+
+    frames[0] = env->pc_w * 2;
+    n = 1 + avr_profiler_unwind(p, cs, frames + 1,
+                                AVR_PROFILER_MAX_FRAMES - 1);
+
+    key = g_bytes_new(frames, n * sizeof(frames[0]));
+    count = GPOINTER_TO_UINT(g_hash_table_lookup(p->stacks, key));
+    g_hash_table_replace(p->stacks, key, GUINT_TO_POINTER(count + 1));
+    p->samples++;
+}
+
+static void avr_profiler_tick(void *opaque)
+{
+    AVRProfiler *p = opaque;
+
+    if (first_cpu && object_dynamic_cast(OBJECT(first_cpu), TYPE_AVR_CPU)) {
+        async_run_on_cpu(first_cpu, avr_profiler_sample,
+                         RUN_ON_CPU_HOST_PTR(p));
+    }
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                        p->interval_ns);
+}
+
+/* The caller frees the result */
+static char *avr_profiler_symbol(uint32_t addr)
+{
+    const char *name = lookup_symbol(addr);
+
+    if (name[0] == '\0') {
+        return g_strdup_printf("0x%05" PRIx32, addr);
+    }
+    return g_strdup(name);
+}
+
+typedef struct AVRProfilerEntry {
+    char *name;
+    guint count;
+} AVRProfilerEntry;
+
+static gint avr_profiler_compare(gconstpointer a, gconstpointer b)
+{
+    const AVRProfilerEntry *ea = a;
+    const AVRProfilerEntry *eb = b;
+
+    if (ea->count != eb->count) {
+        return ea->count < eb->count ? 1 : -1;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+static void avr_profiler_write_flat(AVRProfiler *p, FILE *f)
+{
+    GHashTable *by_name = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    GArray *entries = g_array_new(false, false, sizeof(AVRProfilerEntry));
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i;
+
+    g_hash_table_iter_init(&iter, p->stacks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const uint32_t *frames = g_bytes_get_data(key, NULL);
+        char *name = avr_profiler_symbol(frames[0]);
+        guint count = GPOINTER_TO_UINT(g_hash_table_lookup(by_name, name));
+
+        g_hash_table_replace(by_name, name,
+                             GUINT_TO_POINTER(count + GPOINTER_TO_UINT(value)));
+    }
+
+    g_hash_table_iter_init(&iter, by_name);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        AVRProfilerEntry e = { key, GPOINTER_TO_UINT(value) };
+
+        g_array_append_val(entries, e);
+    }
+    g_array_sort(entries, avr_profiler_compare);
+
+    fprintf(f, "# %" PRIu64 " samples, one every %" PRIu64 " ns\n",
+            p->samples, p->interval_ns);
+    fprintf(f, "#   self  samples  function\n");
+    for (i = 0; i < entries->len; i++) {
+        AVRProfilerEntry *e = &g_array_index(entries, AVRProfilerEntry, i);
+
+        fprintf(f, "%7.2f%% %8u  %s\n", 100.0 * e->count / p->samples,
+                e->count, e->name);
+    }
+
+    g_array_free(entries, true);
+    g_hash_table_destroy(by_name);
+}
+
+static void avr_profiler_write_folded(AVRProfiler *p, FILE *f)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, p->stacks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gsize size;
+        const uint32_t *frames = g_bytes_get_data(key, &size);
+        int i = size / sizeof(frames[0]);
+
+        while (i-- > 0) {
+            char *name = avr_profiler_symbol(frames[i]);
+
+            fprintf(f, "%s%c", name, i ? ';' : ' ');
+            g_free(name);
+        }
+        fprintf(f, "%u\n", GPOINTER_TO_UINT(value));
+    }
+}
+
+static void avr_profiler_write(AVRProfiler *p, const char *filename,
+                               void (*write)(AVRProfiler *p, FILE *f))
+{
+    FILE *f;
+
+    if (!filename) {
+        return;
+    }
+    f = fopen(filename, "w");
+    if (!f) {
+        error_report("avr-profiler: cannot open %s: %s", filename,
+                     strerror(errno));
+        return;
+    }
+    write(p, f);
+    if (fclose(f) != 0) {
+        error_report("avr-profiler: cannot write %s: %s", filename,
+                     strerror(errno));
+    }
+}
+
+static void avr_profiler_exit(Notifier *n, void *data)
+{
+    AVRProfiler *p = container_of(n, AVRProfiler, exit_notifier);
+
+    if (p->samples == 0) {
+        return;
+    }
+    avr_profiler_write(p, p->flat, avr_profiler_write_flat);
+    avr_profiler_write(p, p->folded, avr_profiler_write_folded);
+}
+
+static void avr_profiler_complete(UserCreatable *uc, Error **errp)
+{
+    AVRProfiler *p = AVR_PROFILER(uc);
+
+    if (!p->flat && !p->folded) {
+        error_setg(errp, "avr-profiler: set flat, folded or both");
+        return;
+    }
+    if (p->interval_ns == 0) {
+        error_setg(errp, "avr-profiler: interval must not be 0");
+        return;
+    }
+
+    p->stack = g_malloc(p->stack_bytes);
+    p->stacks = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+                                      (GDestroyNotify)g_bytes_unref, NULL);
+    p->exit_notifier.notify = avr_profiler_exit;
+    qemu_add_exit_notifier(&p->exit_notifier);
+
+    /* -object is created before the board, ticks look the CPU up */
+    p->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_profiler_tick, p);
+    timer_mod(p->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                        p->interval_ns);
+}
+
+static bool avr_profiler_can_be_deleted(UserCreatable *uc)
+{
+    return false; /* the samples are written at exit */
+}
+
+static char *avr_profiler_get_flat(Object *obj, Error **errp)
+{
+    return g_strdup(AVR_PROFILER(obj)->flat);
+}
+
+static void avr_profiler_set_flat(Object *obj, const char *value, Error **errp)
+{
+    AVRProfiler *p = AVR_PROFILER(obj);
+
+    g_free(p->flat);
+    p->flat = g_strdup(value);
+}
+
+static char *avr_profiler_get_folded(Object *obj, Error **errp)
+{
+    return g_strdup(AVR_PROFILER(obj)->folded);
+}
+
+static void avr_profiler_set_folded(Object *obj, const char *value,
+                                    Error **errp)
+{
+    AVRProfiler *p = AVR_PROFILER(obj);
+
+    g_free(p->folded);
+    p->folded = g_strdup(value);
+}
+
+static void avr_profiler_get_interval(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    visit_type_uint64(v, name, &AVR_PROFILER(obj)->interval_ns, errp);
+}
+
+static void avr_profiler_set_interval(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    visit_type_uint64(v, name, &AVR_PROFILER(obj)->interval_ns, errp);
+}
+
+static void avr_profiler_get_stack_bytes(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    visit_type_uint32(v, name, &AVR_PROFILER(obj)->stack_bytes, errp);
+}
+
+static void avr_profiler_set_stack_bytes(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    AVRProfiler *p = AVR_PROFILER(obj);
+
+    if (p->stack) {
+        error_setg(errp, "avr-profiler: stack-bytes can't be changed now");
+        return;
+    }
+    visit_type_uint32(v, name, &p->stack_bytes, errp);
+}
+
+static void avr_profiler_instance_init(Object *obj)
+{
+    AVRProfiler *p = AVR_PROFILER(obj);
+
+    p->interval_ns = 1000000; /* 1 kHz of virtual time */
+    p->stack_bytes = 256;
+}
+
+static void avr_profiler_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = avr_profiler_complete;
+    ucc->can_be_deleted = avr_profiler_can_be_deleted;
+
+    object_class_property_add_str(oc, "flat", avr_profiler_get_flat,
+                                  avr_profiler_set_flat, &error_abort);
+    object_class_property_add_str(oc, "folded", avr_profiler_get_folded,
+                                  avr_profiler_set_folded, &error_abort);
+    object_class_property_add(oc, "interval", "uint64",
+                              avr_profiler_get_interval,
+                              avr_profiler_set_interval,
+                              NULL, NULL, &error_abort);
+    object_class_property_add(oc, "stack-bytes", "uint32",
+                              avr_profiler_get_stack_bytes,
+                              avr_profiler_set_stack_bytes,
+                              NULL, NULL, &error_abort);
+}
+
+static const TypeInfo avr_profiler_info = {
+    .name = TYPE_AVR_PROFILER,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(AVRProfiler),
+    .instance_init = avr_profiler_instance_init,
+    .class_init = avr_profiler_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void avr_profiler_register_types(void)
+{
+    type_register_static(&avr_profiler_info);
+}
+
+type_init(avr_profiler_register_types)
@@ -22,7 +22,8 @@
  *  NOTE:
  *      This is not a real AVR board, this is an example!
  *      The CPU is an approximation of an ATmega2560, but is missing various
- *      built-in peripherals.
+ *      built-in peripherals.  Other parts can be described in a file given
+ *      with -machine sample,mcu=FILE, see include/hw/avr/mcu.h.
  *
  *      This example board loads provided binary file into flash memory and
  *      executes it from 0x00000000 address in the code memory space.
@@ -38,18 +39,26 @@
 #include "hw/hw.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
+#include "sysemu/blockdev.h"
 #include "ui/console.h"
 #include "hw/boards.h"
 #include "hw/loader.h"
 #include "qemu/error-report.h"
+#include "qemu/config-file.h"
+#include "qemu/option.h"
 #include "exec/address-spaces.h"
 #include "include/hw/sysbus.h"
 #include "include/hw/char/avr_usart.h"
+#include "include/hw/intc/avr_intc.h"
 #include "include/hw/timer/avr_timer16.h"
+#include "include/hw/nvram/avr_eeprom.h"
+#include "include/hw/watchdog/avr_wdt.h"
+#include "include/hw/gpio/avr_gpio.h"
+#include "include/hw/avr/snapshot.h"
+#include "include/hw/avr/mcu.h"
 #include "elf.h"
 
-#define SIZE_FLASH 0x00040000
-#define SIZE_SRAM 0x00002200
 /*
  * Size of additional "external" memory, as if the AVR were configured to use
  * an external RAM chip.
@@ -58,120 +67,393 @@
  */
 #define SIZE_EXMEM 0x00000000
 
-/* Offsets of periphals in emulated memory space (i.e. not host addresses)  */
-#define PRR0 0x64
-#define PRR1 0x65
-#define USART_BASE 0xc0
-#define USART_PRR PRR0
-#define USART_PRR_MASK 0b00000010
-#define TIMER1_BASE 0x80
-#define TIMER1_IMSK_BASE 0x6f
-#define TIMER1_IFR_BASE 0x36
-#define TIMER1_PRR PRR0
-#define TIMER1_PRR_MASK 0b01000000
-
-/* Interrupt numbers used by peripherals */
-#define TIMER1_CAPT_IRQ 15
-#define TIMER1_COMPA_IRQ 16
-#define TIMER1_COMPB_IRQ 17
-#define TIMER1_COMPC_IRQ 18
-#define TIMER1_OVF_IRQ 19
+#define TYPE_SAMPLE_MACHINE MACHINE_TYPE_NAME("sample")
+#define SAMPLE_MACHINE(obj) \
+    OBJECT_CHECK(SampleMachineState, (obj), TYPE_SAMPLE_MACHINE)
 
-static void sample_init(MachineState *machine)
+typedef struct {
+    /* <private> */
+    MachineState parent_obj;
+
+    /* <public> */
+    char *mcu;
+    /* Next serial port and -drive if=mtd to hand out */
+    int serial_index;
+    int mtd_index;
+} SampleMachineState;
+
+/*
+ * Map a peripheral's registers both into the system's address space and into
+ * the CPU's IO dispatch table, @addr is a data space address.
+ */
+static void sample_map_periph(AVRCPU *cpu, MemoryRegion *sysmem,
+                              SysBusDevice *busdev, int n, hwaddr addr)
+{
+    MemoryRegion *mr = sysbus_mmio_get_region(busdev, n);
+
+    memory_region_add_subregion(sysmem, OFFSET_DATA + addr, mr);
+    avr_cpu_map_io(cpu, addr, mr);
+}
+
+/* Name of a per-system object, the first system keeps the plain name */
+static char *sample_name(const char *name, int n)
+{
+    return n ? g_strdup_printf("%s%d", name, n) : g_strdup(name);
+}
+
+/* Load firmware (contents of flash) trying to auto-detect format */
+static void sample_load_firmware(const char *filename, AddressSpace *as,
+                                 uint32_t flash_size)
+{
+    int bytes_loaded;
+
+    bytes_loaded = load_elf_as(
+        filename, NULL, NULL, NULL, NULL, NULL, NULL, 0, EM_NONE, 0, 0, as);
+    if (bytes_loaded < 0) {
+        error_report(
+            "Unable to load %s as ELF, trying again as raw binary",
+            filename);
+        bytes_loaded = load_image_targphys_as(
+            filename, OFFSET_CODE, flash_size, as);
+    }
+    if (bytes_loaded < 0) {
+        error_report(
+            "Unable to load firmware image %s as ELF or raw binary",
+            filename);
+        exit(1);
+    }
+}
+
+/* The CPU and devices of one system, see sample_system_reset() */
+typedef struct {
+    AVRCPU *cpu;
+    GPtrArray *devices;
+} SampleSystem;
+
+/*
+ * Reset one system, its CPU and its devices.  The devices aren't on a bus,
+ * a machine reset resets each system with this.
+ */
+static void sample_system_reset(void *opaque)
 {
-    MemoryRegion *address_space_mem;
+    SampleSystem *sys = opaque;
+    guint i;
+
+    cpu_reset(CPU(sys->cpu));
+    for (i = 0; i < sys->devices->len; i++) {
+        device_reset(g_ptr_array_index(sys->devices, i));
+    }
+}
+
+static void sample_system_reset_work(CPUState *cs, run_on_cpu_data data)
+{
+    sample_system_reset(data.host_ptr);
+}
+
+/*
+ * AVR_WDT_RESET of a system's watchdog.  The other systems run on, so the
+ * system is reset by its own CPU, in between two TBs.
+ */
+static void sample_wdt_reset(void *opaque, int n, int level)
+{
+    SampleSystem *sys = opaque;
+
+    if (level) {
+        async_run_on_cpu(CPU(sys->cpu), sample_system_reset_work,
+                         RUN_ON_CPU_HOST_PTR(sys));
+    }
+}
+
+/* Number of interrupt acknowledge inputs of @dev, see avr_intc.h */
+static int sample_num_ack(DeviceState *dev)
+{
+    NamedGPIOList *ngl;
+
+    QLIST_FOREACH(ngl, &dev->gpios, node) {
+        if (ngl->name && !strcmp(ngl->name, AVR_INTC_ACK)) {
+            return ngl->num_in;
+        }
+    }
+    return 0;
+}
+
+/* Create a built-in peripheral of system @sys as @p describes it */
+static void sample_init_periph(SampleMachineState *sms, SampleSystem *sys,
+                               MemoryRegion *sysmem, AVRIntcState *intc,
+                               const AVRPeriphDesc *p)
+{
+    AVRCPU *cpu = sys->cpu;
+    ObjectClass *oc = object_class_by_name(p->type);
+    DeviceState *dev;
+    SysBusDevice *busdev;
+    DriveInfo *dinfo;
+    char **prop;
+    int i;
+
+    if (!oc || !object_class_dynamic_cast(oc, TYPE_SYS_BUS_DEVICE) ||
+        object_class_is_abstract(oc)) {
+        error_report("[%s]: %s isn't a sysbus device type", p->name, p->type);
+        exit(1);
+    }
+    dev = DEVICE(object_new(p->type));
+    busdev = SYS_BUS_DEVICE(dev);
+    for (prop = p->props; *prop; prop += 2) {
+        object_property_parse(OBJECT(dev), prop[1], prop[0], &error_fatal);
+    }
+
+    if (object_dynamic_cast(OBJECT(dev), TYPE_AVR_USART)) {
+        AVRUsartState *usart = AVR_USART(dev);
+
+        usart->prr_address = OFFSET_DATA + p->prr_address;
+        usart->prr_mask = p->prr_mask;
+        usart->prr_as = CPU(cpu)->as;
+        qdev_prop_set_chr(dev, "chardev", serial_hd(sms->serial_index++));
+    } else if (object_dynamic_cast(OBJECT(dev), TYPE_AVR_TIMER16)) {
+        AVRTimer16State *timer = AVR_TIMER16(dev);
+
+        timer->prr_address = OFFSET_DATA + p->prr_address;
+        timer->prr_mask = p->prr_mask;
+    } else if (object_dynamic_cast(OBJECT(dev), TYPE_AVR_EEPROM)) {
+        /* Kept in -drive if=mtd,index=n,format=raw if there is one */
+        dinfo = drive_get(IF_MTD, 0, sms->mtd_index++);
+        if (dinfo) {
+            qdev_prop_set_drive(dev, "drive", blk_by_legacy_dinfo(dinfo),
+                                &error_fatal);
+        }
+    } else if (object_dynamic_cast(OBJECT(dev), TYPE_AVR_WDT)) {
+        /* Its own system's CPU, where WDR leaves its mark */
+        object_property_set_link(OBJECT(dev), OBJECT(cpu), "cpu",
+                                 &error_fatal);
+        qdev_connect_gpio_out_named(dev, AVR_WDT_RESET, 0,
+                                    qemu_allocate_irq(sample_wdt_reset,
+                                                      sys, 0));
+    }
+    object_property_set_bool(OBJECT(dev), true, "realized", &error_fatal);
+    g_ptr_array_add(sys->devices, dev);
+
+    if (p->num_base > busdev->num_mmio) {
+        error_report("[%s]: %s has %d MMIO regions", p->name, p->type,
+                     busdev->num_mmio);
+        exit(1);
+    }
+    for (i = 0; i < p->num_base; i++) {
+        sample_map_periph(cpu, sysmem, busdev, i, p->base[i]);
+    }
+    for (i = 0; i < p->num_irq; i++) {
+        if (!sysbus_has_irq(busdev, i)) {
+            error_report("[%s]: %s has %d IRQs", p->name, p->type, i);
+            exit(1);
+        }
+        sysbus_connect_irq(busdev, i,
+                           qdev_get_gpio_in(DEVICE(intc), p->irq[i]));
+        if (i < sample_num_ack(dev)) {
+            qdev_connect_gpio_out_named(DEVICE(intc), AVR_INTC_ACK, p->irq[i],
+                qdev_get_gpio_in_named(dev, AVR_INTC_ACK, i));
+        }
+    }
+}
+
+/*
+ * Create AVR system @n: a CPU, its memories and its peripherals.
+ *
+ * With -smp N the board is N independent systems that share nothing but the
+ * QEMU process and its translator, each running on a thread of its own
+ * under MTTCG.  Each system's USARTs take the next serial ports, and the
+ * firmware is loaded into all of them; -device loader,cpu-num=n,file=...
+ * gives one a different one.  Only the first system lives in the system
+ * address space, which is what the monitor looks at.  A watchdog reset
+ * resets its own system only, a machine reset all of them.
+ *
+ * Peripheral accesses and timers run under the BQL, so firmware that spends
+ * its time in IO registers doesn't scale with N.  -icount is refused: its
+ * instruction counter, and so the virtual clock, would be shared by all
+ * systems.
+ */
+static void sample_init_system(SampleMachineState *sms, int n,
+                               const AVRMcuDesc *desc, const char *filename)
+{
+    MachineState *machine = MACHINE(sms);
+    MemoryRegion *sysmem;
     MemoryRegion *ram;
     MemoryRegion *flash;
     AVRCPU *cpu_avr;
-    const char *firmware = NULL;
-    const char *filename;
-    int bytes_loaded;
-    AVRUsartState *usart0;
-    AVRTimer16State *timer1;
-    SysBusDevice *busdev;
+    AVRIntcState *intc;
+    SampleSystem *sys;
+    AddressSpace *as;
+    char *name;
+    int i;
 
-    address_space_mem = get_system_memory();
     ram = g_new(MemoryRegion, 1);
     flash = g_new(MemoryRegion, 1);
 
-    /* ATmega2560. */
-    cpu_avr = AVR_CPU(cpu_create("avr6-avr"));
+    if (n == 0) {
+        sysmem = get_system_memory();
+        memory_region_allocate_system_memory(
+            ram, NULL, "avr.ram", desc->sram_size + SIZE_EXMEM);
+    } else {
+        sysmem = g_new(MemoryRegion, 1);
+        name = sample_name("avr.system", n);
+        memory_region_init(sysmem, OBJECT(machine), name, UINT64_MAX);
+        g_free(name);
+        name = sample_name("avr.ram", n);
+        memory_region_init_ram(ram, NULL, name, desc->sram_size + SIZE_EXMEM,
+                               &error_fatal);
+        g_free(name);
+    }
+    memory_region_add_subregion(sysmem, OFFSET_DATA, ram);
 
-    memory_region_allocate_system_memory(
-        ram, NULL, "avr.ram", SIZE_SRAM + SIZE_EXMEM);
-    memory_region_add_subregion(address_space_mem, OFFSET_DATA, ram);
+    name = sample_name("avr.flash", n);
+    memory_region_init_rom(flash, NULL, name, desc->flash_size, &error_fatal);
+    memory_region_add_subregion(sysmem, OFFSET_CODE, flash);
+    g_free(name);
 
-    memory_region_init_rom(flash, NULL, "avr.flash", SIZE_FLASH, &error_fatal);
-    memory_region_add_subregion(address_space_mem, OFFSET_CODE, flash);
+    name = g_strdup_printf(AVR_CPU_TYPE_NAME("%s"), desc->cpu_type);
+    if (!object_class_by_name(name)) {
+        error_report("Unknown AVR CPU model %s", desc->cpu_type);
+        exit(1);
+    }
+    cpu_avr = AVR_CPU(object_new(name));
+    g_free(name);
+    object_property_set_link(OBJECT(cpu_avr), OBJECT(sysmem), "memory",
+                             &error_abort);
+    object_property_set_bool(OBJECT(cpu_avr), true, "realized", &error_fatal);
+    as = CPU(cpu_avr)->as;
+
+    sys = g_new0(SampleSystem, 1);
+    sys->cpu = cpu_avr;
+    sys->devices = g_ptr_array_new();
+    qemu_register_reset(sample_system_reset, sys);
+
+    /*
+     * SRAM and the flash SPM can write to go in avr-snapshot-save.  That
+     * stops the first CPU only, the others would run on while it is taken.
+     */
+    if (smp_cpus == 1) {
+        avr_snapshot_add_memory(ram);
+        avr_snapshot_add_memory(flash);
+    }
+
+    /* Interrupt controller, its statistics are at /machine/intc */
+    intc = AVR_INTC(object_new(TYPE_AVR_INTC));
+    name = sample_name("intc", n);
+    object_property_add_child(OBJECT(machine), name, OBJECT(intc),
+                              &error_fatal);
+    g_free(name);
+    object_property_set_link(OBJECT(intc), OBJECT(cpu_avr), "cpu",
+                             &error_fatal);
+    qdev_prop_set_uint32(DEVICE(intc), "num-irq", desc->num_irq);
+    object_property_set_bool(OBJECT(intc), true, "realized", &error_fatal);
+    g_ptr_array_add(sys->devices, intc);
 
-    /* USART 0 built-in peripheral */
-    usart0 = AVR_USART(object_new(TYPE_AVR_USART));
-    busdev = SYS_BUS_DEVICE(usart0);
-    sysbus_mmio_map(busdev, 0, OFFSET_DATA + USART_BASE);
     /*
-     * These IRQ numbers don't match the datasheet because we're counting from
-     * zero and not including reset.
+     * Built-in peripherals, -global avr-gpio.chardev=ID streams the pin
+     * changes of the GPIO ports when there is a single system
      */
-    sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(DEVICE(cpu_avr), 24));
-    sysbus_connect_irq(busdev, 1, qdev_get_gpio_in(DEVICE(cpu_avr), 25));
-    sysbus_connect_irq(busdev, 2, qdev_get_gpio_in(DEVICE(cpu_avr), 26));
-    usart0->prr_address = OFFSET_DATA + PRR0;
-    usart0->prr_mask = USART_PRR_MASK;
-    qdev_prop_set_chr(DEVICE(usart0), "chardev", serial_hd(0));
-    object_property_set_bool(OBJECT(usart0), true, "realized", &error_fatal);
-
-    /* Timer 1 built-in periphal */
-    timer1 = AVR_TIMER16(object_new(TYPE_AVR_TIMER16));
-    busdev = SYS_BUS_DEVICE(timer1);
-    sysbus_mmio_map(busdev, 0, OFFSET_DATA + TIMER1_BASE);
-    sysbus_mmio_map(busdev, 1, OFFSET_DATA + TIMER1_IMSK_BASE);
-    sysbus_mmio_map(busdev, 2, OFFSET_DATA + TIMER1_IFR_BASE);
-    sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(
-        DEVICE(cpu_avr), TIMER1_CAPT_IRQ));
-    sysbus_connect_irq(busdev, 1, qdev_get_gpio_in(
-        DEVICE(cpu_avr), TIMER1_COMPA_IRQ));
-    sysbus_connect_irq(busdev, 2, qdev_get_gpio_in(
-        DEVICE(cpu_avr), TIMER1_COMPB_IRQ));
-    sysbus_connect_irq(busdev, 3, qdev_get_gpio_in(
-        DEVICE(cpu_avr), TIMER1_COMPC_IRQ));
-    sysbus_connect_irq(busdev, 4, qdev_get_gpio_in(
-        DEVICE(cpu_avr), TIMER1_OVF_IRQ));
-    timer1->prr_address = OFFSET_DATA + TIMER1_PRR;
-    timer1->prr_mask = TIMER1_PRR_MASK;
-    object_property_set_bool(OBJECT(timer1), true, "realized", &error_fatal);
-
-    /* Load firmware (contents of flash) trying to auto-detect format */
-    firmware = machine->firmware;
+    for (i = 0; i < desc->num_periph; i++) {
+        sample_init_periph(sms, sys, sysmem, intc, &desc->periph[i]);
+    }
+
+    if (filename) {
+        sample_load_firmware(filename, as, desc->flash_size);
+    }
+}
+
+static int sample_is_gpio_chardev(void *opaque, QemuOpts *opts,
+                                  Error **errp)
+{
+    const char *driver = qemu_opt_get(opts, "driver");
+    const char *property = qemu_opt_get(opts, "property");
+
+    return driver && property && !strcmp(driver, TYPE_AVR_GPIO) &&
+           !strcmp(property, "chardev");
+}
+
+static void sample_init(MachineState *machine)
+{
+    SampleMachineState *sms = SAMPLE_MACHINE(machine);
+    const char *firmware = machine->firmware;
+    const char *filename = NULL;
+    const char *mcu = NULL;
+    const AVRMcuDesc *desc;
+    int n;
+
     if (firmware != NULL) {
         filename = qemu_find_file(QEMU_FILE_TYPE_BIOS, firmware);
         if (filename == NULL) {
             error_report("Unable to find %s", firmware);
             exit(1);
         }
+    }
 
-        bytes_loaded = load_elf(
-            filename, NULL, NULL, NULL, NULL, NULL, NULL, 0, EM_NONE, 0, 0);
-        if (bytes_loaded < 0) {
-            error_report(
-                "Unable to load %s as ELF, trying again as raw binary",
-                firmware);
-            bytes_loaded = load_image_targphys(
-                filename, OFFSET_CODE, SIZE_FLASH);
-        }
-        if (bytes_loaded < 0) {
-            error_report(
-                "Unable to load firmware image %s as ELF or raw binary",
-                firmware);
+    if (sms->mcu) {
+        mcu = qemu_find_file(QEMU_FILE_TYPE_BIOS, sms->mcu);
+        if (mcu == NULL) {
+            error_report("Unable to find %s", sms->mcu);
             exit(1);
         }
     }
+    desc = avr_mcu_desc_get(mcu, &error_fatal);
+
+    /* -global sets the property of every system's ports alike */
+    if (smp_cpus > 1 &&
+        qemu_opts_foreach(qemu_find_opts("global"), sample_is_gpio_chardev,
+                          NULL, NULL)) {
+        error_report("-global %s.chardev can't be used with -smp, the "
+                     "systems would share the chardev", TYPE_AVR_GPIO);
+        exit(1);
+    }
+
+    /* One virtual clock would follow the instructions of every system */
+    if (smp_cpus > 1 && use_icount) {
+        error_report("-icount can't be used with -smp, the systems would "
+                     "share one virtual clock");
+        exit(1);
+    }
+
+    for (n = 0; n < smp_cpus; n++) {
+        sample_init_system(sms, n, desc, filename);
+    }
 }
 
-static void sample_machine_init(MachineClass *mc)
+static char *sample_get_mcu(Object *obj, Error **errp)
 {
+    return g_strdup(SAMPLE_MACHINE(obj)->mcu);
+}
+
+static void sample_set_mcu(Object *obj, const char *value, Error **errp)
+{
+    SampleMachineState *sms = SAMPLE_MACHINE(obj);
+
+    g_free(sms->mcu);
+    sms->mcu = g_strdup(value);
+}
+
+static void sample_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "AVR sample/example board";
     mc->init = sample_init;
     mc->is_default = 1;
+    mc->max_cpus = 64;
+
+    object_class_property_add_str(oc, "mcu", sample_get_mcu, sample_set_mcu,
+                                  &error_abort);
+    object_class_property_set_description(oc, "mcu",
+        "File describing the AVR part, the built-in one is an ATmega2560",
+        &error_abort);
+}
+
+static const TypeInfo sample_info = {
+    .name          = TYPE_SAMPLE_MACHINE,
+    .parent        = TYPE_MACHINE,
+    .instance_size = sizeof(SampleMachineState),
+    .class_init    = sample_class_init,
+};
+
+static void sample_machine_register_types(void)
+{
+    type_register_static(&sample_info);
 }
 
-DEFINE_MACHINE("sample", sample_machine_init)
+type_init(sample_machine_register_types)
@@ -0,0 +1,275 @@
+/*
+ * AVR in-process machine snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  The CPU and device state goes through their VMStateDescriptions into a
+ *  buffer, the same as for migration, which is a few hundred bytes for an
+ *  AVR.  Memory is the bulk of the machine, so the board's regions are dirty
+ *  logged and a load copies back only the TARGET_PAGE_SIZE pages that were
+ *  written since.  Flash pages copied back have their translation blocks
+ *  invalidated, everything else stays translated.
+ *
+ *  QEMU_CLOCK_VIRTUAL isn't part of the snapshot and keeps going, devices
+ *  rebase their timers on it in their post_load hooks.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-target.h"
+#include "qemu/error-report.h"
+#include "qom/cpu.h"
+#include "hw/qdev-core.h"
+#include "hw/avr/snapshot.h"
+#include "exec/ram_addr.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file.h"
+
+typedef struct AVRSnapshotMemory {
+    MemoryRegion *mr;
+    uint8_t *data; /* contents when the snapshot was saved */
+} AVRSnapshotMemory;
+
+typedef struct AVRSnapshotState {
+    const VMStateDescription *vmsd;
+    void *opaque;
+} AVRSnapshotState;
+
+static struct {
+    GArray *memory; /* of AVRSnapshotMemory */
+    GArray *state; /* of AVRSnapshotState, in the order they were saved */
+    GByteArray *buf; /* their migration state */
+    bool valid;
+} avr_snapshot;
+
+void avr_snapshot_add_memory(MemoryRegion *mr)
+{
+    AVRSnapshotMemory m = {
+        .mr = mr,
+        .data = g_malloc(memory_region_size(mr)),
+    };
+
+    if (!avr_snapshot.memory) {
+        avr_snapshot.memory = g_array_new(false, false,
+                                          sizeof(AVRSnapshotMemory));
+        avr_snapshot.state = g_array_new(false, false,
+                                         sizeof(AVRSnapshotState));
+        avr_snapshot.buf = g_byte_array_new();
+    }
+    g_array_append_val(avr_snapshot.memory, m);
+    memory_region_set_log(mr, true, DIRTY_MEMORY_VGA);
+}
+
+static ssize_t avr_snapshot_get_buffer(void *opaque, uint8_t *buf,
+                                       int64_t pos, size_t size)
+{
+    GByteArray *data = opaque;
+
+    if (pos >= data->len) {
+        return 0;
+    }
+    size = MIN(size, data->len - pos);
+    memcpy(buf, data->data + pos, size);
+    return size;
+}
+
+static ssize_t avr_snapshot_writev_buffer(void *opaque, struct iovec *iov,
+                                          int iovcnt, int64_t pos)
+{
+    GByteArray *data = opaque;
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        g_byte_array_append(data, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static const QEMUFileOps avr_snapshot_read_ops = {
+    .get_buffer = avr_snapshot_get_buffer,
+};
+
+static const QEMUFileOps avr_snapshot_write_ops = {
+    .writev_buffer = avr_snapshot_writev_buffer,
+};
+
+static void avr_snapshot_add_state(const VMStateDescription *vmsd,
+                                   void *opaque)
+{
+    AVRSnapshotState s = {
+        .vmsd = vmsd,
+        .opaque = opaque,
+    };
+
+    g_array_append_val(avr_snapshot.state, s);
+}
+
+static int avr_snapshot_add_device(Object *obj, void *opaque)
+{
+    DeviceState *dev = (DeviceState *)object_dynamic_cast(obj, TYPE_DEVICE);
+    const VMStateDescription *vmsd;
+
+    /* CPUs are done first, with the common state cpu_exec_realizefn adds */
+    if (!dev || !dev->realized || object_dynamic_cast(obj, TYPE_CPU)) {
+        return 0;
+    }
+    vmsd = qdev_get_vmsd(dev);
+    if (vmsd && !vmsd->unmigratable) {
+        avr_snapshot_add_state(vmsd, dev);
+    }
+    return 0;
+}
+
+static void avr_snapshot_collect_state(void)
+{
+    CPUState *cs;
+
+    g_array_set_size(avr_snapshot.state, 0);
+    CPU_FOREACH(cs) {
+        CPUClass *cc = CPU_GET_CLASS(cs);
+
+        if (qdev_get_vmsd(DEVICE(cs))) {
+            avr_snapshot_add_state(qdev_get_vmsd(DEVICE(cs)), cs);
+        } else {
+            avr_snapshot_add_state(&vmstate_cpu_common, cs);
+        }
+        if (cc->vmsd) {
+            avr_snapshot_add_state(cc->vmsd, cs);
+        }
+    }
+    object_child_foreach_recursive(qdev_get_machine(),
+                                   avr_snapshot_add_device, NULL);
+}
+
+/*
+ *  Copy back the pages of @m written since the last save or load.  Most of
+ *  them are RAM, but translations of any flash page the firmware changed
+ *  with SPM are out of date.
+ */
+static void avr_snapshot_restore_memory(AVRSnapshotMemory *m)
+{
+    MemoryRegion *mr = m->mr;
+    uint64_t size = memory_region_size(mr);
+    uint8_t *host = memory_region_get_ram_ptr(mr);
+    ram_addr_t ram_addr = memory_region_get_ram_addr(mr);
+    DirtyBitmapSnapshot *snap;
+    hwaddr addr;
+    hwaddr len;
+
+    snap = memory_region_snapshot_and_clear_dirty(mr, 0, size,
+                                                  DIRTY_MEMORY_VGA);
+    for (addr = 0; addr < size; addr += TARGET_PAGE_SIZE) {
+        len = MIN(TARGET_PAGE_SIZE, size - addr);
+        if (!memory_region_snapshot_get_dirty(mr, snap, addr, len)) {
+            continue;
+        }
+        memcpy(host + addr, m->data + addr, len);
+        if (memory_region_is_rom(mr)) {
+            tb_invalidate_phys_range(ram_addr + addr, ram_addr + addr + len);
+        }
+    }
+    g_free(snap);
+}
+
+/* Both run on the first CPU's thread, so its state is between two TBs */
+static void avr_snapshot_do_save(CPUState *cs, run_on_cpu_data data)
+{
+    Error **errp = data.host_ptr;
+    AVRSnapshotState *s;
+    AVRSnapshotMemory *m;
+    QEMUFile *f;
+    int ret = 0;
+    int i;
+
+    avr_snapshot.valid = false;
+    for (i = 0; i < avr_snapshot.memory->len; i++) {
+        m = &g_array_index(avr_snapshot.memory, AVRSnapshotMemory, i);
+        memcpy(m->data, memory_region_get_ram_ptr(m->mr),
+               memory_region_size(m->mr));
+        memory_region_reset_dirty(m->mr, 0, memory_region_size(m->mr),
+                                  DIRTY_MEMORY_VGA);
+    }
+
+    avr_snapshot_collect_state();
+    g_byte_array_set_size(avr_snapshot.buf, 0);
+    f = qemu_fopen_ops(avr_snapshot.buf, &avr_snapshot_write_ops);
+    for (i = 0; i < avr_snapshot.state->len && ret == 0; i++) {
+        s = &g_array_index(avr_snapshot.state, AVRSnapshotState, i);
+        ret = vmstate_save_state(f, s->vmsd, s->opaque, NULL);
+        if (ret) {
+            error_setg(errp, "Failed to save %s state", s->vmsd->name);
+        }
+    }
+    if (qemu_fclose(f) < 0 && ret == 0) {
+        error_setg(errp, "Failed to save the machine state");
+        ret = -1;
+    }
+    avr_snapshot.valid = ret == 0;
+}
+
+static void avr_snapshot_do_load(CPUState *cs, run_on_cpu_data data)
+{
+    Error **errp = data.host_ptr;
+    AVRSnapshotState *s;
+    QEMUFile *f;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < avr_snapshot.memory->len; i++) {
+        avr_snapshot_restore_memory(&g_array_index(avr_snapshot.memory,
+                                                   AVRSnapshotMemory, i));
+    }
+
+    f = qemu_fopen_ops(avr_snapshot.buf, &avr_snapshot_read_ops);
+    for (i = 0; i < avr_snapshot.state->len && ret == 0; i++) {
+        s = &g_array_index(avr_snapshot.state, AVRSnapshotState, i);
+        ret = vmstate_load_state(f, s->vmsd, s->opaque, s->vmsd->version_id);
+        if (ret) {
+            error_setg(errp, "Failed to load %s state", s->vmsd->name);
+        }
+    }
+    qemu_fclose(f);
+}
+
+void qmp_avr_snapshot_save(Error **errp)
+{
+    if (!avr_snapshot.memory) {
+        error_setg(errp, "The machine doesn't support snapshots");
+        return;
+    }
+    run_on_cpu(first_cpu, avr_snapshot_do_save, RUN_ON_CPU_HOST_PTR(errp));
+}
+
+void qmp_avr_snapshot_load(Error **errp)
+{
+    if (!avr_snapshot.valid) {
+        error_setg(errp, "No snapshot has been saved");
+        return;
+    }
+    run_on_cpu(first_cpu, avr_snapshot_do_load, RUN_ON_CPU_HOST_PTR(errp));
+}
+
+void hmp_avr_snapshot_save(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_avr_snapshot_save(&err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+void hmp_avr_snapshot_load(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_avr_snapshot_load(&err);
+    if (err) {
+        error_report_err(err);
+    }
+}
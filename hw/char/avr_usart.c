@@ -24,30 +24,100 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "hw/char/avr_usart.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
+#include "exec/address-spaces.h"
+
+/* Time it takes to shift a whole frame in or out at the current baud rate */
+static int64_t avr_usart_frame_ns(AVRUsartState *usart)
+{
+    uint32_t ubrr = (usart->brrh << 8) | usart->brrl;
+    uint32_t bits = 1 + ctpop8(usart->char_mask);
+
+    bits += (usart->csrc & USART_CSRC_PM1) ? 1 : 0;
+    bits += (usart->csrc & USART_CSRC_USBS) ? 2 : 1;
+    bits *= (usart->csra & USART_CSRA_U2X) ? 8 : 16;
+
+    return muldiv64((uint64_t)bits * (ubrr + 1), NANOSECONDS_PER_SECOND,
+                    usart->cpu_freq_hz);
+}
+
+/* Move the next received character into UDR once the line has caught up */
+static void avr_usart_rx_update(AVRUsartState *usart)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (usart->data_valid || fifo8_is_empty(&usart->rx_fifo)) {
+        return;
+    }
+    if (now < usart->rx_next_ns) {
+        timer_mod(usart->rx_timer, usart->rx_next_ns);
+        return;
+    }
+
+    usart->data = fifo8_pop(&usart->rx_fifo);
+    usart->data_valid = true;
+    usart->rx_next_ns = now + avr_usart_frame_ns(usart);
+    usart->csra |= USART_CSRA_RXC;
+    if (usart->csrb & USART_CSRB_RXCIE) {
+        qemu_set_irq(usart->rxc_irq, 1);
+    }
+    qemu_chr_fe_accept_input(&usart->chr);
+}
+
+static void avr_usart_rx_timer(void *opaque)
+{
+    avr_usart_rx_update(opaque);
+}
+
+/* Hand everything written so far to the chardev in one go */
+static void avr_usart_tx_flush(AVRUsartState *usart)
+{
+    const uint8_t *buf;
+    uint32_t len;
+
+    while (!fifo8_is_empty(&usart->tx_fifo)) {
+        buf = fifo8_pop_buf(&usart->tx_fifo,
+                            fifo8_num_used(&usart->tx_fifo), &len);
+        qemu_chr_fe_write_all(&usart->chr, buf, len);
+    }
+}
+
+static void avr_usart_tx_timer(void *opaque)
+{
+    AVRUsartState *usart = opaque;
+
+    avr_usart_tx_flush(usart);
+
+    usart->csra |= USART_CSRA_DRE;
+    if (usart->csrb & USART_CSRB_DREIE) {
+        qemu_set_irq(usart->dre_irq, 1);
+    }
+    usart->csra |= USART_CSRA_TXC;
+    if (usart->csrb & USART_CSRB_TXCIE) {
+        qemu_set_irq(usart->txc_irq, 1);
+        usart->csra &= 0xff ^ USART_CSRA_TXC;
+    }
+}
 
 static int avr_usart_can_receive(void *opaque)
 {
     AVRUsartState *usart = opaque;
 
-    if (usart->data_valid || !(usart->csrb & USART_CSRB_RXEN)) {
+    if (!(usart->csrb & USART_CSRB_RXEN)) {
         return 0;
     }
-    return 1;
+    return fifo8_num_free(&usart->rx_fifo);
 }
 
 static void avr_usart_receive(void *opaque, const uint8_t *buffer, int size)
 {
     AVRUsartState *usart = opaque;
-    assert(size == 1);
-    assert(!usart->data_valid);
-    usart->data = buffer[0];
-    usart->data_valid = true;
-    usart->csra |= USART_CSRA_RXC;
-    if (usart->csrb & USART_CSRB_RXCIE) {
-        qemu_set_irq(usart->rxc_irq, 1);
-    }
+
+    fifo8_push_all(&usart->rx_fifo, buffer, size);
+    avr_usart_rx_update(usart);
 }
 
 static void update_char_mask(AVRUsartState *usart)
@@ -95,6 +165,16 @@ static void avr_usart_reset(DeviceState *dev)
 {
     AVRUsartState *usart = AVR_USART(dev);
     usart->data_valid = false;
+    fifo8_reset(&usart->rx_fifo);
+    /*
+     * Characters written before the reset would mostly have been shifted
+     * out by now, it is only the model that holds on to them
+     */
+    avr_usart_tx_flush(usart);
+    timer_del(usart->rx_timer);
+    timer_del(usart->tx_timer);
+    usart->rx_next_ns = 0;
+    usart->tx_end_ns = 0;
     usart->csra = 0b00100000;
     usart->csrb = 0b00000000;
     usart->csrc = 0b00000110;
@@ -106,6 +186,15 @@ static void avr_usart_reset(DeviceState *dev)
     qemu_set_irq(usart->dre_irq, 0);
 }
 
+static uint8_t avr_usart_read_prr(AVRUsartState *usart)
+{
+    uint8_t prr = 0;
+
+    address_space_read(usart->prr_as ? usart->prr_as : &address_space_memory,
+                       usart->prr_address, MEMTXATTRS_UNSPECIFIED, &prr, 1);
+    return prr;
+}
+
 static uint64_t avr_usart_read(void *opaque, hwaddr addr, unsigned int size)
 {
     AVRUsartState *usart = opaque;
@@ -113,7 +202,7 @@ static uint64_t avr_usart_read(void *opaque, hwaddr addr, unsigned int size)
     uint8_t data;
     assert(size == 1);
 
-    cpu_physical_memory_read(usart->prr_address, &prr, 1);
+    prr = avr_usart_read_prr(usart);
     if (prr & usart->prr_mask) {
         /* USART disabled, ignore. */
         avr_usart_reset(DEVICE(usart));
@@ -134,7 +223,7 @@ static uint64_t avr_usart_read(void *opaque, hwaddr addr, unsigned int size)
         }
         usart->csra &= 0xff ^ USART_CSRA_RXC;
         qemu_set_irq(usart->rxc_irq, 0);
-        qemu_chr_fe_accept_input(&usart->chr);
+        avr_usart_rx_update(usart);
         return data;
     case USART_CSRA:
         return usart->csra;
@@ -161,12 +250,12 @@ static void avr_usart_write(void *opaque, hwaddr addr, uint64_t value,
 {
     AVRUsartState *usart = opaque;
     uint8_t mask;
-    uint8_t data;
+    int64_t now;
     assert((value & 0xff) == value);
     assert(size == 1);
 
     uint8_t prr;
-    cpu_physical_memory_read(usart->prr_address, &prr, 1);
+    prr = avr_usart_read_prr(usart);
     if (prr & usart->prr_mask) {
         /* USART disabled, ignore. */
         avr_usart_reset(DEVICE(usart));
@@ -179,17 +268,27 @@ static void avr_usart_write(void *opaque, hwaddr addr, uint64_t value,
             /* Transmitter disabled, ignore. */
             return;
         }
-        usart->csra |= USART_CSRA_TXC;
-        usart->csra |= USART_CSRA_DRE;
-        if (usart->csrb & USART_CSRB_TXCIE) {
-            qemu_set_irq(usart->txc_irq, 1);
-            usart->csra &= 0xff ^ USART_CSRA_TXC;
+        if (fifo8_is_full(&usart->tx_fifo)) {
+            /* Firmware that doesn't wait for DRE, send it all right away */
+            avr_usart_tx_flush(usart);
         }
-        if (usart->csrb & USART_CSRB_DREIE) {
+        fifo8_push(&usart->tx_fifo, value);
+
+        /*
+         * The FIFO is sent on when its last character would have been
+         * shifted out, so the chardev sees one write per FIFO full.
+         */
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        usart->tx_end_ns = MAX(now, usart->tx_end_ns) +
+                           avr_usart_frame_ns(usart);
+        timer_mod(usart->tx_timer, usart->tx_end_ns);
+
+        if (fifo8_is_full(&usart->tx_fifo)) {
+            usart->csra &= 0xff ^ USART_CSRA_DRE;
+            qemu_set_irq(usart->dre_irq, 0);
+        } else if (usart->csrb & USART_CSRB_DREIE) {
             qemu_set_irq(usart->dre_irq, 1);
         }
-        data = value;
-        qemu_chr_fe_write_all(&usart->chr, &data, 1);
         break;
     case USART_CSRA:
         mask = 0b01000011;
@@ -215,6 +314,10 @@ static void avr_usart_write(void *opaque, hwaddr addr, uint64_t value,
         if (!(value & USART_CSRB_RXEN)) {
             /* Receiver disabled, flush input buffer. */
             usart->data_valid = false;
+            fifo8_reset(&usart->rx_fifo);
+            timer_del(usart->rx_timer);
+        } else {
+            qemu_chr_fe_accept_input(&usart->chr);
         }
         qemu_set_irq(usart->rxc_irq,
             ((value & USART_CSRB_RXCIE) &&
@@ -269,6 +372,10 @@ static const MemoryRegionOps avr_usart_ops = {
 
 static Property avr_usart_properties[] = {
     DEFINE_PROP_CHR("chardev", AVRUsartState, chr),
+    DEFINE_PROP_UINT32("rx-fifo-size", AVRUsartState, rx_fifo_size, 16),
+    DEFINE_PROP_UINT32("tx-fifo-size", AVRUsartState, tx_fifo_size, 16),
+    DEFINE_PROP_UINT64("cpu-frequency-hz", AVRUsartState, cpu_freq_hz,
+                       20000000),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -285,19 +392,104 @@ static void avr_usart_init(Object *obj)
 static void avr_usart_realize(DeviceState *dev, Error **errp)
 {
     AVRUsartState *s = AVR_USART(dev);
+
+    if (s->rx_fifo_size == 0 || s->tx_fifo_size == 0) {
+        error_setg(errp, "FIFO sizes must be at least 1");
+        return;
+    }
+    if (s->cpu_freq_hz == 0 || s->cpu_freq_hz > UINT32_MAX) {
+        error_setg(errp, "cpu-frequency-hz out of range");
+        return;
+    }
+    fifo8_create(&s->rx_fifo, s->rx_fifo_size);
+    fifo8_create(&s->tx_fifo, s->tx_fifo_size);
+    s->rx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_usart_rx_timer, s);
+    s->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_usart_tx_timer, s);
     qemu_chr_fe_set_handlers(&s->chr, avr_usart_can_receive,
                              avr_usart_receive, NULL, NULL,
                              s, NULL, true);
     avr_usart_reset(dev);
 }
 
+static void avr_usart_unrealize(DeviceState *dev, Error **errp)
+{
+    AVRUsartState *s = AVR_USART(dev);
+
+    timer_del(s->rx_timer);
+    timer_free(s->rx_timer);
+    timer_del(s->tx_timer);
+    timer_free(s->tx_timer);
+    fifo8_destroy(&s->rx_fifo);
+    fifo8_destroy(&s->tx_fifo);
+}
+
+static int avr_usart_pre_save(void *opaque)
+{
+    AVRUsartState *usart = opaque;
+
+    usart->saved_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    return 0;
+}
+
+/*
+ * Snapshots can be restored while the virtual clock runs on, keep the
+ * characters in flight the same distance from now as when they were saved.
+ * Both timers are only pending while their FIFO has something to move.
+ */
+static int avr_usart_post_load(void *opaque, int version_id)
+{
+    AVRUsartState *usart = opaque;
+    int64_t shift = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - usart->saved_ns;
+
+    usart->rx_next_ns += shift;
+    usart->tx_end_ns += shift;
+
+    if (!usart->data_valid && !fifo8_is_empty(&usart->rx_fifo)) {
+        timer_mod(usart->rx_timer, usart->rx_next_ns);
+    } else {
+        timer_del(usart->rx_timer);
+    }
+    if (!fifo8_is_empty(&usart->tx_fifo)) {
+        timer_mod(usart->tx_timer, usart->tx_end_ns);
+    } else {
+        timer_del(usart->tx_timer);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_avr_usart = {
+    .name = "avr-usart",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = avr_usart_pre_save,
+    .post_load = avr_usart_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(data, AVRUsartState),
+        VMSTATE_BOOL(data_valid, AVRUsartState),
+        VMSTATE_UINT8(char_mask, AVRUsartState),
+        VMSTATE_FIFO8(rx_fifo, AVRUsartState),
+        VMSTATE_FIFO8(tx_fifo, AVRUsartState),
+        VMSTATE_INT64(rx_next_ns, AVRUsartState),
+        VMSTATE_INT64(tx_end_ns, AVRUsartState),
+        VMSTATE_INT64(saved_ns, AVRUsartState),
+        VMSTATE_UINT8(csra, AVRUsartState),
+        VMSTATE_UINT8(csrb, AVRUsartState),
+        VMSTATE_UINT8(csrc, AVRUsartState),
+        VMSTATE_UINT8(brrh, AVRUsartState),
+        VMSTATE_UINT8(brrl, AVRUsartState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void avr_usart_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = avr_usart_reset;
+    dc->vmsd = &vmstate_avr_usart;
     dc->props = avr_usart_properties;
     dc->realize = avr_usart_realize;
+    dc->unrealize = avr_usart_unrealize;
 }
 
 static const TypeInfo avr_usart_info = {
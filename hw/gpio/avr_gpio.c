@@ -0,0 +1,297 @@
+/*
+ * AVR GPIO ports
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  Firmware that bit-bangs a protocol toggles pins millions of times, too
+ *  often for anything outside QEMU to follow them one at a time.  Changes
+ *  are appended to a ring buffer as AVRGpioEvent records instead, and the
+ *  buffer goes to the chardev once it is half full, flush-delay-ms after
+ *  the first event in it, or when the VM stops.  The guest never waits for
+ *  the backend: if it falls behind, new events are dropped and the next
+ *  one written carries AVR_GPIO_EVENT_LOST.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/log.h"
+#include "hw/gpio/avr_gpio.h"
+#include "migration/vmstate.h"
+
+static void avr_gpio_flush(AVRGpioState *s);
+
+static gboolean avr_gpio_watch(GIOChannel *chan, GIOCondition cond,
+                               void *opaque)
+{
+    AVRGpioState *s = opaque;
+
+    s->watch_tag = 0;
+    avr_gpio_flush(s);
+    return FALSE;
+}
+
+/* Write out as much of the buffer as the backend takes without blocking */
+static void avr_gpio_flush(AVRGpioState *s)
+{
+    uint32_t chunk;
+    int ret;
+
+    timer_del(s->flush_timer);
+    while (s->len > 0 && !s->watch_tag) {
+        chunk = MIN(s->len, s->buffer_size - s->head);
+        ret = qemu_chr_fe_write(&s->chr, s->buffer + s->head, chunk);
+        if (ret <= 0) {
+            s->watch_tag = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                 avr_gpio_watch, s);
+            if (!s->watch_tag) {
+                /* The backend went away, drop what it didn't take */
+                s->head = 0;
+                s->len = 0;
+            }
+            return;
+        }
+        s->head = (s->head + ret) % s->buffer_size;
+        s->len -= ret;
+    }
+    if (s->len == 0) {
+        s->head = 0;
+    }
+}
+
+static void avr_gpio_flush_timer(void *opaque)
+{
+    avr_gpio_flush(opaque);
+}
+
+static void avr_gpio_vm_state_change(void *opaque, int running,
+                                     RunState state)
+{
+    if (!running) {
+        avr_gpio_flush(opaque);
+    }
+}
+
+static void avr_gpio_record(AVRGpioState *s, AVRGpioPort *p)
+{
+    AVRGpioEvent ev;
+
+    if (s->len + sizeof(ev) > s->buffer_size) {
+        s->lost = true;
+        return;
+    }
+    ev.time_ns = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    ev.port = p->index;
+    ev.pins = p->pins;
+    ev.ddr = p->ddr;
+    ev.flags = s->lost ? AVR_GPIO_EVENT_LOST : 0;
+    s->lost = false;
+
+    /* buffer_size is a multiple of the record size, so they never wrap */
+    memcpy(s->buffer + (s->head + s->len) % s->buffer_size, &ev, sizeof(ev));
+    s->len += sizeof(ev);
+
+    if (s->len >= s->buffer_size / 2) {
+        avr_gpio_flush(s);
+    } else if (!timer_pending(s->flush_timer) && !s->watch_tag) {
+        timer_mod(s->flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->flush_delay_ms);
+    }
+}
+
+/* Bring the GPIO lines and the event stream up to date with the registers */
+static void avr_gpio_update(AVRGpioPort *p)
+{
+    AVRGpioState *s = p->gpio;
+    uint8_t input = (p->input & p->driven) | (p->port & ~p->driven);
+    uint8_t pins = (p->port & p->ddr) | (input & ~p->ddr);
+    uint8_t changed = (pins ^ p->pins) & p->ddr;
+    int i;
+
+    if (pins == p->pins && p->ddr == p->reported_ddr) {
+        return;
+    }
+    /* Output lines carry what the firmware drives */
+    for (i = 0; i < 8; i++) {
+        if (changed & (1 << i)) {
+            qemu_set_irq(s->out[p->index * 8 + i], (pins >> i) & 1);
+        }
+    }
+    p->pins = pins;
+    p->reported_ddr = p->ddr;
+
+    if (qemu_chr_fe_backend_connected(&s->chr)) {
+        avr_gpio_record(s, p);
+    }
+}
+
+static void avr_gpio_set_input(void *opaque, int line, int level)
+{
+    AVRGpioState *s = opaque;
+    AVRGpioPort *p = &s->ports[line / 8];
+    uint8_t mask = 1 << (line % 8);
+
+    p->driven |= mask;
+    p->input = level ? p->input | mask : p->input & ~mask;
+    avr_gpio_update(p);
+}
+
+static uint64_t avr_gpio_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    AVRGpioPort *p = opaque;
+
+    assert(size == 1);
+    switch (addr) {
+    case GPIO_PIN:
+        return p->pins;
+    case GPIO_DDR:
+        return p->ddr;
+    case GPIO_PORT:
+        return p->port;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        return 0;
+    }
+}
+
+static void avr_gpio_write(void *opaque, hwaddr addr, uint64_t value,
+                           unsigned int size)
+{
+    AVRGpioPort *p = opaque;
+
+    assert(size == 1);
+    switch (addr) {
+    case GPIO_PIN:
+        /* Writing ones to PINx toggles those bits of PORTx */
+        p->port ^= value;
+        break;
+    case GPIO_DDR:
+        p->ddr = value;
+        break;
+    case GPIO_PORT:
+        p->port = value;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        return;
+    }
+    avr_gpio_update(p);
+}
+
+static const MemoryRegionOps avr_gpio_ops = {
+    .read = avr_gpio_read,
+    .write = avr_gpio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void avr_gpio_reset(DeviceState *dev)
+{
+    AVRGpioState *s = AVR_GPIO(dev);
+    int i;
+
+    for (i = 0; i < s->num_ports; i++) {
+        s->ports[i].ddr = 0;
+        s->ports[i].port = 0;
+        avr_gpio_update(&s->ports[i]);
+    }
+}
+
+static void avr_gpio_realize(DeviceState *dev, Error **errp)
+{
+    AVRGpioState *s = AVR_GPIO(dev);
+    AVRGpioPort *p;
+    char *name;
+    int i;
+
+    if (s->num_ports == 0 || s->num_ports > AVR_GPIO_MAX_PORTS) {
+        error_setg(errp, "%s: num-ports must be between 1 and %d",
+                   TYPE_AVR_GPIO, AVR_GPIO_MAX_PORTS);
+        return;
+    }
+    s->buffer_size = QEMU_ALIGN_UP(MAX(s->buffer_size, 2),
+                                   sizeof(AVRGpioEvent) * 2);
+
+    for (i = 0; i < s->num_ports; i++) {
+        p = &s->ports[i];
+        p->gpio = s;
+        p->index = i;
+        name = g_strdup_printf("%s.port%c", TYPE_AVR_GPIO,
+                               i < 8 ? 'a' + i : 'a' + i + 1);
+        memory_region_init_io(&p->iomem, OBJECT(s), &avr_gpio_ops, p,
+                              name, 3);
+        g_free(name);
+        sysbus_init_mmio(SYS_BUS_DEVICE(s), &p->iomem);
+    }
+    qdev_init_gpio_in(dev, avr_gpio_set_input, s->num_ports * 8);
+    qdev_init_gpio_out(dev, s->out, s->num_ports * 8);
+
+    if (qemu_chr_fe_backend_connected(&s->chr)) {
+        s->buffer = g_malloc(s->buffer_size);
+        s->flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                      avr_gpio_flush_timer, s);
+        s->vmstate = qemu_add_vm_change_state_handler(
+            avr_gpio_vm_state_change, s);
+    }
+}
+
+static const VMStateDescription vmstate_avr_gpio_port = {
+    .name = "avr-gpio-port",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(ddr, AVRGpioPort),
+        VMSTATE_UINT8(port, AVRGpioPort),
+        VMSTATE_UINT8(input, AVRGpioPort),
+        VMSTATE_UINT8(driven, AVRGpioPort),
+        VMSTATE_UINT8(pins, AVRGpioPort),
+        VMSTATE_UINT8(reported_ddr, AVRGpioPort),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_avr_gpio = {
+    .name = "avr-gpio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(ports, AVRGpioState, AVR_GPIO_MAX_PORTS, 1,
+                             vmstate_avr_gpio_port, AVRGpioPort),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property avr_gpio_properties[] = {
+    DEFINE_PROP_UINT32("num-ports", AVRGpioState, num_ports, 1),
+    DEFINE_PROP_CHR("chardev", AVRGpioState, chr),
+    DEFINE_PROP_UINT32("buffer-size", AVRGpioState, buffer_size, 65536),
+    DEFINE_PROP_UINT32("flush-delay-ms", AVRGpioState, flush_delay_ms, 10),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void avr_gpio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = avr_gpio_realize;
+    dc->reset = avr_gpio_reset;
+    dc->vmsd = &vmstate_avr_gpio;
+    dc->props = avr_gpio_properties;
+}
+
+static const TypeInfo avr_gpio_info = {
+    .name          = TYPE_AVR_GPIO,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AVRGpioState),
+    .class_init    = avr_gpio_class_init,
+};
+
+static void avr_gpio_register_types(void)
+{
+    type_register_static(&avr_gpio_info);
+}
+
+type_init(avr_gpio_register_types)
@@ -0,0 +1,218 @@
+/*
+ * AVR interrupt controller
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "hw/intc/avr_intc.h"
+#include "migration/vmstate.h"
+
+/*
+ *  Lines are flags that stay pending until the CPU enters their vector or
+ *  the peripheral lowers them, as the interrupt flags of AVR peripherals are
+ *  cleared by hardware when the vector is executed.  The peripheral clears
+ *  its own flag when its acknowledge line is pulsed.
+ */
+static void avr_intc_set_irq(void *opaque, int irq, int level)
+{
+    AVRIntcState *s = opaque;
+    CPUState *cs = CPU(s->cpu);
+    uint64_t mask = UINT64_C(1) << irq;
+    uint64_t was_pending = s->pending;
+
+    if (!level) {
+        s->pending &= ~mask;
+        if (s->pending == 0) {
+            cpu_reset_interrupt(cs, CPU_INTERRUPT_HARD);
+        }
+        return;
+    }
+
+    if (!(s->pending & mask)) {
+        s->raised_ns[irq] = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        s->pending |= mask;
+    }
+    if (was_pending) {
+        return; /* the CPU has already been told */
+    }
+
+    if (qemu_cpu_is_self(cs) && !cpu_interrupts_enabled(&s->cpu->env)) {
+        /*
+         * Raised by the CPU's own IO access or a timer on its thread while
+         * it can't take the interrupt, don't make it leave the TB for
+         * nothing. Setting I returns to the main loop, which looks at
+         * interrupt_request again.
+         */
+        cs->interrupt_request |= CPU_INTERRUPT_HARD;
+    } else {
+        cpu_interrupt(cs, CPU_INTERRUPT_HARD);
+    }
+}
+
+/*
+ *  Called by the CPU, with I set and CPU_INTERRUPT_HARD requested, to enter
+ *  the highest priority pending line.  Returns the line, or -1 if none.
+ */
+int avr_intc_acknowledge(void *opaque)
+{
+    AVRIntcState *s = opaque;
+    int64_t latency;
+    int irq;
+
+    if (s->pending == 0) {
+        cpu_reset_interrupt(CPU(s->cpu), CPU_INTERRUPT_HARD);
+        return -1;
+    }
+
+    irq = ctz64(s->pending);
+    s->pending &= s->pending - 1;
+    if (s->pending == 0) {
+        cpu_reset_interrupt(CPU(s->cpu), CPU_INTERRUPT_HARD);
+    }
+
+    latency = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->raised_ns[irq];
+    s->count[irq]++;
+    s->latency_ns[irq] += latency;
+    s->max_latency_ns[irq] = MAX(s->max_latency_ns[irq], latency);
+
+    qemu_irq_pulse(s->ack[irq]);
+    return irq;
+}
+
+static void avr_intc_get_stats(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    AVRIntcState *s = AVR_INTC(obj);
+    uint64_t *stats = opaque;
+    uint64List *list = NULL;
+    uint64List *entry;
+    int i;
+
+    for (i = s->num_irq - 1; i >= 0; i--) {
+        entry = g_new0(uint64List, 1);
+        entry->value = stats[i];
+        entry->next = list;
+        list = entry;
+    }
+    visit_type_uint64List(v, name, &list, errp);
+    qapi_free_uint64List(list);
+}
+
+static void avr_intc_reset(DeviceState *dev)
+{
+    AVRIntcState *s = AVR_INTC(dev);
+
+    s->pending = 0;
+    memset(s->raised_ns, 0, sizeof(s->raised_ns));
+    memset(s->count, 0, sizeof(s->count));
+    memset(s->latency_ns, 0, sizeof(s->latency_ns));
+    memset(s->max_latency_ns, 0, sizeof(s->max_latency_ns));
+}
+
+static void avr_intc_realize(DeviceState *dev, Error **errp)
+{
+    AVRIntcState *s = AVR_INTC(dev);
+
+    if (!s->cpu) {
+        error_setg(errp, "avr-intc: 'cpu' link not set");
+        return;
+    }
+    if (s->num_irq == 0 || s->num_irq > AVR_INTC_MAX_IRQ) {
+        error_setg(errp, "avr-intc: num-irq must be between 1 and %d",
+                   AVR_INTC_MAX_IRQ);
+        return;
+    }
+
+    qdev_init_gpio_in(dev, avr_intc_set_irq, s->num_irq);
+    qdev_init_gpio_out_named(dev, s->ack, AVR_INTC_ACK, s->num_irq);
+    s->cpu->env.intc = s;
+}
+
+static void avr_intc_init(Object *obj)
+{
+    AVRIntcState *s = AVR_INTC(obj);
+
+    object_property_add(obj, "irq-count", "uint64List",
+                        avr_intc_get_stats, NULL, NULL, s->count, NULL);
+    object_property_add(obj, "irq-latency-ns", "uint64List",
+                        avr_intc_get_stats, NULL, NULL, s->latency_ns, NULL);
+    object_property_add(obj, "irq-max-latency-ns", "uint64List",
+                        avr_intc_get_stats, NULL, NULL, s->max_latency_ns,
+                        NULL);
+}
+
+static int avr_intc_pre_save(void *opaque)
+{
+    AVRIntcState *s = opaque;
+
+    s->saved_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    return 0;
+}
+
+/*
+ * Keep the latency statistics meaningful when a snapshot is restored without
+ * the virtual clock going back with it.
+ */
+static int avr_intc_post_load(void *opaque, int version_id)
+{
+    AVRIntcState *s = opaque;
+    int64_t shift = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->saved_ns;
+    int i;
+
+    for (i = 0; i < AVR_INTC_MAX_IRQ; i++) {
+        s->raised_ns[i] += shift;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_avr_intc = {
+    .name = "avr-intc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = avr_intc_pre_save,
+    .post_load = avr_intc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(pending, AVRIntcState),
+        VMSTATE_INT64_ARRAY(raised_ns, AVRIntcState, AVR_INTC_MAX_IRQ),
+        VMSTATE_INT64(saved_ns, AVRIntcState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property avr_intc_properties[] = {
+    DEFINE_PROP_LINK("cpu", AVRIntcState, cpu, TYPE_AVR_CPU, AVRCPU *),
+    DEFINE_PROP_UINT32("num-irq", AVRIntcState, num_irq, 57),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void avr_intc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = avr_intc_realize;
+    dc->reset = avr_intc_reset;
+    dc->vmsd = &vmstate_avr_intc;
+    dc->props = avr_intc_properties;
+}
+
+static const TypeInfo avr_intc_info = {
+    .name          = TYPE_AVR_INTC,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AVRIntcState),
+    .instance_init = avr_intc_init,
+    .class_init    = avr_intc_class_init,
+};
+
+static void avr_intc_register_types(void)
+{
+    type_register_static(&avr_intc_info);
+}
+
+type_init(avr_intc_register_types)
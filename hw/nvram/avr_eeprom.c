@@ -0,0 +1,399 @@
+/*
+ * AVR EEPROM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  Firmware commonly keeps calibration data and counters in EEPROM and
+ *  rewrites them often, so the contents live in memory and only the range
+ *  that changed is written to the block backend, flush-delay-ms after the
+ *  first change and whenever the VM stops.  That includes QEMU exiting, so
+ *  the contents survive from one run to the next.
+ *
+ *  A write keeps EEPE set for the 3.4ms (erase and write) or 1.8ms (erase
+ *  or write only) of virtual time the part takes, which firmware polls or
+ *  waits for the EE READY interrupt for.  Tests that don't care can set
+ *  write-delay=off to have writes complete at once.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/log.h"
+#include "hw/nvram/avr_eeprom.h"
+#include "migration/vmstate.h"
+
+#define EEPROM_MODE_ERASE_WRITE 0
+#define EEPROM_MODE_ERASE       1
+#define EEPROM_MODE_WRITE       2
+
+#define EEPROM_ERASE_WRITE_NS 3400000
+#define EEPROM_ERASE_OR_WRITE_NS 1800000
+
+static void avr_eeprom_update_irq(AVREepromState *ee)
+{
+    qemu_set_irq(ee->ready_irq, (ee->cr & EEPROM_CR_EERIE) &&
+                                !(ee->cr & EEPROM_CR_EEPE));
+}
+
+static void avr_eeprom_flush(AVREepromState *ee)
+{
+    int ret;
+
+    timer_del(ee->flush_timer);
+    if (!ee->blk || ee->dirty_lo >= ee->dirty_hi) {
+        return;
+    }
+    ret = blk_pwrite(ee->blk, ee->dirty_lo, ee->mem + ee->dirty_lo,
+                     ee->dirty_hi - ee->dirty_lo, 0);
+    if (ret < 0) {
+        error_report("%s: failed to write back EEPROM contents: %s",
+                     TYPE_AVR_EEPROM, strerror(-ret));
+    }
+    ee->dirty_lo = ee->size;
+    ee->dirty_hi = 0;
+}
+
+static void avr_eeprom_flush_timer(void *opaque)
+{
+    avr_eeprom_flush(opaque);
+}
+
+static void avr_eeprom_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    if (!running) {
+        avr_eeprom_flush(opaque);
+    }
+}
+
+static void avr_eeprom_set_dirty(AVREepromState *ee, uint32_t lo, uint32_t hi)
+{
+    if (!ee->blk) {
+        return;
+    }
+    if (ee->dirty_lo >= ee->dirty_hi) {
+        timer_mod(ee->flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + ee->flush_delay_ms);
+    }
+    ee->dirty_lo = MIN(ee->dirty_lo, lo);
+    ee->dirty_hi = MAX(ee->dirty_hi, hi);
+}
+
+/*
+ * Make the dirty range what differs from the backend, after mem was
+ * replaced by a loaded state.  Loading the state it was saved with writes
+ * nothing back.
+ */
+static void avr_eeprom_compare(AVREepromState *ee)
+{
+    uint8_t *disk;
+    uint32_t lo = 0;
+    uint32_t hi = ee->size;
+    int ret;
+
+    timer_del(ee->flush_timer);
+    ee->dirty_lo = ee->size;
+    ee->dirty_hi = 0;
+    if (!ee->blk) {
+        return;
+    }
+
+    disk = g_malloc(ee->size);
+    ret = blk_pread(ee->blk, 0, disk, ee->size);
+    /* If the backend can't be read, write all of it back */
+    if (ret >= 0) {
+        while (lo < hi && ee->mem[lo] == disk[lo]) {
+            lo++;
+        }
+        while (hi > lo && ee->mem[hi - 1] == disk[hi - 1]) {
+            hi--;
+        }
+    }
+    g_free(disk);
+
+    if (lo < hi) {
+        avr_eeprom_set_dirty(ee, lo, hi);
+    }
+}
+
+static uint32_t avr_eeprom_address(AVREepromState *ee)
+{
+    return ((ee->arh << 8) | ee->arl) & (ee->size - 1);
+}
+
+static void avr_eeprom_write_done(void *opaque)
+{
+    AVREepromState *ee = opaque;
+
+    ee->cr &= ~EEPROM_CR_EEPE;
+    avr_eeprom_update_irq(ee);
+}
+
+/* Program the byte at EEAR as EEPM says, EEPE has just been set */
+static void avr_eeprom_program(AVREepromState *ee)
+{
+    uint32_t addr = avr_eeprom_address(ee);
+    uint8_t old = ee->mem[addr];
+    int64_t duration;
+
+    switch ((ee->cr & EEPROM_CR_EEPM) >> 4) {
+    case EEPROM_MODE_ERASE_WRITE:
+        ee->mem[addr] = ee->dr;
+        duration = EEPROM_ERASE_WRITE_NS;
+        break;
+    case EEPROM_MODE_ERASE:
+        ee->mem[addr] = 0xff;
+        duration = EEPROM_ERASE_OR_WRITE_NS;
+        break;
+    case EEPROM_MODE_WRITE:
+        ee->mem[addr] &= ee->dr;
+        duration = EEPROM_ERASE_OR_WRITE_NS;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: reserved programming mode\n",
+                      __func__);
+        return;
+    }
+    if (ee->mem[addr] != old) {
+        avr_eeprom_set_dirty(ee, addr, addr + 1);
+    }
+
+    if (ee->write_delay) {
+        ee->cr |= EEPROM_CR_EEPE;
+        ee->write_end_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + duration;
+        timer_mod(ee->write_timer, ee->write_end_ns);
+    }
+}
+
+/*
+ * Writing EEPE only starts a write if EEMPE was set by the previous write
+ * to EECR.  The part clears EEMPE four cycles after it is set, which is
+ * what firmware does in between anyway.
+ */
+static void avr_eeprom_write_cr(AVREepromState *ee, uint8_t value)
+{
+    bool armed = ee->cr & EEPROM_CR_EEMPE;
+    uint8_t keep = EEPROM_CR_EERIE | EEPROM_CR_EEMPE;
+
+    if (ee->cr & EEPROM_CR_EEPE) {
+        /* EEPM can't change and EERE is ignored while a write is going on */
+        ee->cr = (ee->cr & ~keep) | (value & keep);
+        avr_eeprom_update_irq(ee);
+        return;
+    }
+
+    ee->cr = value & (keep | EEPROM_CR_EEPM);
+    if ((value & EEPROM_CR_EEPE) && armed) {
+        ee->cr &= ~EEPROM_CR_EEMPE;
+        avr_eeprom_program(ee);
+    } else if (value & EEPROM_CR_EERE) {
+        ee->dr = ee->mem[avr_eeprom_address(ee)];
+    }
+    avr_eeprom_update_irq(ee);
+}
+
+static uint64_t avr_eeprom_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    AVREepromState *ee = opaque;
+
+    assert(size == 1);
+    switch (addr) {
+    case EEPROM_CR:
+        return ee->cr;
+    case EEPROM_DR:
+        return ee->dr;
+    case EEPROM_ARL:
+        return ee->arl;
+    case EEPROM_ARH:
+        return ee->arh;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        return 0;
+    }
+}
+
+static void avr_eeprom_write(void *opaque, hwaddr addr, uint64_t value,
+                             unsigned int size)
+{
+    AVREepromState *ee = opaque;
+
+    assert(size == 1);
+    switch (addr) {
+    case EEPROM_CR:
+        avr_eeprom_write_cr(ee, value);
+        break;
+    case EEPROM_DR:
+        ee->dr = value;
+        break;
+    case EEPROM_ARL:
+        ee->arl = value;
+        break;
+    case EEPROM_ARH:
+        ee->arh = value & ((ee->size - 1) >> 8);
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        break;
+    }
+}
+
+static const MemoryRegionOps avr_eeprom_ops = {
+    .read = avr_eeprom_read,
+    .write = avr_eeprom_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void avr_eeprom_reset(DeviceState *dev)
+{
+    AVREepromState *ee = AVR_EEPROM(dev);
+
+    /* The contents are non-volatile, only the registers are reset */
+    timer_del(ee->write_timer);
+    ee->cr = 0;
+    ee->dr = 0;
+    ee->arl = 0;
+    ee->arh = 0;
+    ee->write_end_ns = 0;
+    avr_eeprom_update_irq(ee);
+}
+
+static void avr_eeprom_realize(DeviceState *dev, Error **errp)
+{
+    AVREepromState *ee = AVR_EEPROM(dev);
+    int64_t len;
+    int ret;
+
+    if (!is_power_of_2(ee->size) || ee->size > 0x10000) {
+        error_setg(errp, "%s: size must be a power of 2 up to 64KiB",
+                   TYPE_AVR_EEPROM);
+        return;
+    }
+
+    ee->mem = g_malloc(ee->size);
+    memset(ee->mem, 0xff, ee->size); /* erased */
+    ee->dirty_lo = ee->size;
+    ee->dirty_hi = 0;
+
+    if (ee->blk) {
+        len = blk_getlength(ee->blk);
+        if (len != ee->size) {
+            error_setg(errp, "%s: Backing file size %" PRId64 " != %u",
+                       TYPE_AVR_EEPROM, len, ee->size);
+            return;
+        }
+        if (blk_set_perm(ee->blk, BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE,
+                         BLK_PERM_ALL, errp) < 0) {
+            return;
+        }
+        ret = blk_pread(ee->blk, 0, ee->mem, ee->size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "%s: failed to read backing file",
+                             TYPE_AVR_EEPROM);
+            return;
+        }
+        ee->vmstate = qemu_add_vm_change_state_handler(
+            avr_eeprom_vm_state_change, ee);
+    }
+
+    ee->flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                   avr_eeprom_flush_timer, ee);
+}
+
+static void avr_eeprom_init(Object *obj)
+{
+    AVREepromState *ee = AVR_EEPROM(obj);
+
+    sysbus_init_irq(SYS_BUS_DEVICE(obj), &ee->ready_irq);
+
+    memory_region_init_io(&ee->iomem, obj, &avr_eeprom_ops, ee,
+                          TYPE_AVR_EEPROM, 4);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &ee->iomem);
+
+    ee->write_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_eeprom_write_done,
+                                   ee);
+}
+
+static int avr_eeprom_pre_save(void *opaque)
+{
+    AVREepromState *ee = opaque;
+
+    ee->saved_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    return 0;
+}
+
+/*
+ * The virtual clock doesn't go back when an in-process snapshot is restored,
+ * finish a write in progress as long after the load as it had left.
+ */
+static int avr_eeprom_post_load(void *opaque, int version_id)
+{
+    AVREepromState *ee = opaque;
+
+    ee->write_end_ns += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - ee->saved_ns;
+    if (ee->cr & EEPROM_CR_EEPE) {
+        timer_mod(ee->write_timer, ee->write_end_ns);
+    } else {
+        timer_del(ee->write_timer);
+    }
+    /* The backend holds whatever was written since the state was saved */
+    avr_eeprom_compare(ee);
+    return 0;
+}
+
+static const VMStateDescription vmstate_avr_eeprom = {
+    .name = "avr-eeprom",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = avr_eeprom_pre_save,
+    .post_load = avr_eeprom_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(cr, AVREepromState),
+        VMSTATE_UINT8(dr, AVREepromState),
+        VMSTATE_UINT8(arl, AVREepromState),
+        VMSTATE_UINT8(arh, AVREepromState),
+        VMSTATE_INT64(write_end_ns, AVREepromState),
+        VMSTATE_INT64(saved_ns, AVREepromState),
+        VMSTATE_VBUFFER_UINT32(mem, AVREepromState, 0, NULL, size),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property avr_eeprom_properties[] = {
+    DEFINE_PROP_DRIVE("drive", AVREepromState, blk),
+    DEFINE_PROP_UINT32("size", AVREepromState, size, 4096),
+    DEFINE_PROP_BOOL("write-delay", AVREepromState, write_delay, true),
+    DEFINE_PROP_UINT32("flush-delay-ms", AVREepromState, flush_delay_ms,
+                       1000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void avr_eeprom_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = avr_eeprom_realize;
+    dc->reset = avr_eeprom_reset;
+    dc->vmsd = &vmstate_avr_eeprom;
+    dc->props = avr_eeprom_properties;
+}
+
+static const TypeInfo avr_eeprom_info = {
+    .name          = TYPE_AVR_EEPROM,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AVREepromState),
+    .instance_init = avr_eeprom_init,
+    .class_init    = avr_eeprom_class_init,
+};
+
+static void avr_eeprom_register_types(void)
+{
+    type_register_static(&avr_eeprom_info);
+}
+
+type_init(avr_eeprom_register_types)
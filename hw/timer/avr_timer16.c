@@ -37,6 +37,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/timer/avr_timer16.h"
+#include "hw/intc/avr_intc.h"
 #include "qemu/log.h"
 
 /* Register offsets */
@@ -118,25 +119,162 @@ static inline int64_t avr_timer16_ns_to_ticks(AVRTimer16State *t16, int64_t t)
     return t / t16->period_ns;
 }
 
-static void avr_timer16_update_cnt(AVRTimer16State *t16)
+static bool avr_timer16_running(AVRTimer16State *t16)
 {
-    uint16_t cnt;
-    cnt = avr_timer16_ns_to_ticks(t16, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
-                                       t16->reset_time_ns);
-    t16->cntl = (uint8_t)(cnt & 0xff);
-    t16->cnth = (uint8_t)((cnt & 0xff00) >> 8);
+    return CLKSRC(t16) >= T16_CLKSRC_DIV1 &&
+           CLKSRC(t16) <= T16_CLKSRC_DIV1024 && t16->period_ns != 0;
 }
 
-static inline void avr_timer16_recalc_reset_time(AVRTimer16State *t16)
+/* Number of counter values before the counter wraps to zero */
+static uint64_t avr_timer16_period(AVRTimer16State *t16)
 {
+    switch (MODE(t16)) {
+    case T16_MODE_CTC_OCRA:
+        return OCRA(t16) + 1;
+    case T16_MODE_CTC_ICR:
+        return ICR(t16) + 1;
+    default:
+        return 0x10000;
+    }
+}
+
+/*
+ * Tick after @from at which a counter that wraps every @period ticks
+ * reaches @value
+ */
+static uint64_t avr_timer16_next_match(uint64_t from, uint64_t value,
+                                       uint64_t period)
+{
+    return from + 1 + (value + period - (from + 1) % period) % period;
+}
+
+/* Interrupt flags the counter raises between two ticks */
+static uint8_t avr_timer16_events(AVRTimer16State *t16, uint64_t from,
+                                  uint64_t to)
+{
+    uint64_t period = avr_timer16_period(t16);
+    uint8_t events = 0;
+
+    if (period == 0x10000 && avr_timer16_next_match(from, 0, period) <= to) {
+        events |= T16_INT_TOV;
+    }
+    if (MODE(t16) == T16_MODE_CTC_ICR &&
+        avr_timer16_next_match(from, ICR(t16), period) <= to) {
+        events |= T16_INT_IC;
+    }
+    if (OCRA(t16) < period &&
+        avr_timer16_next_match(from, OCRA(t16), period) <= to) {
+        events |= T16_INT_OCA;
+    }
+    if (OCRB(t16) < period &&
+        avr_timer16_next_match(from, OCRB(t16), period) <= to) {
+        events |= T16_INT_OCB;
+    }
+    if (OCRC(t16) < period &&
+        avr_timer16_next_match(from, OCRC(t16), period) <= to) {
+        events |= T16_INT_OCC;
+    }
+    return events;
+}
+
+/* Interrupt flag of each IRQ, in the order of the IRQs */
+static const uint8_t avr_timer16_irq_flags[] = {
+    T16_INT_IC, T16_INT_OCA, T16_INT_OCB, T16_INT_OCC, T16_INT_TOV
+};
+
+static void avr_timer16_raise(AVRTimer16State *t16, uint8_t events)
+{
+    if (events & T16_INT_IC) {
+        qemu_set_irq(t16->capt_irq, 1);
+    }
+    if (events & T16_INT_OCA) {
+        qemu_set_irq(t16->compa_irq, 1);
+    }
+    if (events & T16_INT_OCB) {
+        qemu_set_irq(t16->compb_irq, 1);
+    }
+    if (events & T16_INT_OCC) {
+        qemu_set_irq(t16->compc_irq, 1);
+    }
+    if (events & T16_INT_TOV) {
+        qemu_set_irq(t16->ovf_irq, 1);
+    }
+}
+
+static void avr_timer16_lower(AVRTimer16State *t16, uint8_t events)
+{
+    if (events & T16_INT_IC) {
+        qemu_set_irq(t16->capt_irq, 0);
+    }
+    if (events & T16_INT_OCA) {
+        qemu_set_irq(t16->compa_irq, 0);
+    }
+    if (events & T16_INT_OCB) {
+        qemu_set_irq(t16->compb_irq, 0);
+    }
+    if (events & T16_INT_OCC) {
+        qemu_set_irq(t16->compc_irq, 0);
+    }
+    if (events & T16_INT_TOV) {
+        qemu_set_irq(t16->ovf_irq, 0);
+    }
+}
+
+/*
+ * Bring the counter and interrupt flags up to date with virtual time.
+ *
+ * Nothing happens while the counter runs, CNT and the flags are worked out
+ * from reset_time_ns when they are observed, and the QEMU timer only fires
+ * for events that raise an enabled interrupt.
+ */
+static void avr_timer16_sync(AVRTimer16State *t16)
+{
+    uint64_t period = avr_timer16_period(t16);
+    uint64_t ticks;
+    uint64_t cnt;
+    uint8_t events;
+
+    if (!avr_timer16_running(t16)) {
+        return;
+    }
+
+    ticks = avr_timer16_ns_to_ticks(t16, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                         - t16->reset_time_ns);
+    if (ticks <= t16->sync_ticks) {
+        return;
+    }
+    events = avr_timer16_events(t16, t16->sync_ticks, ticks);
+
+    /* Rebase to the last wrap so the tick count stays small */
+    cnt = ticks % period;
+    t16->reset_time_ns += (ticks - cnt) * t16->period_ns;
+    t16->sync_ticks = cnt;
+    t16->cntl = cnt & 0xff;
+    t16->cnth = (cnt >> 8) & 0xff;
+
+    t16->ifr |= events;
+    avr_timer16_raise(t16, events & t16->imsk);
+}
+
+/*
+ * Restart counting from the current CNT, after it was written or the
+ * clock changed.  A TOP below CNT makes the counter wrap at once rather
+ * than after MAX.
+ */
+static void avr_timer16_recalc_reset_time(AVRTimer16State *t16)
+{
+    t16->sync_ticks = CNT(t16) % avr_timer16_period(t16);
+    t16->cntl = t16->sync_ticks & 0xff;
+    t16->cnth = (t16->sync_ticks >> 8) & 0xff;
     t16->reset_time_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
-                         CNT(t16) * t16->period_ns;
+                         t16->sync_ticks * t16->period_ns;
 }
 
 static void avr_timer16_clock_reset(AVRTimer16State *t16)
 {
     t16->cntl = 0;
     t16->cnth = 0;
+    t16->sync_ticks = 0;
     t16->reset_time_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 }
 
@@ -176,126 +314,61 @@ end:
     return;
 }
 
+/* Arm the QEMU timer for the next event that raises an enabled interrupt */
 static void avr_timer16_set_alarm(AVRTimer16State *t16)
 {
-    if (CLKSRC(t16) == T16_CLKSRC_EXT_FALLING ||
-        CLKSRC(t16) == T16_CLKSRC_EXT_RISING ||
-        CLKSRC(t16) == T16_CLKSRC_STOPPED) {
+    uint64_t period = avr_timer16_period(t16);
+    uint64_t from = t16->sync_ticks;
+    uint64_t next = UINT64_MAX;
+
+    if (!avr_timer16_running(t16)) {
         /* Timer is disabled or set to external clock source (unsupported) */
-        goto end;
+        timer_del(t16->timer);
+        return;
     }
 
-    uint64_t alarm_offset = 0xffff;
-    enum NextInterrupt next_interrupt = OVERFLOW;
-
     switch (MODE(t16)) {
     case T16_MODE_NORMAL:
-        /* Normal mode */
-        if (OCRA(t16) < alarm_offset && OCRA(t16) > CNT(t16) &&
-            (t16->imsk & T16_INT_OCA)) {
-            alarm_offset = OCRA(t16);
-            next_interrupt = COMPA;
-        }
-        break;
     case T16_MODE_CTC_OCRA:
-        /* CTC mode, top = ocra */
-        if (OCRA(t16) < alarm_offset && OCRA(t16) > CNT(t16)) {
-            alarm_offset = OCRA(t16);
-            next_interrupt = COMPA;
-        }
-       break;
     case T16_MODE_CTC_ICR:
-        /* CTC mode, top = icr */
-        if (ICR(t16) < alarm_offset && ICR(t16) > CNT(t16)) {
-            alarm_offset = ICR(t16);
-            next_interrupt = CAPT;
-        }
-        if (OCRA(t16) < alarm_offset && OCRA(t16) > CNT(t16) &&
-            (t16->imsk & T16_INT_OCA)) {
-            alarm_offset = OCRA(t16);
-            next_interrupt = COMPA;
-        }
         break;
     default:
         ERROR("pwm modes are unsupported");
-        goto end;
+        timer_del(t16->timer);
+        return;
     }
-    if (OCRB(t16) < alarm_offset && OCRB(t16) > CNT(t16) &&
-        (t16->imsk & T16_INT_OCB)) {
-        alarm_offset = OCRB(t16);
-        next_interrupt = COMPB;
+
+    if ((t16->imsk & T16_INT_TOV) && period == 0x10000) {
+        next = MIN(next, avr_timer16_next_match(from, 0, period));
     }
-    if (OCRC(t16) < alarm_offset && OCRB(t16) > CNT(t16) &&
-        (t16->imsk & T16_INT_OCC)) {
-        alarm_offset = OCRB(t16);
-        next_interrupt = COMPC;
+    if ((t16->imsk & T16_INT_IC) && MODE(t16) == T16_MODE_CTC_ICR) {
+        next = MIN(next, avr_timer16_next_match(from, ICR(t16), period));
+    }
+    if ((t16->imsk & T16_INT_OCA) && OCRA(t16) < period) {
+        next = MIN(next, avr_timer16_next_match(from, OCRA(t16), period));
+    }
+    if ((t16->imsk & T16_INT_OCB) && OCRB(t16) < period) {
+        next = MIN(next, avr_timer16_next_match(from, OCRB(t16), period));
+    }
+    if ((t16->imsk & T16_INT_OCC) && OCRC(t16) < period) {
+        next = MIN(next, avr_timer16_next_match(from, OCRC(t16), period));
     }
-    alarm_offset -= CNT(t16);
-
-    t16->next_interrupt = next_interrupt;
-    uint64_t alarm_ns =
-        t16->reset_time_ns + ((CNT(t16) + alarm_offset) * t16->period_ns);
-    timer_mod(t16->timer, alarm_ns);
 
-    DB_PRINT("next alarm %" PRIu64 " ns from now",
-        alarm_offset * t16->period_ns);
+    if (next == UINT64_MAX) {
+        timer_del(t16->timer);
+        return;
+    }
+    timer_mod(t16->timer, t16->reset_time_ns + next * t16->period_ns);
 
-end:
-    return;
+    DB_PRINT("next alarm %" PRIu64 " ticks from now", next - from);
 }
 
 static void avr_timer16_interrupt(void *opaque)
 {
     AVRTimer16State *t16 = opaque;
-    uint8_t mode = MODE(t16);
-
-    avr_timer16_update_cnt(t16);
-
-    if (CLKSRC(t16) == T16_CLKSRC_EXT_FALLING ||
-        CLKSRC(t16) == T16_CLKSRC_EXT_RISING ||
-        CLKSRC(t16) == T16_CLKSRC_STOPPED) {
-        /* Timer is disabled or set to external clock source (unsupported) */
-        return;
-    }
 
+    avr_timer16_sync(t16);
     DB_PRINT("interrupt, cnt = %d", CNT(t16));
-
-    /* Counter overflow */
-    if (t16->next_interrupt == OVERFLOW) {
-        DB_PRINT("0xffff overflow");
-        avr_timer16_clock_reset(t16);
-        if (t16->imsk & T16_INT_TOV) {
-            t16->ifr |= T16_INT_TOV;
-            qemu_set_irq(t16->ovf_irq, 1);
-        }
-    }
-    /* Check for ocra overflow in CTC mode */
-    if (mode == T16_MODE_CTC_OCRA && t16->next_interrupt == COMPA) {
-        DB_PRINT("CTC OCRA overflow");
-        avr_timer16_clock_reset(t16);
-    }
-    /* Check for icr overflow in CTC mode */
-    if (mode == T16_MODE_CTC_ICR && t16->next_interrupt == CAPT) {
-        DB_PRINT("CTC ICR overflow");
-        avr_timer16_clock_reset(t16);
-        if (t16->imsk & T16_INT_IC) {
-            t16->ifr |= T16_INT_IC;
-            qemu_set_irq(t16->capt_irq, 1);
-        }
-    }
-    /* Check for output compare interrupts */
-    if (t16->imsk & T16_INT_OCA && t16->next_interrupt == COMPA) {
-        t16->ifr |= T16_INT_OCA;
-        qemu_set_irq(t16->compa_irq, 1);
-    }
-    if (t16->imsk & T16_INT_OCB && t16->next_interrupt == COMPB) {
-        t16->ifr |= T16_INT_OCB;
-        qemu_set_irq(t16->compb_irq, 1);
-    }
-    if (t16->imsk & T16_INT_OCC && t16->next_interrupt == COMPC) {
-        t16->ifr |= T16_INT_OCC;
-        qemu_set_irq(t16->compc_irq, 1);
-    }
     avr_timer16_set_alarm(t16);
 }
 
@@ -331,7 +404,7 @@ static uint64_t avr_timer16_read(void *opaque, hwaddr offset, unsigned size)
         retval = t16->crc;
         break;
     case T16_CNTL:
-        avr_timer16_update_cnt(t16);
+        avr_timer16_sync(t16);
         t16->rtmp = t16->cnth;
         retval = t16->cntl;
         break;
@@ -385,12 +458,17 @@ static void avr_timer16_write(void *opaque, hwaddr offset,
 
     DB_PRINT("write %d to offset %d", val8, (uint8_t)offset);
 
+    /* Raise anything due under the old configuration first */
+    avr_timer16_sync(t16);
+
     switch (offset) {
     case T16_CRA:
         t16->cra = val8;
         if (t16->cra & T16_CRA_OC_CONF) {
             ERROR("output compare pins unsupported");
         }
+        /* The mode, and so TOP, may have changed */
+        avr_timer16_recalc_reset_time(t16);
         break;
     case T16_CRB:
         t16->crb = val8;
@@ -402,10 +480,8 @@ static void avr_timer16_write(void *opaque, hwaddr offset,
         }
         if (CLKSRC(t16) != prev_clk_src) {
             avr_timer16_clksrc_update(t16);
-            if (prev_clk_src == T16_CLKSRC_STOPPED) {
-                t16->reset_time_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-            }
         }
+        avr_timer16_recalc_reset_time(t16);
         break;
     case T16_CRC:
         t16->crc = val8;
@@ -434,6 +510,7 @@ static void avr_timer16_write(void *opaque, hwaddr offset,
         if (MODE(t16) == T16_MODE_CTC_ICR) {
             t16->icrl = val8;
             t16->icrh = t16->rtmp;
+            avr_timer16_recalc_reset_time(t16);
         }
         break;
     case T16_ICRH:
@@ -447,9 +524,15 @@ static void avr_timer16_write(void *opaque, hwaddr offset,
          * trigger an interrupt, when CNT is equal to the value here
          */
         t16->ocral = val8;
+        if (MODE(t16) == T16_MODE_CTC_OCRA) {
+            avr_timer16_recalc_reset_time(t16);
+        }
         break;
     case T16_OCRAH:
         t16->ocrah = val8;
+        if (MODE(t16) == T16_MODE_CTC_OCRA) {
+            avr_timer16_recalc_reset_time(t16);
+        }
         break;
     case T16_OCRBL:
         t16->ocrbl = val8;
@@ -486,10 +569,18 @@ static void avr_timer16_imsk_write(void *opaque, hwaddr offset,
 {
     assert(size == 1);
     AVRTimer16State *t16 = opaque;
+    uint8_t enabled;
+
     if (offset != 0) {
         return;
     }
+    avr_timer16_sync(t16);
+    enabled = (uint8_t)val64 & ~t16->imsk;
+    avr_timer16_lower(t16, t16->imsk & ~(uint8_t)val64);
     t16->imsk = (uint8_t)val64;
+    /* Flags that were already raised interrupt as soon as they're enabled */
+    avr_timer16_raise(t16, t16->ifr & enabled);
+    avr_timer16_set_alarm(t16);
 }
 
 static uint64_t avr_timer16_ifr_read(void *opaque,
@@ -501,6 +592,7 @@ static uint64_t avr_timer16_ifr_read(void *opaque,
     if (offset != 0) {
         return 0;
     }
+    avr_timer16_sync(t16);
     return t16->ifr;
 }
 
@@ -512,7 +604,21 @@ static void avr_timer16_ifr_write(void *opaque, hwaddr offset,
     if (offset != 0) {
         return;
     }
-    t16->ifr = (uint8_t)val64;
+    avr_timer16_sync(t16);
+    /* Flags are cleared by writing a one to them */
+    t16->ifr &= ~(uint8_t)val64;
+    avr_timer16_lower(t16, (uint8_t)val64);
+}
+
+/* The CPU entered the vector of IRQ @n, which clears its flag */
+static void avr_timer16_ack(void *opaque, int n, int level)
+{
+    AVRTimer16State *t16 = opaque;
+
+    if (level) {
+        avr_timer16_sync(t16);
+        t16->ifr &= ~avr_timer16_irq_flags[n];
+    }
 }
 
 static const MemoryRegionOps avr_timer16_ops = {
@@ -548,6 +654,8 @@ static void avr_timer16_init(Object *obj)
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->compb_irq);
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->compc_irq);
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->ovf_irq);
+    qdev_init_gpio_in_named(DEVICE(obj), avr_timer16_ack, AVR_INTC_ACK,
+                            ARRAY_SIZE(avr_timer16_irq_flags));
 
     memory_region_init_io(&s->iomem, obj, &avr_timer16_ops,
                           s, TYPE_AVR_TIMER16, 0xe);
@@ -563,11 +671,66 @@ static void avr_timer16_init(Object *obj)
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_timer16_interrupt, s);
 }
 
+static int avr_timer16_pre_save(void *opaque)
+{
+    AVRTimer16State *t16 = opaque;
+
+    t16->saved_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    return 0;
+}
+
+/*
+ * The virtual clock doesn't go back when an in-process snapshot is restored,
+ * so count on from where the counter was rather than from the saved time.
+ */
+static int avr_timer16_post_load(void *opaque, int version_id)
+{
+    AVRTimer16State *t16 = opaque;
+
+    t16->reset_time_ns += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) -
+                          t16->saved_ns;
+    avr_timer16_set_alarm(t16);
+    return 0;
+}
+
+static const VMStateDescription vmstate_avr_timer16 = {
+    .name = "avr-timer16",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = avr_timer16_pre_save,
+    .post_load = avr_timer16_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(cra, AVRTimer16State),
+        VMSTATE_UINT8(crb, AVRTimer16State),
+        VMSTATE_UINT8(crc, AVRTimer16State),
+        VMSTATE_UINT8(cntl, AVRTimer16State),
+        VMSTATE_UINT8(cnth, AVRTimer16State),
+        VMSTATE_UINT8(icrl, AVRTimer16State),
+        VMSTATE_UINT8(icrh, AVRTimer16State),
+        VMSTATE_UINT8(ocral, AVRTimer16State),
+        VMSTATE_UINT8(ocrah, AVRTimer16State),
+        VMSTATE_UINT8(ocrbl, AVRTimer16State),
+        VMSTATE_UINT8(ocrbh, AVRTimer16State),
+        VMSTATE_UINT8(ocrcl, AVRTimer16State),
+        VMSTATE_UINT8(ocrch, AVRTimer16State),
+        VMSTATE_UINT8(rtmp, AVRTimer16State),
+        VMSTATE_UINT8(imsk, AVRTimer16State),
+        VMSTATE_UINT8(ifr, AVRTimer16State),
+        VMSTATE_UINT64(freq_hz, AVRTimer16State),
+        VMSTATE_UINT64(period_ns, AVRTimer16State),
+        VMSTATE_UINT64(reset_time_ns, AVRTimer16State),
+        VMSTATE_UINT64(sync_ticks, AVRTimer16State),
+        VMSTATE_INT64(saved_ns, AVRTimer16State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void avr_timer16_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = avr_timer16_reset;
+    dc->vmsd = &vmstate_avr_timer16;
     dc->props = avr_timer16_properties;
 }
 
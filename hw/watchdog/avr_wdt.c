@@ -0,0 +1,330 @@
+/*
+ * AVR watchdog timer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  Firmware commonly runs WDR on every pass of its main loop, millions of
+ *  times a second, so it is translated to a plain store to env->wdr with no
+ *  helper call.  The device only looks at the flag from a timer, every
+ *  quarter of the timeout period, and takes a WDR it finds there as having
+ *  happened at that time.  Firmware is never reset early, and a timeout
+ *  comes at most a quarter of the period late.
+ *
+ *  Entering the watchdog vector clears WDIF and, in interrupt and system
+ *  reset mode, WDIE, so that the next timeout resets unless the handler sets
+ *  WDIE again.  The interrupt controller tells the device through its
+ *  AVR_INTC_ACK input.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/log.h"
+#include "hw/watchdog/avr_wdt.h"
+#include "hw/intc/avr_intc.h"
+#include "migration/vmstate.h"
+#include "sysemu/watchdog.h"
+#include "qapi/qapi-events-run-state.h"
+
+/* WDR is looked for this many times per timeout period */
+#define AVR_WDT_CHECKS 4
+
+/* 2K to 1024K cycles of the 128kHz watchdog oscillator */
+static int64_t avr_wdt_period_ns(AVRWdtState *s)
+{
+    int wdp = ((s->wdtcsr & 0x20) >> 2) | (s->wdtcsr & 0x07);
+
+    /* WDP values above 9 are reserved */
+    return (int64_t)(16 * SCALE_MS) << MIN(wdp, 9);
+}
+
+static bool avr_wdt_enabled(AVRWdtState *s)
+{
+    return s->wdtcsr & (AVR_WDT_WDTCSR_WDE | AVR_WDT_WDTCSR_WDIE);
+}
+
+/* Start the period over, forgetting any WDR not seen yet */
+static void avr_wdt_restart(AVRWdtState *s, int64_t now)
+{
+    atomic_set(&s->cpu->env.wdr, 0);
+    s->kick_ns = now;
+}
+
+static void avr_wdt_schedule(AVRWdtState *s, int64_t now)
+{
+    int64_t period = avr_wdt_period_ns(s);
+
+    if (!avr_wdt_enabled(s)) {
+        timer_del(s->timer);
+        return;
+    }
+    timer_mod(s->timer, MIN(now + period / AVR_WDT_CHECKS,
+                            s->kick_ns + period));
+}
+
+static void avr_wdt_timeout(AVRWdtState *s)
+{
+    if (s->wdtcsr & AVR_WDT_WDTCSR_WDIE) {
+        s->wdtcsr |= AVR_WDT_WDTCSR_WDIF;
+        qemu_irq_raise(s->irq);
+    } else if (s->wdtcsr & AVR_WDT_WDTCSR_WDE) {
+        qemu_log_mask(CPU_LOG_RESET, "AVR watchdog timed out\n");
+        s->reset_pending = true;
+        if (s->system_reset &&
+            get_watchdog_action() == WATCHDOG_ACTION_RESET) {
+            /* Only this system is reset, see AVR_WDT_RESET */
+            qapi_event_send_watchdog(WATCHDOG_ACTION_RESET);
+            qemu_irq_pulse(s->system_reset);
+        } else {
+            watchdog_perform_action();
+        }
+    }
+}
+
+static void avr_wdt_timer(void *opaque)
+{
+    AVRWdtState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (atomic_xchg(&s->cpu->env.wdr, 0)) {
+        s->kick_ns = now;
+    } else if (now >= s->kick_ns + avr_wdt_period_ns(s)) {
+        avr_wdt_timeout(s);
+        s->kick_ns = now;
+    }
+    avr_wdt_schedule(s, now);
+}
+
+/*
+ * WDIE can always be written and WDE set, but clearing WDE or changing WDP
+ * needs WDCE and WDE set by the previous write.  The part clears WDCE four
+ * cycles after it is set, which is what firmware does in between anyway.
+ */
+static void avr_wdt_write_wdtcsr(AVRWdtState *s, uint8_t value)
+{
+    uint8_t locked = AVR_WDT_WDTCSR_WDE | AVR_WDT_WDTCSR_WDP;
+    uint8_t arm = AVR_WDT_WDTCSR_WDCE | AVR_WDT_WDTCSR_WDE;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    bool was_enabled = avr_wdt_enabled(s);
+    uint8_t wdtcsr = s->wdtcsr;
+
+    if (value & AVR_WDT_WDTCSR_WDIF) {
+        /* Cleared by writing one */
+        wdtcsr &= ~AVR_WDT_WDTCSR_WDIF;
+        qemu_irq_lower(s->irq);
+    }
+    if (!(value & AVR_WDT_WDTCSR_WDIE)) {
+        qemu_irq_lower(s->irq);
+    }
+    wdtcsr = (wdtcsr & ~AVR_WDT_WDTCSR_WDIE) | (value & AVR_WDT_WDTCSR_WDIE);
+
+    if (s->change_enabled) {
+        wdtcsr = (wdtcsr & ~locked) | (value & locked);
+    } else {
+        wdtcsr |= value & AVR_WDT_WDTCSR_WDE;
+    }
+    /* WDRF keeps the watchdog in system reset mode until it is cleared */
+    if (s->mcusr & AVR_WDT_MCUSR_WDRF) {
+        wdtcsr |= AVR_WDT_WDTCSR_WDE;
+    }
+    s->change_enabled = (value & arm) == arm;
+    s->wdtcsr = wdtcsr;
+
+    if (!was_enabled && avr_wdt_enabled(s)) {
+        avr_wdt_restart(s, now);
+    }
+    avr_wdt_schedule(s, now);
+}
+
+/* The CPU entered the watchdog vector, which clears WDIF */
+static void avr_wdt_ack(void *opaque, int n, int level)
+{
+    AVRWdtState *s = opaque;
+
+    if (level) {
+        s->wdtcsr &= ~AVR_WDT_WDTCSR_WDIF;
+        if (s->wdtcsr & AVR_WDT_WDTCSR_WDE) {
+            /* Interrupt and system reset mode, the next timeout resets */
+            s->wdtcsr &= ~AVR_WDT_WDTCSR_WDIE;
+        }
+        qemu_irq_lower(s->irq);
+    }
+}
+
+static uint64_t avr_wdt_mcusr_read(void *opaque, hwaddr addr,
+                                   unsigned int size)
+{
+    AVRWdtState *s = opaque;
+
+    assert(size == 1);
+    return s->mcusr;
+}
+
+static void avr_wdt_mcusr_write(void *opaque, hwaddr addr, uint64_t value,
+                                unsigned int size)
+{
+    AVRWdtState *s = opaque;
+
+    assert(size == 1);
+    /* Flags are cleared by writing zero, and only set by resets */
+    s->mcusr &= value;
+}
+
+static uint64_t avr_wdt_wdtcsr_read(void *opaque, hwaddr addr,
+                                    unsigned int size)
+{
+    AVRWdtState *s = opaque;
+
+    assert(size == 1);
+    return s->wdtcsr | (s->change_enabled ? AVR_WDT_WDTCSR_WDCE : 0);
+}
+
+static void avr_wdt_wdtcsr_write(void *opaque, hwaddr addr, uint64_t value,
+                                 unsigned int size)
+{
+    assert(size == 1);
+    avr_wdt_write_wdtcsr(opaque, value);
+}
+
+static const MemoryRegionOps avr_wdt_mcusr_ops = {
+    .read = avr_wdt_mcusr_read,
+    .write = avr_wdt_mcusr_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static const MemoryRegionOps avr_wdt_wdtcsr_ops = {
+    .read = avr_wdt_wdtcsr_read,
+    .write = avr_wdt_wdtcsr_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void avr_wdt_reset(DeviceState *dev)
+{
+    AVRWdtState *s = AVR_WDT(dev);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* Anything but the first reset and the watchdog's is an external one */
+    if (!s->powered_on) {
+        s->mcusr = AVR_WDT_MCUSR_PORF;
+        s->powered_on = true;
+    } else if (s->reset_pending) {
+        s->mcusr |= AVR_WDT_MCUSR_WDRF;
+    } else {
+        s->mcusr |= AVR_WDT_MCUSR_EXTRF;
+    }
+    s->reset_pending = false;
+
+    /* After a watchdog reset it keeps running, with the shortest period */
+    s->wdtcsr = (s->mcusr & AVR_WDT_MCUSR_WDRF) ? AVR_WDT_WDTCSR_WDE : 0;
+    s->change_enabled = false;
+    qemu_irq_lower(s->irq);
+
+    avr_wdt_restart(s, now);
+    avr_wdt_schedule(s, now);
+}
+
+static void avr_wdt_realize(DeviceState *dev, Error **errp)
+{
+    AVRWdtState *s = AVR_WDT(dev);
+
+    if (!s->cpu) {
+        error_setg(errp, "avr-wdt: 'cpu' link not set");
+        return;
+    }
+}
+
+static void avr_wdt_init(Object *obj)
+{
+    AVRWdtState *s = AVR_WDT(obj);
+
+    sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->system_reset, AVR_WDT_RESET, 1);
+    qdev_init_gpio_in_named(DEVICE(obj), avr_wdt_ack, AVR_INTC_ACK, 1);
+
+    memory_region_init_io(&s->mcusr_iomem, obj, &avr_wdt_mcusr_ops, s,
+                          TYPE_AVR_WDT ".mcusr", 1);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mcusr_iomem);
+    memory_region_init_io(&s->wdtcsr_iomem, obj, &avr_wdt_wdtcsr_ops, s,
+                          TYPE_AVR_WDT ".wdtcsr", 1);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->wdtcsr_iomem);
+
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, avr_wdt_timer, s);
+}
+
+static int avr_wdt_pre_save(void *opaque)
+{
+    AVRWdtState *s = opaque;
+
+    s->saved_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    /* The flag in the CPU state isn't saved, take the WDR it holds now */
+    if (atomic_xchg(&s->cpu->env.wdr, 0)) {
+        s->kick_ns = s->saved_ns;
+    }
+    return 0;
+}
+
+/*
+ * The virtual clock doesn't go back when an in-process snapshot is restored,
+ * time out as long after the load as was left when the state was saved.
+ */
+static int avr_wdt_post_load(void *opaque, int version_id)
+{
+    AVRWdtState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->kick_ns += now - s->saved_ns;
+    atomic_set(&s->cpu->env.wdr, 0);
+    avr_wdt_schedule(s, now);
+    return 0;
+}
+
+static const VMStateDescription vmstate_avr_wdt = {
+    .name = "avr-wdt",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = avr_wdt_pre_save,
+    .post_load = avr_wdt_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(mcusr, AVRWdtState),
+        VMSTATE_UINT8(wdtcsr, AVRWdtState),
+        VMSTATE_BOOL(change_enabled, AVRWdtState),
+        VMSTATE_INT64(kick_ns, AVRWdtState),
+        VMSTATE_INT64(saved_ns, AVRWdtState),
+        VMSTATE_BOOL(reset_pending, AVRWdtState),
+        VMSTATE_BOOL(powered_on, AVRWdtState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property avr_wdt_properties[] = {
+    DEFINE_PROP_LINK("cpu", AVRWdtState, cpu, TYPE_AVR_CPU, AVRCPU *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void avr_wdt_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = avr_wdt_realize;
+    dc->reset = avr_wdt_reset;
+    dc->vmsd = &vmstate_avr_wdt;
+    dc->props = avr_wdt_properties;
+    set_bit(DEVICE_CATEGORY_WATCHDOG, dc->categories);
+}
+
+static const TypeInfo avr_wdt_info = {
+    .name          = TYPE_AVR_WDT,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AVRWdtState),
+    .instance_init = avr_wdt_init,
+    .class_init    = avr_wdt_class_init,
+};
+
+static void avr_wdt_register_types(void)
+{
+    type_register_static(&avr_wdt_info);
+}
+
+type_init(avr_wdt_register_types)
@@ -0,0 +1,68 @@
+/*
+ * AVR MCU descriptions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * What a board needs to know to build an AVR part: the CPU model, memory
+ * sizes and each built-in peripheral with its registers and interrupts.
+ * Descriptions are GKeyFile files, so a new part needs no rebuild.  The
+ * [mcu] group has cpu, the CPU model as in -cpu, flash-size, sram-size (of
+ * the data space up to the end of SRAM) and num-irq (vectors, not counting
+ * reset).  Every other group is a peripheral:
+ *
+ *   [usart0]
+ *   type=avr-usart
+ *   base=0xc0
+ *   irq=24;25;26
+ *   prr=0x64;0x02
+ *   cpu-frequency-hz=16000000
+ *
+ * type is its QOM type, base the data address of each of its MMIO regions
+ * and irq the interrupt each of its IRQ outputs is connected to, counting
+ * from 0 for the vector after reset.  prr is the power reduction register and the
+ * bit in it that turns the peripheral off.  Other keys are set as
+ * properties of the peripheral.  Numbers may be decimal or hexadecimal.
+ */
+
+#ifndef HW_AVR_MCU_H
+#define HW_AVR_MCU_H
+
+#include "exec/hwaddr.h"
+
+#define AVR_MCU_MAX_REGIONS 16
+#define AVR_MCU_MAX_IRQS 8
+
+typedef struct {
+    char *name;
+    char *type;
+    hwaddr base[AVR_MCU_MAX_REGIONS];
+    uint32_t num_base;
+    uint32_t irq[AVR_MCU_MAX_IRQS];
+    uint32_t num_irq;
+    /* Power reduction register, if prr_mask isn't 0 */
+    hwaddr prr_address;
+    uint8_t prr_mask;
+    /* Other properties, as NULL terminated pairs of name and value */
+    char **props;
+} AVRPeriphDesc;
+
+typedef struct {
+    char *cpu_type;
+    uint32_t flash_size;
+    uint32_t sram_size;
+    uint32_t num_irq;
+    AVRPeriphDesc *periph;
+    uint32_t num_periph;
+} AVRMcuDesc;
+
+/*
+ * Parse the description in @filename, or the built-in ATmega2560 one if it
+ * is NULL.  Each file is only parsed once, later calls return the same
+ * description.
+ */
+const AVRMcuDesc *avr_mcu_desc_get(const char *filename, Error **errp);
+
+#endif /* HW_AVR_MCU_H */
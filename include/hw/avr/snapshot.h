@@ -0,0 +1,31 @@
+/*
+ * AVR in-process machine snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A single snapshot of the CPUs, the devices' migration state and the memory
+ * the board registered, kept in QEMU's own memory and restored without
+ * touching the translation block cache.  Meant for fuzzers that run the same
+ * firmware from the same point over and over, see the avr-snapshot-save and
+ * avr-snapshot-load QMP commands.
+ */
+
+#ifndef HW_AVR_SNAPSHOT_H
+#define HW_AVR_SNAPSHOT_H
+
+#include "exec/memory.h"
+#include "monitor/monitor.h"
+
+/*
+ * Include a RAM or ROM region in the snapshot.  Only the pages written to
+ * since the last save or load are copied back on load.
+ */
+void avr_snapshot_add_memory(MemoryRegion *mr);
+
+void hmp_avr_snapshot_save(Monitor *mon, const QDict *qdict);
+void hmp_avr_snapshot_load(Monitor *mon, const QDict *qdict);
+
+#endif /* HW_AVR_SNAPSHOT_H */
@@ -29,6 +29,8 @@
 #include "hw/sysbus.h"
 #include "chardev/char-fe.h"
 #include "hw/hw.h"
+#include "qemu/fifo8.h"
+#include "qemu/timer.h"
 
 /* Offsets of registers. */
 #define USART_DR   0x06
@@ -42,6 +44,7 @@
 #define USART_CSRA_RXC    (1 << 7)
 #define USART_CSRA_TXC    (1 << 6)
 #define USART_CSRA_DRE    (1 << 5)
+#define USART_CSRA_U2X    (1 << 1)
 #define USART_CSRA_MPCM   (1 << 0)
 
 #define USART_CSRB_RXCIE  (1 << 7)
@@ -57,6 +60,7 @@
 #define USART_CSRC_MSEL0  (1 << 6)
 #define USART_CSRC_PM1    (1 << 5)
 #define USART_CSRC_PM0    (1 << 4)
+#define USART_CSRC_USBS   (1 << 3)
 #define USART_CSRC_CSZ1   (1 << 2)
 #define USART_CSRC_CSZ0   (1 << 1)
 
@@ -76,10 +80,32 @@ typedef struct {
     /* Address of Power Reduction Register and bit that controls this UART */
     hwaddr prr_address;
     uint8_t prr_mask;
+    /* Address space prr_address is in, the system one if NULL */
+    AddressSpace *prr_as;
 
     uint8_t data;
     bool data_valid;
     uint8_t char_mask;
+
+    /*
+     * Characters received from the chardev that the receiver hasn't got to
+     * yet, and characters written to UDR that haven't been sent on.  Both
+     * move at the baud rate set by UBRR.
+     */
+    Fifo8 rx_fifo;
+    Fifo8 tx_fifo;
+    uint32_t rx_fifo_size;
+    uint32_t tx_fifo_size;
+    QEMUTimer *rx_timer;
+    QEMUTimer *tx_timer;
+    /* Earliest time the next character can be moved into UDR */
+    int64_t rx_next_ns;
+    /* Time the last character in tx_fifo has been shifted out */
+    int64_t tx_end_ns;
+    /* Virtual time when the state was saved, the two above are rebased */
+    int64_t saved_ns;
+    uint64_t cpu_freq_hz;
+
     /* Control and Status Registers */
     uint8_t csra;
     uint8_t csrb;
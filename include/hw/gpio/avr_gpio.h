@@ -0,0 +1,101 @@
+/*
+ * AVR GPIO ports
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The general purpose IO ports of an AVR device, each with its PINx, DDRx
+ * and PORTx registers.  Port n is sysbus MMIO region n, and its pins are GPIO
+ * lines 8 * n to 8 * n + 7 both ways: outputs follow the pins the firmware
+ * drives, inputs set the level of the others.
+ *
+ * Pin changes can also be streamed to the "chardev" backend as a sequence
+ * of AVRGpioEvent records, which are buffered and written out in batches.
+ */
+
+#ifndef HW_GPIO_AVR_GPIO_H
+#define HW_GPIO_AVR_GPIO_H
+
+#include "hw/sysbus.h"
+#include "chardev/char-fe.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+/* Offsets of registers */
+#define GPIO_PIN   0x00
+#define GPIO_DDR   0x01
+#define GPIO_PORT  0x02
+
+/* Ports A to L, there is no port I */
+#define AVR_GPIO_MAX_PORTS 11
+
+/*
+ * Record of the event stream, all fields are little endian.  One is written
+ * whenever the level or direction of any pin of a port changes.
+ */
+typedef struct QEMU_PACKED {
+    /* QEMU_CLOCK_VIRTUAL time of the change */
+    uint64_t time_ns;
+    /* Port index, 0 is port A */
+    uint8_t port;
+    /* Pin levels and DDRx after the change */
+    uint8_t pins;
+    uint8_t ddr;
+    /* AVR_GPIO_EVENT_* */
+    uint8_t flags;
+} AVRGpioEvent;
+
+/* Events were dropped before this one because the buffer was full */
+#define AVR_GPIO_EVENT_LOST 0x01
+
+#define TYPE_AVR_GPIO "avr-gpio"
+#define AVR_GPIO(obj) \
+    OBJECT_CHECK(AVRGpioState, (obj), TYPE_AVR_GPIO)
+
+typedef struct AVRGpioState AVRGpioState;
+
+typedef struct {
+    MemoryRegion iomem;
+    AVRGpioState *gpio;
+    uint8_t index;
+
+    /* Registers */
+    uint8_t ddr;
+    uint8_t port;
+    /*
+     * Levels of the GPIO input lines, and which of them have been set.
+     * Input pins no line drives follow their pull-up, i.e. PORTx.
+     */
+    uint8_t input;
+    uint8_t driven;
+    /* Pin levels and directions last reported */
+    uint8_t pins;
+    uint8_t reported_ddr;
+} AVRGpioPort;
+
+struct AVRGpioState {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    AVRGpioPort ports[AVR_GPIO_MAX_PORTS];
+    uint32_t num_ports;
+    qemu_irq out[AVR_GPIO_MAX_PORTS * 8];
+
+    /* Event stream */
+    CharBackend chr;
+    uint32_t buffer_size;
+    uint32_t flush_delay_ms;
+    /* Ring of buffer_size bytes, events start at head */
+    uint8_t *buffer;
+    uint32_t head;
+    uint32_t len;
+    bool lost;
+    guint watch_tag;
+    QEMUTimer *flush_timer;
+    VMChangeStateEntry *vmstate;
+};
+
+#endif /* HW_GPIO_AVR_GPIO_H */
@@ -0,0 +1,60 @@
+/*
+ * AVR interrupt controller
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * AVR devices have no programmable interrupt controller, each peripheral
+ * has its own enable and flag bits and the vector number fixes the priority.
+ * This device collects the peripherals' interrupt lines for the CPU, picks
+ * the vector to enter and keeps per-vector statistics.
+ *
+ * Entering a vector clears the peripheral's flag on AVR devices.  The
+ * device pulses line n of its AVR_INTC_ACK GPIO outputs when the CPU enters
+ * the vector of line n, for peripherals with flags to clear to connect to
+ * their own AVR_INTC_ACK inputs, one per IRQ.
+ */
+
+#ifndef HW_INTC_AVR_INTC_H
+#define HW_INTC_AVR_INTC_H
+
+#include "hw/sysbus.h"
+#include "target/avr/cpu.h"
+
+#define TYPE_AVR_INTC "avr-intc"
+#define AVR_INTC(obj) \
+    OBJECT_CHECK(AVRIntcState, (obj), TYPE_AVR_INTC)
+
+/* Interrupt lines, not counting reset, the ATmega2560 has 56 */
+#define AVR_INTC_MAX_IRQ 64
+
+/* Name of the GPIOs that acknowledge interrupts */
+#define AVR_INTC_ACK "avr-intc-ack"
+
+typedef struct AVRIntcState {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    AVRCPU *cpu;
+    uint32_t num_irq;
+
+    /* Pulsed when the CPU enters the vector of each line */
+    qemu_irq ack[AVR_INTC_MAX_IRQ];
+
+    /* Bit n is set while line n is pending, lower lines take priority */
+    uint64_t pending;
+    /* QEMU_CLOCK_VIRTUAL time at which each pending line was raised */
+    int64_t raised_ns[AVR_INTC_MAX_IRQ];
+    /* QEMU_CLOCK_VIRTUAL when the state was saved */
+    int64_t saved_ns;
+
+    /* Per line statistics since reset, readable with qom-get */
+    uint64_t count[AVR_INTC_MAX_IRQ];
+    uint64_t latency_ns[AVR_INTC_MAX_IRQ]; /* total from raise to entry */
+    uint64_t max_latency_ns[AVR_INTC_MAX_IRQ];
+} AVRIntcState;
+
+#endif /* HW_INTC_AVR_INTC_H */
@@ -0,0 +1,78 @@
+/*
+ * AVR EEPROM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The EEPROM of megaAVR devices, accessed a byte at a time through the
+ * EECR, EEDR and EEARL/EEARH registers.  Its contents are kept in memory and
+ * written back to the "drive" block backend, if there is one, some time
+ * after they change, so firmware that writes a lot doesn't wait for the host
+ * on every byte.
+ */
+
+#ifndef HW_NVRAM_AVR_EEPROM_H
+#define HW_NVRAM_AVR_EEPROM_H
+
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/sysemu.h"
+
+/* Offsets of registers, EECR is at IO address 0x1f on the ATmega2560 */
+#define EEPROM_CR   0x00
+#define EEPROM_DR   0x01
+#define EEPROM_ARL  0x02
+#define EEPROM_ARH  0x03
+
+/* Relevant bits in EECR */
+#define EEPROM_CR_EERE   (1 << 0)
+#define EEPROM_CR_EEPE   (1 << 1)
+#define EEPROM_CR_EEMPE  (1 << 2)
+#define EEPROM_CR_EERIE  (1 << 3)
+#define EEPROM_CR_EEPM   (3 << 4)
+
+#define TYPE_AVR_EEPROM "avr-eeprom"
+#define AVR_EEPROM(obj) \
+    OBJECT_CHECK(AVREepromState, (obj), TYPE_AVR_EEPROM)
+
+typedef struct {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    MemoryRegion iomem;
+    BlockBackend *blk;
+    uint32_t size;
+    /* Keep EEPE set for as long as the part takes to program a byte */
+    bool write_delay;
+    /* How long changed contents may stay unwritten to the backend */
+    uint32_t flush_delay_ms;
+
+    uint8_t *mem;
+    /* Range of mem that differs from the backend, empty if lo >= hi */
+    uint32_t dirty_lo;
+    uint32_t dirty_hi;
+    QEMUTimer *flush_timer;
+    VMChangeStateEntry *vmstate;
+
+    /* Clears EEPE at the end of a write */
+    QEMUTimer *write_timer;
+    /* Virtual time at which the write in progress ends */
+    int64_t write_end_ns;
+    /* Virtual time when the state was saved, write_end_ns is rebased */
+    int64_t saved_ns;
+
+    /* Control, data and address registers */
+    uint8_t cr;
+    uint8_t dr;
+    uint8_t arl;
+    uint8_t arh;
+
+    /* EEPROM Ready */
+    qemu_irq ready_irq;
+} AVREepromState;
+
+#endif /* HW_NVRAM_AVR_EEPROM_H */
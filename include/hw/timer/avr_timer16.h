@@ -36,14 +36,6 @@
 #include "qemu/timer.h"
 #include "hw/hw.h"
 
-enum NextInterrupt {
-    OVERFLOW,
-    COMPA,
-    COMPB,
-    COMPC,
-    CAPT
-};
-
 #define TYPE_AVR_TIMER16 "avr-timer16"
 #define AVR_TIMER16(obj) \
     OBJECT_CHECK(AVRTimer16State, (obj), TYPE_AVR_TIMER16)
@@ -92,8 +84,12 @@ typedef struct AVRTimer16State {
     uint64_t cpu_freq_hz;
     uint64_t freq_hz;
     uint64_t period_ns;
+    /* Virtual time at which the counter was zero */
     uint64_t reset_time_ns;
-    enum NextInterrupt next_interrupt;
+    /* Timer ticks since reset_time_ns that events have been raised for */
+    uint64_t sync_ticks;
+    /* Virtual time when the state was saved, see avr_timer16_post_load() */
+    int64_t saved_ns;
 } AVRTimer16State;
 
 #endif /* AVR_TIMER16_H */
@@ -0,0 +1,78 @@
+/*
+ * AVR watchdog timer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The watchdog of megaAVR devices, with its WDTCSR control register and
+ * the MCUSR reset flags.  MCUSR is MMIO region 0 and WDTCSR region 1, the
+ * watchdog interrupt is IRQ 0 and AVR_INTC_ACK input 0 acknowledges it.
+ * When it times out in system reset mode, it does what -watchdog-action
+ * says.  The default reset pulses the AVR_WDT_RESET output, which the board
+ * connects to reset the watchdog's own system, and resets the whole machine
+ * if the output isn't connected.
+ *
+ * WDR doesn't call into the device: it sets a flag in the CPU state given by
+ * the "cpu" link, which the device looks at a few times per timeout period.
+ */
+
+#ifndef HW_WATCHDOG_AVR_WDT_H
+#define HW_WATCHDOG_AVR_WDT_H
+
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "target/avr/cpu.h"
+
+/* Relevant bits in MCUSR */
+#define AVR_WDT_MCUSR_PORF   (1 << 0)
+#define AVR_WDT_MCUSR_EXTRF  (1 << 1)
+#define AVR_WDT_MCUSR_WDRF   (1 << 3)
+#define AVR_WDT_MCUSR_MASK   0x1f
+
+/* Relevant bits in WDTCSR */
+#define AVR_WDT_WDTCSR_WDP   0x27
+#define AVR_WDT_WDTCSR_WDE   (1 << 3)
+#define AVR_WDT_WDTCSR_WDCE  (1 << 4)
+#define AVR_WDT_WDTCSR_WDIE  (1 << 6)
+#define AVR_WDT_WDTCSR_WDIF  (1 << 7)
+
+/* Name of the GPIO output that asks for a system reset */
+#define AVR_WDT_RESET "avr-wdt-reset"
+
+#define TYPE_AVR_WDT "avr-wdt"
+#define AVR_WDT(obj) \
+    OBJECT_CHECK(AVRWdtState, (obj), TYPE_AVR_WDT)
+
+typedef struct {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    MemoryRegion mcusr_iomem;
+    MemoryRegion wdtcsr_iomem;
+    AVRCPU *cpu;
+
+    /* Registers */
+    uint8_t mcusr;
+    uint8_t wdtcsr;
+    /* WDCE was set by the previous write to WDTCSR */
+    bool change_enabled;
+
+    /* Checks for WDR and times the watchdog out */
+    QEMUTimer *timer;
+    /* QEMU_CLOCK_VIRTUAL time of the last WDR seen, or of enabling */
+    int64_t kick_ns;
+    /* Virtual time when the state was saved, kick_ns is rebased */
+    int64_t saved_ns;
+    /* The next reset is the watchdog's */
+    bool reset_pending;
+    /* The machine has been reset since it was created */
+    bool powered_on;
+
+    qemu_irq irq;
+    qemu_irq system_reset;
+} AVRWdtState;
+
+#endif /* HW_WATCHDOG_AVR_WDT_H */
@@ -90,6 +90,9 @@
 #include "hw/s390x/storage-keys.h"
 #include "hw/s390x/storage-attributes.h"
 #endif
+#if defined(TARGET_AVR)
+#include "hw/avr/snapshot.h"
+#endif
 
 /*
  * Supported types:
@@ -0,0 +1,317 @@
+#!/usr/bin/env python
+#
+# AVR instruction decoder generator.
+#
+# Copyright (c) 2019 University of Kent
+# Author: Sarah Harris
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+
+#
+# # Why is this here?
+# This takes the list of human readable descriptions of instructions in
+# target/avr/insn.def and uses it to build a binary decision tree used to
+# choose translation functions for opcodes.
+# It's built like this because figuring out the structure of AVR instructions
+# was too hard and writing a Big Nested Switch by hand seemed too painful.
+#
+# # How does it work?
+# This is based J. R. Quinlan's ID3 algorithm, tweaked to add weights to each
+# instruction.
+# Having a binary tree branch on opcode bits seems obvious, but the awkward
+# part is deciding which order to test the bits.
+# Getting the order right means that redundant bits can be ignored and fewer
+# branches are needed; i.e. less memory and faster lookups.
+# Here, the tests are ordered by an estimate of information gain based on
+# Shannon Entropy.
+# In short, we guess how much each bit tells us and pick the one that gives
+# us most progress toward knowing which instruction we're seeing.
+# The weights are currently only used to prioritise legal opcodes over
+# illegal opcodes, which significantly reduces the tree size.
+#
+# # Why is this done at build time?
+# The tree used to be built by QEMU during startup, which cost a noticeable
+# amount of time for short runs and left the tree scattered across the heap.
+# Emitting it as a const array means startup does no decoder construction and
+# lookups walk a single contiguous block of memory.
+#
+# # What's the flat table?
+# With --flat, the tree is expanded into a table with one byte per 16 bit
+# opcode, so decoding is a single indexed load instead of a tree walk.
+# It takes 64KiB rather than a couple of KiB, which still fits comfortably in
+# the L2 cache of any host we care about.
+# Only the first 16 bits of an opcode are needed to identify the instruction,
+# the bits following in 32 bit instructions are just operands.
+#
+
+import re
+import sys
+import getopt
+from math import log
+
+# Wide enough for the largest AVR instruction.
+OPCODE_SIZE = 16
+
+# Probability estimate for each instruction.
+# Larger values mean higher priority.
+WEIGHT_LEGAL = 1 << 16
+WEIGHT_ILLEGAL = 1
+
+# Set in flat table entries for 32 bit instructions, see AVR_DECODE_FLAT_LONG
+FLAT_LONG = 0x80
+
+output_file = None
+
+
+def error(*args):
+    sys.stderr.write('avrdecode: ' + ' '.join(str(a) for a in args) + '\n')
+    sys.exit(1)
+
+
+class Pattern:
+    """Bit pattern matched by an instruction"""
+    def __init__(self, name, text):
+        self.name = name
+        self.length = 0
+        self.weight = WEIGHT_LEGAL
+        # For each 1 in mask, the same bit in the opcode must match bits.
+        self.bits = 0
+        self.mask = 0
+        bit = 1 << (OPCODE_SIZE - 1)
+        for c in text:
+            if c == '_':
+                continue
+            if c == '0':
+                self.mask |= bit
+            elif c == '1':
+                self.bits |= bit
+                self.mask |= bit
+            elif c != '*':
+                error('bad character', repr(c), 'in pattern for', name)
+            bit >>= 1
+            self.length += 1
+        if self.length not in (16, 32):
+            error('pattern for', name, 'is', self.length, 'bits long')
+
+    def matches(self, bits, mask):
+        overlap = self.mask & mask
+        return (self.bits & overlap) == (bits & overlap)
+
+
+def parse_file(f):
+    """Return the list of patterns described by an insn.def file"""
+    patterns = []
+    insn_re = re.compile(r'^AVR_INSN\(\s*(\w+)\s*,\s*"([01*_]+)"\s*\)')
+    for line in f:
+        m = insn_re.match(line)
+        if m:
+            patterns.append(Pattern(m.group(1), m.group(2)))
+    if not patterns:
+        error('no instructions found')
+    return patterns
+
+
+def count_opcodes(mask):
+    """Return the number of opcodes that could match a bit pattern"""
+    return 1 << (OPCODE_SIZE - bin(mask).count('1'))
+
+
+def count_legal(patterns, bits, mask):
+    return sum(1 for p in patterns if p.matches(bits, mask))
+
+
+def count_illegal(patterns, bits, mask):
+    """Return one if any opcode allowed by a bit pattern is illegal"""
+    no_legal = 0
+    for p in patterns:
+        if p.matches(bits, mask):
+            no_legal += count_opcodes(mask | p.mask)
+    no_opcodes = count_opcodes(mask)
+    assert no_legal <= no_opcodes
+    return 0 if no_legal == no_opcodes else 1
+
+
+def weigh_matches(patterns, bits, mask):
+    """Return sum of weights of instructions that match a bit pattern"""
+    illegal = count_illegal(patterns, bits, mask) * WEIGHT_ILLEGAL
+    legal = sum(p.weight for p in patterns if p.matches(bits, mask))
+    return legal + illegal
+
+
+def subtree_effort(patterns, bits, mask, parent_weight):
+    """Return estimated information needed to decide a subtree's outcome"""
+    weight = weigh_matches(patterns, bits, mask)
+    entropy_legal = 0.0
+    for p in patterns:
+        if p.matches(bits, mask):
+            probability = float(p.weight) / weight
+            entropy_legal -= probability * log(probability, 2)
+    probability = float(WEIGHT_ILLEGAL) / weight
+    entropy_illegal = -probability * log(probability, 2) * \
+        count_illegal(patterns, bits, mask)
+    return (float(weight) / parent_weight) * (entropy_legal + entropy_illegal)
+
+
+class Leaf:
+    def __init__(self, name, length):
+        self.name = name
+        self.length = length
+
+
+class Branch:
+    def __init__(self, bit, zero, one):
+        self.bit = bit
+        self.zero = zero
+        self.one = one
+
+
+def build_tree(patterns, bits, mask):
+    """Return recursively built tree for decoding an opcode to instruction"""
+    matching_illegal = count_illegal(patterns, bits, mask)
+    matching_legal = count_legal(patterns, bits, mask)
+    if matching_legal == 0:
+        return Leaf(None, 16)
+    if matching_legal == 1 and matching_illegal == 0:
+        p = [p for p in patterns if p.matches(bits, mask)][0]
+        return Leaf(p.name, p.length)
+
+    # Work out which bit to branch on
+    tree_weight = weigh_matches(patterns, bits, mask)
+    min_bit = None
+    min_effort = 0.0
+    for i in range(OPCODE_SIZE):
+        bit = 1 << i
+        if mask & bit:
+            continue
+        effort = subtree_effort(patterns, bits, mask | bit, tree_weight) + \
+            subtree_effort(patterns, bits | bit, mask | bit, tree_weight)
+        if min_bit is None or effort < min_effort:
+            min_bit = i
+            min_effort = effort
+    if min_bit is None:
+        error('multiple instructions match opcode bits', hex(bits))
+
+    bit = 1 << min_bit
+    zero = build_tree(patterns, bits, mask | bit)
+    one = build_tree(patterns, bits | bit, mask | bit)
+    return Branch(min_bit, zero, one)
+
+
+def flatten(tree):
+    """
+    Return the tree as a list of nodes in depth-first order, so that the
+    zero child of a branch always immediately follows it.
+    """
+    nodes = []
+
+    def visit(node):
+        index = len(nodes)
+        nodes.append(node)
+        if isinstance(node, Branch):
+            node.zero_index = visit(node.zero)
+            node.one_index = visit(node.one)
+        return index
+
+    visit(tree)
+    return nodes
+
+
+def insn_enum(name):
+    if name is None:
+        return 'AVR_INSN_ILLEGAL'
+    return 'AVR_INSN_' + name
+
+
+def output_tree(out, nodes):
+    out.write('static const AVRDecodeNode avr_decode_tree[%d] = {\n'
+              % len(nodes))
+    for i, node in enumerate(nodes):
+        if isinstance(node, Branch):
+            out.write('    /* %4d */ { %2d,  0, { %4d, %4d } },\n'
+                      % (i, node.bit, node.zero_index, node.one_index))
+        else:
+            out.write('    /* %4d */ { AVR_DECODE_LEAF, %2d, { %s, 0 } },\n'
+                      % (i, node.length, insn_enum(node.name)))
+    out.write('};\n')
+
+
+def output_flat(out, patterns, tree):
+    # Entries are AVRInsnId values, check they agree with the C enum
+    out.write('QEMU_BUILD_BUG_ON(AVR_INSN_ILLEGAL != %d);\n\n' % len(patterns))
+    if len(patterns) >= FLAT_LONG:
+        error('too many instructions for the flat table')
+    ids = dict((p.name, i) for i, p in enumerate(patterns))
+    ids[None] = len(patterns)
+
+    out.write('static const uint8_t avr_decode_flat_table[1 << %d] = {\n'
+              % OPCODE_SIZE)
+    for base in range(0, 1 << OPCODE_SIZE, 16):
+        entries = []
+        for opcode in range(base, base + 16):
+            node = tree
+            while isinstance(node, Branch):
+                node = node.one if (opcode >> node.bit) & 1 else node.zero
+            entry = ids[node.name]
+            if node.length == 32:
+                entry |= FLAT_LONG
+            entries.append('%3d' % entry)
+        out.write('    /* 0x%04x */ %s,\n' % (base, ', '.join(entries)))
+    out.write('};\n')
+
+
+def main():
+    global output_file
+
+    flat = False
+    try:
+        (opts, args) = getopt.getopt(sys.argv[1:], 'o:',
+                                     ['output=', 'flat'])
+    except getopt.GetoptError as err:
+        error(err)
+    for o, a in opts:
+        if o in ('-o', '--output'):
+            output_file = a
+        elif o == '--flat':
+            flat = True
+        else:
+            assert False, 'unhandled option'
+    if len(args) != 1:
+        error('expected exactly one input file')
+
+    with open(args[0], 'r') as f:
+        patterns = parse_file(f)
+
+    tree = build_tree(patterns, 0, 0)
+
+    if output_file:
+        out = open(output_file, 'w')
+    else:
+        out = sys.stdout
+    out.write('/* This file is autogenerated by scripts/avrdecode.py.  */\n\n')
+    if flat:
+        output_flat(out, patterns, tree)
+    else:
+        output_tree(out, flatten(tree))
+    if output_file:
+        out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -50,6 +50,10 @@ typedef struct AVRCPUClass {
 /**
  *  AVRCPU:
  *  @env: #CPUAVRState
+ *  @flat_decoder: Decode with a flat opcode table instead of the tree.
+ *  @coverage_shm_id: SysV shared memory segment to count TB edges in, as
+ *  passed to the target in __AFL_SHM_ID, or -1 not to instrument TBs.
+ *  @coverage: The segment, attached when the CPU is realized.
  *
  *  A AVR CPU.
  */
@@ -59,6 +63,11 @@ typedef struct AVRCPU {
     /*< public >*/
 
     CPUAVRState env;
+
+    bool flat_decoder;
+    uint32_t spm_page_size; /* flash page size for SPM, in bytes */
+    int32_t coverage_shm_id;
+    uint8_t *coverage;
 } AVRCPU;
 
 static inline AVRCPU *avr_env_get_cpu(CPUAVRState *env)
@@ -20,10 +20,16 @@
 
 #include "qemu/osdep.h"
 #include "qemu/qemu-print.h"
+#include "qemu/host-utils.h"
 #include "qapi/error.h"
 #include "cpu.h"
+#include "decode.h"
 #include "qemu-common.h"
 #include "migration/vmstate.h"
+#include "hw/qdev-properties.h"
+#ifdef CONFIG_POSIX
+#include <sys/shm.h>
+#endif
 
 static void avr_cpu_set_pc(CPUState *cs, vaddr value)
 {
@@ -66,6 +72,7 @@ static void avr_cpu_reset(CPUState *s)
     env->sregS = 0;
     env->sregH = 0;
     env->sregT = 0;
+    env->cc_op = AVR_CC_OP_FLAGS;
 
     env->rampD = 0;
     env->rampX = 0;
@@ -76,21 +83,70 @@ static void avr_cpu_reset(CPUState *s)
 
     memset(env->r, 0, sizeof(env->r));
 
+    env->spmcsr = 0;
+    memset(env->spm_buffer, 0xff, sizeof(env->spm_buffer));
+
+    env->cov_prev = 0;
+    env->wdr = 0;
+
     tlb_flush(s);
 }
 
 static void avr_cpu_disas_set_info(CPUState *cpu, disassemble_info *info)
 {
     info->mach = bfd_arch_avr;
-    info->print_insn = NULL;
+    info->print_insn = print_insn_avr;
+}
+
+static void avr_cpu_attach_coverage(AVRCPU *cpu, Error **errp)
+{
+#ifdef CONFIG_POSIX
+    struct shmid_ds ds;
+    void *map;
+
+    if (shmctl(cpu->coverage_shm_id, IPC_STAT, &ds) < 0) {
+        error_setg_errno(errp, errno, "cannot use coverage-shm-id %d",
+                         cpu->coverage_shm_id);
+        return;
+    }
+    if (ds.shm_segsz < AVR_COVERAGE_MAP_SIZE) {
+        error_setg(errp, "coverage-shm-id %d is smaller than %d bytes",
+                   cpu->coverage_shm_id, AVR_COVERAGE_MAP_SIZE);
+        return;
+    }
+    map = shmat(cpu->coverage_shm_id, NULL, 0);
+    if (map == (void *)-1) {
+        error_setg_errno(errp, errno, "cannot attach coverage-shm-id %d",
+                         cpu->coverage_shm_id);
+        return;
+    }
+    cpu->coverage = map;
+#else
+    error_setg(errp, "coverage-shm-id is not supported on this host");
+#endif
 }
 
 static void avr_cpu_realizefn(DeviceState *dev, Error **errp)
 {
     CPUState *cs = CPU(dev);
+    AVRCPU *cpu = AVR_CPU(dev);
     AVRCPUClass *mcc = AVR_CPU_GET_CLASS(dev);
     Error *local_err = NULL;
 
+    if (cpu->spm_page_size < 2 || cpu->spm_page_size > AVR_SPM_PAGE_MAX ||
+        !is_power_of_2(cpu->spm_page_size)) {
+        error_setg(errp, "spm-page-size must be a power of 2 between 2 and %d",
+                   AVR_SPM_PAGE_MAX);
+        return;
+    }
+    if (cpu->coverage_shm_id >= 0) {
+        avr_cpu_attach_coverage(cpu, &local_err);
+        if (local_err != NULL) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
     cpu_exec_realizefn(cs, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -102,35 +158,12 @@ static void avr_cpu_realizefn(DeviceState *dev, Error **errp)
     mcc->parent_realize(dev, errp);
 }
 
-static void avr_cpu_set_int(void *opaque, int irq, int level)
-{
-    AVRCPU *cpu = opaque;
-    CPUAVRState *env = &cpu->env;
-    CPUState *cs = CPU(cpu);
-
-    uint64_t mask = (1ull << irq);
-    if (level) {
-        env->intsrc |= mask;
-        cpu_interrupt(cs, CPU_INTERRUPT_HARD);
-    } else {
-        env->intsrc &= ~mask;
-        if (env->intsrc == 0) {
-            cpu_reset_interrupt(cs, CPU_INTERRUPT_HARD);
-        }
-    }
-}
-
 static void avr_cpu_initfn(Object *obj)
 {
     CPUState *cs = CPU(obj);
     AVRCPU *cpu = AVR_CPU(obj);
 
     cs->env_ptr = &cpu->env;
-
-#ifndef CONFIG_USER_ONLY
-    /* Set the number of interrupts supported by the CPU. */
-    qdev_init_gpio_in(DEVICE(cpu), avr_cpu_set_int, 57);
-#endif
 }
 
 static ObjectClass *avr_cpu_class_by_name(const char *cpu_model)
@@ -159,6 +192,14 @@ static ObjectClass *avr_cpu_class_by_name(const char *cpu_model)
     return NULL;
 }
 
+static Property avr_cpu_properties[] = {
+    DEFINE_PROP_BOOL("flat-decoder", AVRCPU, flat_decoder, false),
+    DEFINE_PROP_UINT32("spm-page-size", AVRCPU, spm_page_size,
+                       AVR_SPM_PAGE_MAX),
+    DEFINE_PROP_INT32("coverage-shm-id", AVRCPU, coverage_shm_id, -1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void avr_cpu_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -167,6 +208,7 @@ static void avr_cpu_class_init(ObjectClass *oc, void *data)
 
     mcc->parent_realize = dc->realize;
     dc->realize = avr_cpu_realizefn;
+    dc->props = avr_cpu_properties;
 
     mcc->parent_reset = cc->reset;
     cc->reset = avr_cpu_reset;
@@ -195,11 +237,132 @@ static void avr_cpu_class_init(ObjectClass *oc, void *data)
     cc->gdb_num_core_regs = 35;
 }
 
+/*
+ * Instruction timings, in clock cycles, from the AVR Instruction Set Manual.
+ *
+ * Conditional branches and skips are listed with their not taken cost, the
+ * translator adds the extra cycles on the taken path.  Loads and stores are
+ * timed as accesses to internal SRAM.
+ */
+#define AVR_CYCLES_COMMON \
+    [0 ... AVR_INSN_ILLEGAL - 1] = 1, \
+    [AVR_INSN_ADIW] = 2, \
+    [AVR_INSN_SBIW] = 2, \
+    [AVR_INSN_MUL] = 2, \
+    [AVR_INSN_MULS] = 2, \
+    [AVR_INSN_MULSU] = 2, \
+    [AVR_INSN_FMUL] = 2, \
+    [AVR_INSN_FMULS] = 2, \
+    [AVR_INSN_FMULSU] = 2, \
+    [AVR_INSN_RJMP] = 2, \
+    [AVR_INSN_IJMP] = 2, \
+    [AVR_INSN_EIJMP] = 2, \
+    [AVR_INSN_JMP] = 3, \
+    [AVR_INSN_LDDY] = 2, \
+    [AVR_INSN_LDDZ] = 2, \
+    [AVR_INSN_STDY] = 2, \
+    [AVR_INSN_STDZ] = 2, \
+    [AVR_INSN_POP] = 2, \
+    [AVR_INSN_LPM1] = 3, \
+    [AVR_INSN_LPM2] = 3, \
+    [AVR_INSN_LPMX] = 3, \
+    [AVR_INSN_ELPM1] = 3, \
+    [AVR_INSN_ELPM2] = 3, \
+    [AVR_INSN_ELPMX] = 3
+
+/* AVRe and AVRe+ cores, which is every core before XMEGA */
+#define AVR_CYCLES_AVRE \
+    AVR_CYCLES_COMMON, \
+    [AVR_INSN_CBI] = 2, \
+    [AVR_INSN_SBI] = 2, \
+    [AVR_INSN_LDX1] = 2, \
+    [AVR_INSN_LDX2] = 2, \
+    [AVR_INSN_LDX3] = 2, \
+    [AVR_INSN_LDY2] = 2, \
+    [AVR_INSN_LDY3] = 2, \
+    [AVR_INSN_LDZ2] = 2, \
+    [AVR_INSN_LDZ3] = 2, \
+    [AVR_INSN_LDS] = 2, \
+    [AVR_INSN_STX1] = 2, \
+    [AVR_INSN_STX2] = 2, \
+    [AVR_INSN_STX3] = 2, \
+    [AVR_INSN_STY2] = 2, \
+    [AVR_INSN_STY3] = 2, \
+    [AVR_INSN_STZ2] = 2, \
+    [AVR_INSN_STZ3] = 2, \
+    [AVR_INSN_STS] = 2, \
+    [AVR_INSN_PUSH] = 2
+
+static const uint8_t avr_cycles_avre[AVR_INSN_ILLEGAL] = {
+    AVR_CYCLES_AVRE,
+    [AVR_INSN_RCALL] = 3,
+    [AVR_INSN_ICALL] = 3,
+    [AVR_INSN_CALL] = 4,
+    [AVR_INSN_RET] = 4,
+    [AVR_INSN_RETI] = 4,
+};
+
+/* Pushing and popping a 3 byte PC takes an extra cycle */
+static const uint8_t avr_cycles_avre_3_byte_pc[AVR_INSN_ILLEGAL] = {
+    AVR_CYCLES_AVRE,
+    [AVR_INSN_RCALL] = 4,
+    [AVR_INSN_ICALL] = 4,
+    [AVR_INSN_EICALL] = 4,
+    [AVR_INSN_CALL] = 5,
+    [AVR_INSN_RET] = 5,
+    [AVR_INSN_RETI] = 5,
+};
+
+/* AVRxm cores, i.e. XMEGA */
+#define AVR_CYCLES_AVRXM \
+    AVR_CYCLES_COMMON, \
+    [AVR_INSN_SBIC] = 2, \
+    [AVR_INSN_SBIS] = 2, \
+    [AVR_INSN_LDX1] = 2, \
+    [AVR_INSN_LDX2] = 2, \
+    [AVR_INSN_LDX3] = 3, \
+    [AVR_INSN_LDY2] = 2, \
+    [AVR_INSN_LDY3] = 3, \
+    [AVR_INSN_LDZ2] = 2, \
+    [AVR_INSN_LDZ3] = 3, \
+    [AVR_INSN_LDDY] = 3, \
+    [AVR_INSN_LDDZ] = 3, \
+    [AVR_INSN_LDS] = 3, \
+    [AVR_INSN_STX3] = 2, \
+    [AVR_INSN_STY3] = 2, \
+    [AVR_INSN_STZ3] = 2, \
+    [AVR_INSN_STS] = 2, \
+    [AVR_INSN_XCH] = 2, \
+    [AVR_INSN_LAC] = 2, \
+    [AVR_INSN_LAS] = 2, \
+    [AVR_INSN_LAT] = 2
+
+static const uint8_t avr_cycles_avrxm[AVR_INSN_ILLEGAL] = {
+    AVR_CYCLES_AVRXM,
+    [AVR_INSN_RCALL] = 2,
+    [AVR_INSN_ICALL] = 2,
+    [AVR_INSN_CALL] = 3,
+    [AVR_INSN_RET] = 4,
+    [AVR_INSN_RETI] = 4,
+};
+
+static const uint8_t avr_cycles_avrxm_3_byte_pc[AVR_INSN_ILLEGAL] = {
+    AVR_CYCLES_AVRXM,
+    [AVR_INSN_RCALL] = 3,
+    [AVR_INSN_ICALL] = 3,
+    [AVR_INSN_EICALL] = 3,
+    [AVR_INSN_CALL] = 4,
+    [AVR_INSN_RET] = 5,
+    [AVR_INSN_RETI] = 5,
+};
+
 static void avr_avr1_initfn(Object *obj)
 {
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_2_BYTE_SP);
     avr_set_feature(env, AVR_FEATURE_2_BYTE_PC);
@@ -210,6 +373,8 @@ static void avr_avr2_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -225,6 +390,8 @@ static void avr_avr25_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -235,6 +402,7 @@ static void avr_avr25_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_2_BYTE_SP);
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_avr3_initfn(Object *obj)
@@ -242,6 +410,8 @@ static void avr_avr3_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -258,6 +428,8 @@ static void avr_avr31_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -276,6 +448,8 @@ static void avr_avr35_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -287,6 +461,7 @@ static void avr_avr35_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_JMP_CALL);
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_avr4_initfn(Object *obj)
@@ -294,6 +469,8 @@ static void avr_avr4_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -305,6 +482,7 @@ static void avr_avr4_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
     avr_set_feature(env, AVR_FEATURE_MUL);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_avr5_initfn(Object *obj)
@@ -312,6 +490,8 @@ static void avr_avr5_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -324,6 +504,7 @@ static void avr_avr5_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
     avr_set_feature(env, AVR_FEATURE_MUL);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_avr51_initfn(Object *obj)
@@ -331,6 +512,8 @@ static void avr_avr51_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -346,6 +529,7 @@ static void avr_avr51_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
     avr_set_feature(env, AVR_FEATURE_MUL);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_avr6_initfn(Object *obj)
@@ -353,6 +537,8 @@ static void avr_avr6_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avre_3_byte_pc;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -369,6 +555,7 @@ static void avr_avr6_initfn(Object *obj)
     avr_set_feature(env, AVR_FEATURE_LPMX);
     avr_set_feature(env, AVR_FEATURE_MOVW);
     avr_set_feature(env, AVR_FEATURE_MUL);
+    avr_set_feature(env, AVR_FEATURE_SPM);
 }
 
 static void avr_xmega2_initfn(Object *obj)
@@ -376,6 +563,8 @@ static void avr_xmega2_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avrxm;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -396,6 +585,8 @@ static void avr_xmega4_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avrxm;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -419,6 +610,8 @@ static void avr_xmega5_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avrxm;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -445,6 +638,8 @@ static void avr_xmega6_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avrxm_3_byte_pc;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -469,6 +664,8 @@ static void avr_xmega7_initfn(Object *obj)
     AVRCPU *cpu = AVR_CPU(obj);
     CPUAVRState *env = &cpu->env;
 
+    env->insn_cycles = avr_cycles_avrxm_3_byte_pc;
+
     avr_set_feature(env, AVR_FEATURE_LPM);
     avr_set_feature(env, AVR_FEATURE_IJMP_ICALL);
     avr_set_feature(env, AVR_FEATURE_ADIW_SBIW);
@@ -25,6 +25,12 @@
 
 #define TARGET_LONG_BITS 32
 
+/*
+ * Each AVR system of a board has a CPU and memory of its own, nothing is
+ * shared between vCPUs that needs ordering.
+ */
+#define TCG_GUEST_DEFAULT_MO (0)
+
 #define CPUArchState struct CPUAVRState
 
 #include "exec/cpu-defs.h"
@@ -41,6 +47,10 @@
 #define TARGET_VIRT_ADDR_SPACE_BITS 24
 #define NB_MMU_MODES 2
 
+/* The icount budget left from each instruction on, see gen_intermediate_code() */
+#define TARGET_INSN_START_EXTRA_WORDS 1
+#define TARGET_INSN_START_ICOUNT 1
+
 /*
  * AVR has two memory spaces, data & code.
  * e.g. both have 0 address
@@ -50,6 +60,12 @@
 #define MMU_CODE_IDX 0
 #define MMU_DATA_IDX 1
 
+/*
+ * Code is always fetched from flash at OFFSET_CODE, the mapping of code
+ * addresses never changes, so TBs spanning two pages can be chained to.
+ */
+#define TARGET_FIXED_CODE_MAPPING
+
 #define EXCP_RESET 1
 #define EXCP_INT(n) (EXCP_RESET + (n) + 1)
 
@@ -57,6 +73,13 @@
 #define NO_CPU_REGISTERS 32
 /* Number of IO registers accessible by ld/st/in/out */
 #define NO_IO_REGISTERS 64
+/* Largest flash page SPM can erase or write, in bytes */
+#define AVR_SPM_PAGE_MAX 256
+/* Number of IO and extended IO registers peripherals can be mapped to */
+#define NO_IO_PORTS (0x200 - NO_CPU_REGISTERS)
+/* Edge coverage bitmap size, the same as AFL's */
+#define AVR_COVERAGE_BITS 16
+#define AVR_COVERAGE_MAP_SIZE (1 << AVR_COVERAGE_BITS)
 
 /*
  * Offsets of AVR memory regions in host memory space.
@@ -115,8 +138,36 @@ enum avr_features {
     AVR_FEATURE_RAMPZ,
 };
 
+/*
+ * Lazily evaluated flags.  Arithmetic instructions store their result and
+ * operands in cc_r, cc_rd and cc_rr and the kind of operation in cc_op, and
+ * the flags that operation sets are only computed when something reads them.
+ * Flags the operation doesn't set are held in the sreg fields as usual.
+ */
+typedef enum AVRCCOp {
+    AVR_CC_OP_FLAGS, /* all flags are in the sreg fields */
+    AVR_CC_OP_ADD, /* ADD, ADC: C Z N V S H */
+    AVR_CC_OP_SUB, /* SUB, SUBI, CP, CPI, NEG: C Z N V S H */
+    AVR_CC_OP_ADDW, /* ADIW: C Z N V S */
+    AVR_CC_OP_SUBW, /* SBIW: C Z N V S */
+    AVR_CC_OP_LOGIC, /* AND, ANDI, OR, ORI, EOR, COM: Z N V S */
+    AVR_CC_OP_INC, /* INC: Z N V S */
+    AVR_CC_OP_DEC, /* DEC: Z N V S */
+    AVR_CC_OP_NB,
+} AVRCCOp;
+
 typedef struct CPUAVRState CPUAVRState;
 
+/*
+ * Peripheral register mapped to an IO port, so the slow path of IN/OUT and
+ * LD/ST can call the device directly instead of looking it up in the system
+ * address space on every access.
+ */
+typedef struct AVRIOPort {
+    MemoryRegion *mr; /* NULL if nothing was mapped with avr_cpu_map_io() */
+    hwaddr offset; /* of the register within mr */
+} AVRIOPort;
+
 struct CPUAVRState {
     uint32_t pc_w; /* 0x003fffff up to 22 bits */
 
@@ -130,6 +181,11 @@ struct CPUAVRState {
     uint32_t sregT; /* 0x00000001 1 bits */
     uint32_t sregI; /* 0x00000001 1 bits */
 
+    uint32_t cc_op; /* AVRCCOp */
+    uint32_t cc_r; /* result of the last lazy flags operation */
+    uint32_t cc_rd; /* its operands */
+    uint32_t cc_rr;
+
     uint32_t rampD; /* 0x00ff0000 8 bits */
     uint32_t rampX; /* 0x00ff0000 8 bits */
     uint32_t rampY; /* 0x00ff0000 8 bits */
@@ -139,10 +195,19 @@ struct CPUAVRState {
     uint32_t r[NO_CPU_REGISTERS]; /* 8 bits each */
     uint32_t sp; /* 16 bits */
 
-    uint64_t intsrc; /* interrupt sources */
+    void *intc; /* AVRIntcState, see hw/intc/avr_intc.c */
     bool fullacc; /* CPU/MEM if true MEM only otherwise */
 
     uint32_t features;
+    const uint8_t *insn_cycles; /* cycles per AVRInsnId, see cpu.c */
+
+    uint8_t spmcsr; /* store program memory control and status register */
+    uint8_t spm_buffer[AVR_SPM_PAGE_MAX]; /* temporary page buffer */
+
+    AVRIOPort io[NO_IO_PORTS]; /* indexed by data address - 0x20 */
+
+    uint32_t cov_prev; /* location of the last TB run, see gen_coverage() */
+    uint32_t wdr; /* set by WDR, see hw/watchdog/avr_wdt.c */
 
     /* Those resources are used only in QEMU core */
     CPU_COMMON
@@ -182,9 +247,13 @@ int avr_cpu_handle_mmu_fault(CPUState *cpu, vaddr address, int size,
                                 int rw, int mmu_idx);
 int avr_cpu_memory_rw_debug(CPUState *cs, vaddr address, uint8_t *buf,
                                 int len, bool is_write);
+int print_insn_avr(bfd_vma addr, disassemble_info *info);
 
 enum {
     TB_FLAGS_FULL_ACCESS = 1,
+    /* cc_op on entry to the TB */
+    TB_FLAGS_CC_OP_SHIFT = 1,
+    TB_FLAGS_CC_OP_MASK = 0xf << TB_FLAGS_CC_OP_SHIFT,
 };
 
 static inline void cpu_get_tb_cpu_state(CPUAVRState *env, target_ulong *pc,
@@ -198,6 +267,7 @@ static inline void cpu_get_tb_cpu_state(CPUAVRState *env, target_ulong *pc,
     if (env->fullacc) {
         flags |= TB_FLAGS_FULL_ACCESS;
     }
+    flags |= env->cc_op << TB_FLAGS_CC_OP_SHIFT;
 
     *pflags = flags;
 }
@@ -207,15 +277,15 @@ static inline int cpu_interrupts_enabled(CPUAVRState *env)
     return env->sregI != 0;
 }
 
+uint8_t avr_cpu_compute_flags(CPUAVRState *env);
+void avr_cpu_map_io(AVRCPU *cpu, hwaddr addr, MemoryRegion *mr);
+bool avr_cpu_data_is_ram(CPUState *cs, uint32_t addr, uint32_t size);
+int avr_intc_acknowledge(void *opaque);
+
 static inline uint8_t cpu_get_sreg(CPUAVRState *env)
 {
     uint8_t sreg;
-    sreg = (env->sregC & 0x01) << 0
-         | (env->sregZ == 0 ? 1 : 0) << 1
-         | (env->sregN) << 2
-         | (env->sregV) << 3
-         | (env->sregS) << 4
-         | (env->sregH) << 5
+    sreg = avr_cpu_compute_flags(env)
          | (env->sregT) << 6
          | (env->sregI) << 7;
     return sreg;
@@ -231,6 +301,7 @@ static inline void cpu_set_sreg(CPUAVRState *env, uint8_t sreg)
     env->sregH = (sreg >> 5) & 0x01;
     env->sregT = (sreg >> 6) & 0x01;
     env->sregI = (sreg >> 7) & 0x01;
+    env->cc_op = AVR_CC_OP_FLAGS;
 }
 
 #include "exec/exec-all.h"
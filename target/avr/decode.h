@@ -30,39 +30,28 @@
 typedef struct DisasContext DisasContext;
 typedef int (*TranslateFn)(DisasContext *ctx, uint32_t opcode);
 
-/*
- * Human readable instruction descriptions used to generate decoder.
- * Doing this at runtime avoids a complicated new build step.
- */
-typedef struct {
-    /* Instruction mnemonic for debugging */
-    const char *name;
-    /*
-     * Bit pattern describing the instruction's opcode.
-     * Each character represents a bit:
-     * - '1' means bit must be set
-     * - '0' means bit must be cleared
-     * - '*' means don't care
-     * - '_' is ignored (i.e. whitespace), please use to aid readability
-     */
-    const char *pattern;
-    /* Function used to translate this instruction to TCG */
-    TranslateFn decoder;
-} Instruction;
+/* Identifiers for each instruction listed in insn.def */
+typedef enum {
+#define AVR_INSN(name, pattern) AVR_INSN_##name,
+#include "insn.def"
+#undef AVR_INSN
+    /* Returned for opcodes that don't match any instruction */
+    AVR_INSN_ILLEGAL,
+} AVRInsnId;
 
 /*
- * Converts a list of instruction descriptions to a decoding tree
- * and caches it.
- * Must only be called once.
- * `size` is the number of instructions in the given list.
+ * Returns the identifier and length (in bits) of an instruction, given
+ * the opcode.
+ * The decoding tree is generated from insn.def at build time, so no
+ * initialisation is needed.
  */
-void avr_decoder_init(const Instruction instructions[], const size_t size);
+AVRInsnId avr_decode(const uint32_t opcode, uint32_t *const length_out);
 
 /*
- * Returns the translation function and length of an instruction, given
- * the opcode.
- * avr_decoder_init() must be called first to build the decoding tree.
+ * As avr_decode(), but using a flat table with an entry for every 16 bit
+ * opcode instead of the decoding tree.
+ * Lookups are a single load, at the cost of a larger (64KiB) table.
  */
-TranslateFn avr_decode(const uint32_t opcode, uint32_t *const length_out);
+AVRInsnId avr_decode_flat(const uint32_t opcode, uint32_t *const length_out);
 
 #endif /* AVR_DECODER_H */
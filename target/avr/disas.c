@@ -0,0 +1,296 @@
+/*
+ * AVR disassembler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ *  Instructions are decoded with the same generated tables as the
+ *  translator uses, see insn.def, so the two can't disagree about what an
+ *  opcode is.  Each AVRInsnId then has a format below saying how to print
+ *  it, which keeps printing a TB's instructions for -d in_asm about as cheap
+ *  as decoding them.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "disas/dis-asm.h"
+#include "qemu/bitops.h"
+#include "cpu.h"
+#include "decode.h"
+
+/*
+ * Operands are printed from a string in which each lower case letter is an
+ * opcode field, everything else is printed as is:
+ *   d  Rd, 5 bits at 4         r  Rr, 5 bits at 9 and 0
+ *   h  R16-R31, 4 bits at 4    g  R16-R31, 4 bits at 0
+ *   m  R16-R23, 3 bits at 4    n  R16-R23, 3 bits at 0
+ *   w  register pair at 4      v  register pair at 0
+ *   a  R24-R30 pair of ADIW    k  6 bit immediate of ADIW
+ *   c  8 bit immediate         x  4 bit immediate of DES
+ *   q  6 bit displacement      s  bit number at 0
+ *   e  6 bit IO address        p  5 bit IO address
+ *   l  Rd of LDS and STS       i  their 16 bit data address
+ *   j  22 bit code address     o  12 bit relative code address
+ *   b  7 bit relative code address of a conditional branch
+ */
+typedef struct {
+    const char *mnemonic;
+    const char *operands;
+    /* If set, the mnemonic is picked by the 3 bit field at alias_shift */
+    const char *const *alias;
+    uint8_t alias_shift;
+} AVRInsnFormat;
+
+static const char *const avr_brbs_alias[8] = {
+    "brcs", "breq", "brmi", "brvs", "brlt", "brhs", "brts", "brie",
+};
+
+static const char *const avr_brbc_alias[8] = {
+    "brcc", "brne", "brpl", "brvc", "brge", "brhc", "brtc", "brid",
+};
+
+static const char *const avr_bset_alias[8] = {
+    "sec", "sez", "sen", "sev", "ses", "seh", "set", "sei",
+};
+
+static const char *const avr_bclr_alias[8] = {
+    "clc", "clz", "cln", "clv", "cls", "clh", "clt", "cli",
+};
+
+static const AVRInsnFormat avr_insn_formats[AVR_INSN_ILLEGAL] = {
+    [AVR_INSN_ADC]    = { "adc",    "d,r" },
+    [AVR_INSN_ADD]    = { "add",    "d,r" },
+    [AVR_INSN_ADIW]   = { "adiw",   "a,k" },
+    [AVR_INSN_AND]    = { "and",    "d,r" },
+    [AVR_INSN_ANDI]   = { "andi",   "h,c" },
+    [AVR_INSN_ASR]    = { "asr",    "d" },
+    [AVR_INSN_BCLR]   = { "bclr",   "", avr_bclr_alias, 4 },
+    [AVR_INSN_BLD]    = { "bld",    "d,s" },
+    [AVR_INSN_BRBC]   = { "brbc",   "b", avr_brbc_alias, 0 },
+    [AVR_INSN_BRBS]   = { "brbs",   "b", avr_brbs_alias, 0 },
+    [AVR_INSN_BREAK]  = { "break",  "" },
+    [AVR_INSN_BSET]   = { "bset",   "", avr_bset_alias, 4 },
+    [AVR_INSN_BST]    = { "bst",    "d,s" },
+    [AVR_INSN_CALL]   = { "call",   "j" },
+    [AVR_INSN_CBI]    = { "cbi",    "p,s" },
+    [AVR_INSN_COM]    = { "com",    "d" },
+    [AVR_INSN_CP]     = { "cp",     "d,r" },
+    [AVR_INSN_CPC]    = { "cpc",    "d,r" },
+    [AVR_INSN_CPI]    = { "cpi",    "h,c" },
+    [AVR_INSN_CPSE]   = { "cpse",   "d,r" },
+    [AVR_INSN_DEC]    = { "dec",    "d" },
+    [AVR_INSN_DES]    = { "des",    "x" },
+    [AVR_INSN_EICALL] = { "eicall", "" },
+    [AVR_INSN_EIJMP]  = { "eijmp",  "" },
+    [AVR_INSN_ELPM1]  = { "elpm",   "" },
+    [AVR_INSN_ELPM2]  = { "elpm",   "d,Z" },
+    [AVR_INSN_ELPMX]  = { "elpm",   "d,Z+" },
+    [AVR_INSN_EOR]    = { "eor",    "d,r" },
+    [AVR_INSN_FMUL]   = { "fmul",   "m,n" },
+    [AVR_INSN_FMULS]  = { "fmuls",  "m,n" },
+    [AVR_INSN_FMULSU] = { "fmulsu", "m,n" },
+    [AVR_INSN_ICALL]  = { "icall",  "" },
+    [AVR_INSN_IJMP]   = { "ijmp",   "" },
+    [AVR_INSN_IN]     = { "in",     "d,e" },
+    [AVR_INSN_INC]    = { "inc",    "d" },
+    [AVR_INSN_JMP]    = { "jmp",    "j" },
+    [AVR_INSN_LAC]    = { "lac",    "Z,d" },
+    [AVR_INSN_LAS]    = { "las",    "Z,d" },
+    [AVR_INSN_LAT]    = { "lat",    "Z,d" },
+    [AVR_INSN_LDX1]   = { "ld",     "d,X" },
+    [AVR_INSN_LDX2]   = { "ld",     "d,X+" },
+    [AVR_INSN_LDX3]   = { "ld",     "d,-X" },
+    [AVR_INSN_LDY2]   = { "ld",     "d,Y+" },
+    [AVR_INSN_LDY3]   = { "ld",     "d,-Y" },
+    [AVR_INSN_LDDY]   = { "ldd",    "d,Y+q" },
+    [AVR_INSN_LDZ2]   = { "ld",     "d,Z+" },
+    [AVR_INSN_LDZ3]   = { "ld",     "d,-Z" },
+    [AVR_INSN_LDDZ]   = { "ldd",    "d,Z+q" },
+    [AVR_INSN_LDI]    = { "ldi",    "h,c" },
+    [AVR_INSN_LDS]    = { "lds",    "l,i" },
+    [AVR_INSN_LPM1]   = { "lpm",    "" },
+    [AVR_INSN_LPM2]   = { "lpm",    "d,Z" },
+    [AVR_INSN_LPMX]   = { "lpm",    "d,Z+" },
+    [AVR_INSN_LSR]    = { "lsr",    "d" },
+    [AVR_INSN_MOV]    = { "mov",    "d,r" },
+    [AVR_INSN_MOVW]   = { "movw",   "w,v" },
+    [AVR_INSN_MUL]    = { "mul",    "d,r" },
+    [AVR_INSN_MULS]   = { "muls",   "h,g" },
+    [AVR_INSN_MULSU]  = { "mulsu",  "m,n" },
+    [AVR_INSN_NEG]    = { "neg",    "d" },
+    [AVR_INSN_NOP]    = { "nop",    "" },
+    [AVR_INSN_OR]     = { "or",     "d,r" },
+    [AVR_INSN_ORI]    = { "ori",    "h,c" },
+    [AVR_INSN_OUT]    = { "out",    "e,d" },
+    [AVR_INSN_POP]    = { "pop",    "d" },
+    [AVR_INSN_PUSH]   = { "push",   "d" },
+    [AVR_INSN_RCALL]  = { "rcall",  "o" },
+    [AVR_INSN_RET]    = { "ret",    "" },
+    [AVR_INSN_RETI]   = { "reti",   "" },
+    [AVR_INSN_RJMP]   = { "rjmp",   "o" },
+    [AVR_INSN_ROR]    = { "ror",    "d" },
+    [AVR_INSN_SBC]    = { "sbc",    "d,r" },
+    [AVR_INSN_SBCI]   = { "sbci",   "h,c" },
+    [AVR_INSN_SBI]    = { "sbi",    "p,s" },
+    [AVR_INSN_SBIC]   = { "sbic",   "p,s" },
+    [AVR_INSN_SBIS]   = { "sbis",   "p,s" },
+    [AVR_INSN_SBIW]   = { "sbiw",   "a,k" },
+    [AVR_INSN_SBRC]   = { "sbrc",   "d,s" },
+    [AVR_INSN_SBRS]   = { "sbrs",   "d,s" },
+    [AVR_INSN_SLEEP]  = { "sleep",  "" },
+    [AVR_INSN_SPM]    = { "spm",    "" },
+    [AVR_INSN_SPMX]   = { "spm",    "Z+" },
+    [AVR_INSN_STX1]   = { "st",     "X,d" },
+    [AVR_INSN_STX2]   = { "st",     "X+,d" },
+    [AVR_INSN_STX3]   = { "st",     "-X,d" },
+    [AVR_INSN_STY2]   = { "st",     "Y+,d" },
+    [AVR_INSN_STY3]   = { "st",     "-Y,d" },
+    [AVR_INSN_STDY]   = { "std",    "Y+q,d" },
+    [AVR_INSN_STZ2]   = { "st",     "Z+,d" },
+    [AVR_INSN_STZ3]   = { "st",     "-Z,d" },
+    [AVR_INSN_STDZ]   = { "std",    "Z+q,d" },
+    [AVR_INSN_STS]    = { "sts",    "i,l" },
+    [AVR_INSN_SUB]    = { "sub",    "d,r" },
+    [AVR_INSN_SUBI]   = { "subi",   "h,c" },
+    [AVR_INSN_SWAP]   = { "swap",   "d" },
+    [AVR_INSN_WDR]    = { "wdr",    "" },
+    [AVR_INSN_XCH]    = { "xch",    "Z,d" },
+};
+
+#define output(format, ...) \
+    (info->fprintf_func(info->stream, format, ##__VA_ARGS__))
+
+/*
+ * Print operand @op of @opcode, 16 bit instructions are in its low half and
+ * 32 bit ones have their first word in the high half.  @addr is the byte
+ * address of the instruction.
+ */
+static void avr_print_operand(disassemble_info *info, char op,
+                              uint32_t opcode, bfd_vma addr)
+{
+    switch (op) {
+    case 'd':
+        output("r%d", extract32(opcode, 4, 5));
+        break;
+    case 'r':
+        output("r%d", (extract32(opcode, 9, 1) << 4) | extract32(opcode, 0, 4));
+        break;
+    case 'h':
+        output("r%d", 16 + extract32(opcode, 4, 4));
+        break;
+    case 'g':
+        output("r%d", 16 + extract32(opcode, 0, 4));
+        break;
+    case 'm':
+        output("r%d", 16 + extract32(opcode, 4, 3));
+        break;
+    case 'n':
+        output("r%d", 16 + extract32(opcode, 0, 3));
+        break;
+    case 'w':
+        output("r%d", 2 * extract32(opcode, 4, 4));
+        break;
+    case 'v':
+        output("r%d", 2 * extract32(opcode, 0, 4));
+        break;
+    case 'a':
+        output("r%d", 24 + 2 * extract32(opcode, 4, 2));
+        break;
+    case 'k':
+        output("0x%02X", (extract32(opcode, 6, 2) << 4) |
+                         extract32(opcode, 0, 4));
+        break;
+    case 'c':
+        output("0x%02X", (extract32(opcode, 8, 4) << 4) |
+                         extract32(opcode, 0, 4));
+        break;
+    case 'x':
+        output("0x%02X", extract32(opcode, 4, 4));
+        break;
+    case 'q':
+        output("%d", (extract32(opcode, 13, 1) << 5) |
+                     (extract32(opcode, 10, 2) << 3) |
+                     extract32(opcode, 0, 3));
+        break;
+    case 's':
+        output("%d", extract32(opcode, 0, 3));
+        break;
+    case 'e':
+        output("0x%02x", (extract32(opcode, 9, 2) << 4) |
+                         extract32(opcode, 0, 4));
+        break;
+    case 'p':
+        output("0x%02x", extract32(opcode, 3, 5));
+        break;
+    case 'l':
+        output("r%d", extract32(opcode, 20, 5));
+        break;
+    case 'i':
+        output("0x%04x", extract32(opcode, 0, 16));
+        break;
+    case 'j':
+        info->print_address_func(((extract32(opcode, 20, 5) << 17) |
+                                  extract32(opcode, 0, 17)) * 2, info);
+        break;
+    case 'o':
+        info->print_address_func(addr + 2 + sextract32(opcode, 0, 12) * 2,
+                                 info);
+        break;
+    case 'b':
+        info->print_address_func(addr + 2 + sextract32(opcode, 3, 7) * 2,
+                                 info);
+        break;
+    case ',':
+        output(", ");
+        break;
+    default:
+        output("%c", op);
+        break;
+    }
+}
+
+int print_insn_avr(bfd_vma addr, disassemble_info *info)
+{
+    const AVRInsnFormat *format;
+    const char *mnemonic;
+    const char *op;
+    bfd_byte buffer[2];
+    uint32_t opcode;
+    uint32_t length;
+    AVRInsnId insn;
+    int status;
+
+    status = info->read_memory_func(addr, buffer, 2, info);
+    if (status != 0) {
+        info->memory_error_func(status, addr, info);
+        return -1;
+    }
+    opcode = bfd_getl16(buffer);
+
+    insn = avr_decode_flat(opcode, &length);
+    if (insn == AVR_INSN_ILLEGAL || !avr_insn_formats[insn].mnemonic) {
+        output(".word   0x%04x", opcode);
+        return 2;
+    }
+    if (length == 32) {
+        status = info->read_memory_func(addr + 2, buffer, 2, info);
+        if (status != 0) {
+            info->memory_error_func(status, addr + 2, info);
+            return -1;
+        }
+        opcode = (opcode << 16) | bfd_getl16(buffer);
+    }
+
+    format = &avr_insn_formats[insn];
+    mnemonic = format->mnemonic;
+    if (format->alias) {
+        mnemonic = format->alias[extract32(opcode, format->alias_shift, 3)];
+    }
+    output(*format->operands ? "%-8s" : "%s", mnemonic);
+    for (op = format->operands; *op; op++) {
+        avr_print_operand(info, *op, opcode, addr);
+    }
+    return length / 8;
+}
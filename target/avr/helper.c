@@ -24,12 +24,28 @@
 #include "hw/irq.h"
 #include "hw/sysbus.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/replay.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "exec/helper-proto.h"
 #include "exec/ioport.h"
+#include "exec/address-spaces.h"
+#include "exec/memory.h"
+#include "qemu/main-loop.h"
 #include "qemu/host-utils.h"
 #include "qemu/error-report.h"
+#include "qemu/log.h"
+
+/* SPMCSR bits */
+#define SPMCSR_SPMEN 0x01
+#define SPMCSR_PGERS 0x02
+#define SPMCSR_PGWRT 0x04
+#define SPMCSR_BLBSET 0x08
+#define SPMCSR_RWWSRE 0x10
+#define SPMCSR_SIGRD 0x20
+#define SPMCSR_OPS (SPMCSR_SPMEN | SPMCSR_PGERS | SPMCSR_PGWRT | \
+                    SPMCSR_BLBSET | SPMCSR_RWWSRE | SPMCSR_SIGRD)
 
 bool avr_cpu_exec_interrupt(CPUState *cs, int interrupt_request)
 {
@@ -49,15 +65,15 @@ bool avr_cpu_exec_interrupt(CPUState *cs, int interrupt_request)
         }
     }
     if (interrupt_request & CPU_INTERRUPT_HARD) {
-        if (cpu_interrupts_enabled(env) && env->intsrc != 0) {
-            int index = ctz32(env->intsrc);
-            cs->exception_index = EXCP_INT(index);
-            cc->do_interrupt(cs);
+        if (cpu_interrupts_enabled(env)) {
+            int index = avr_intc_acknowledge(env->intc);
 
-            env->intsrc &= env->intsrc - 1; /* clear the interrupt */
-            cs->interrupt_request &= ~CPU_INTERRUPT_HARD;
+            if (index >= 0) {
+                cs->exception_index = EXCP_INT(index);
+                cc->do_interrupt(cs);
 
-            ret = true;
+                ret = true;
+            }
         }
     }
     return ret;
@@ -75,17 +91,21 @@ void avr_cpu_do_interrupt(CPUState *cs)
 
     if (cs->exception_index == EXCP_RESET) {
         vector = 0;
-    } else if (env->intsrc != 0) {
-        vector = ctz32(env->intsrc) + 1;
+    } else if (cs->exception_index > EXCP_RESET) {
+        vector = cs->exception_index - EXCP_RESET;
     }
 
+    /*
+     * The return address goes big-endian below SP, as in gen_push_ret(),
+     * with a 16 bit access for all but the low byte of a 3 byte PC.
+     */
     if (avr_feature(env, AVR_FEATURE_3_BYTE_PC)) {
-        cpu_stb_data(env, env->sp--, (ret & 0x0000ff));
-        cpu_stb_data(env, env->sp--, (ret & 0x00ff00) >> 8);
-        cpu_stb_data(env, env->sp--, (ret & 0xff0000) >> 16);
+        cpu_stb_data(env, env->sp, (ret & 0x0000ff));
+        cpu_stw_data(env, env->sp - 2, bswap16(ret >> 8));
+        env->sp -= 3;
     } else if (avr_feature(env, AVR_FEATURE_2_BYTE_PC)) {
-        cpu_stb_data(env, env->sp--, (ret & 0x0000ff));
-        cpu_stb_data(env, env->sp--, (ret & 0x00ff00) >> 8);
+        cpu_stw_data(env, env->sp - 1, bswap16(ret));
+        env->sp -= 2;
     } else {
         cpu_stb_data(env, env->sp--, (ret & 0x0000ff));
     }
@@ -96,6 +116,73 @@ void avr_cpu_do_interrupt(CPUState *cs)
     cs->exception_index = -1;
 }
 
+/*
+ *  Returns the C, Z, N, V, S and H flags in their SREG positions, computing
+ *  the ones set by the last lazy flags operation from its operands.
+ */
+uint8_t avr_cpu_compute_flags(CPUAVRState *env)
+{
+    uint32_t r = env->cc_r;
+    uint32_t rd = env->cc_rd;
+    uint32_t rr = env->cc_rr;
+    uint32_t carries;
+    uint32_t c = env->sregC;
+    uint32_t z = env->sregZ == 0;
+    uint32_t n = env->sregN;
+    uint32_t v = env->sregV;
+    uint32_t s = env->sregS;
+    uint32_t h = env->sregH;
+
+    switch (env->cc_op) {
+    case AVR_CC_OP_FLAGS:
+        break;
+    case AVR_CC_OP_ADD:
+        carries = (rd & rr) | (rd & ~r) | (rr & ~r);
+        c = (carries >> 7) & 1;
+        h = (carries >> 3) & 1;
+        v = (((rd ^ r) & ~(rd ^ rr)) >> 7) & 1;
+        n = (r >> 7) & 1;
+        break;
+    case AVR_CC_OP_SUB:
+        carries = (~rd & rr) | (~rd & r) | (r & rr);
+        c = (carries >> 7) & 1;
+        h = (carries >> 3) & 1;
+        v = (((rd ^ r) & (rd ^ rr)) >> 7) & 1;
+        n = (r >> 7) & 1;
+        break;
+    case AVR_CC_OP_ADDW:
+        c = ((rd & ~r) >> 15) & 1;
+        v = ((r & ~rd) >> 15) & 1;
+        n = (r >> 15) & 1;
+        break;
+    case AVR_CC_OP_SUBW:
+        c = ((r & ~rd) >> 15) & 1;
+        v = ((rd & ~r) >> 15) & 1;
+        n = (r >> 15) & 1;
+        break;
+    case AVR_CC_OP_LOGIC:
+        v = 0;
+        n = (r >> 7) & 1;
+        break;
+    case AVR_CC_OP_INC:
+        v = r == 0x80;
+        n = (r >> 7) & 1;
+        break;
+    case AVR_CC_OP_DEC:
+        v = r == 0x7f;
+        n = (r >> 7) & 1;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    if (env->cc_op != AVR_CC_OP_FLAGS) {
+        z = r == 0;
+        s = n ^ v;
+    }
+
+    return c << 0 | z << 1 | n << 2 | v << 3 | s << 4 | h << 5;
+}
+
 int avr_cpu_memory_rw_debug(CPUState *cs, vaddr addr, uint8_t *buf,
                                 int len, bool is_write)
 {
@@ -136,7 +223,9 @@ void tlb_fill(CPUState *cs, target_ulong vaddr, int size,
     } else if (vaddr < NO_CPU_REGISTERS + NO_IO_REGISTERS) {
         /*
          * access to CPU registers, exit and rebuilt this TB to use full access
-         * incase it touches specially handled registers like SREG or SP
+         * incase it touches specially handled registers like SREG or SP.
+         * LD/ST and friends never get here as they check for this page
+         * inline, only stack accesses of calls and returns do.
          */
         AVRCPU *cpu = AVR_CPU(cs);
         CPUAVRState *env = &cpu->env;
@@ -152,14 +241,136 @@ void tlb_fill(CPUState *cs, target_ulong vaddr, int size,
         cs, vaddr, paddr, attrs, prot, mmu_idx, TARGET_PAGE_SIZE);
 }
 
+/*
+ *  Write a flash page, address_space_write_rom() invalidates just the TBs
+ *  translated from that range
+ */
+static void avr_spm_write_page(CPUState *cs, uint32_t page, uint8_t *data,
+                               uint32_t size)
+{
+    address_space_write_rom(cs->as, OFFSET_CODE + page,
+                            MEMTXATTRS_UNSPECIFIED, data, size);
+}
+
+/*
+ *  This function implements SPM instruction
+ *
+ *  The operation is selected by SPMCSR as on megaAVR devices, either filling
+ *  a word of the temporary page buffer from R1:R0, or erasing or writing the
+ *  flash page RAMPZ:Z points to.  Operations complete immediately, so the
+ *  RWW section never reads as busy.
+ */
+void helper_spm(CPUAVRState *env)
+{
+    AVRCPU *cpu = avr_env_get_cpu(env);
+    uint32_t size = cpu->spm_page_size;
+    uint32_t addr = env->rampZ | (env->r[31] << 8) | env->r[30];
+    uint32_t page = addr & ~(size - 1);
+    uint8_t data[AVR_SPM_PAGE_MAX];
+    uint32_t i;
+
+    if (!(env->spmcsr & SPMCSR_SPMEN)) {
+        return;
+    }
+
+    switch (env->spmcsr & SPMCSR_OPS) {
+    case SPMCSR_SPMEN: /* fill the temporary page buffer */
+        i = addr & (size - 1) & ~1;
+        env->spm_buffer[i] = env->r[0];
+        env->spm_buffer[i + 1] = env->r[1];
+        break;
+    case SPMCSR_SPMEN | SPMCSR_PGERS: /* erase page */
+        if (OFFSET_CODE + page + size > OFFSET_DATA) {
+            qemu_log_mask(LOG_GUEST_ERROR, "SPM erase outside of flash\n");
+            break;
+        }
+        memset(data, 0xff, size);
+        avr_spm_write_page(CPU(cpu), page, data, size);
+        break;
+    case SPMCSR_SPMEN | SPMCSR_PGWRT: /* write page */
+        if (OFFSET_CODE + page + size > OFFSET_DATA) {
+            qemu_log_mask(LOG_GUEST_ERROR, "SPM write outside of flash\n");
+            break;
+        }
+        /* programming can only clear bits that were left erased */
+        address_space_read(CPU(cpu)->as, OFFSET_CODE + page,
+                           MEMTXATTRS_UNSPECIFIED, data, size);
+        for (i = 0; i < size; i++) {
+            data[i] &= env->spm_buffer[i];
+        }
+        avr_spm_write_page(CPU(cpu), page, data, size);
+        memset(env->spm_buffer, 0xff, sizeof(env->spm_buffer));
+        break;
+    case SPMCSR_SPMEN | SPMCSR_RWWSRE: /* re-enable the RWW section */
+        memset(env->spm_buffer, 0xff, sizeof(env->spm_buffer));
+        break;
+    default:
+        qemu_log_mask(LOG_UNIMP, "SPM with SPMCSR 0x%02x not implemented\n",
+                      env->spmcsr);
+        break;
+    }
+
+    env->spmcsr &= ~SPMCSR_OPS;
+}
+
+/*
+ *  Nothing the CPU can observe changes before the next timer event.  Under
+ *  icount the instruction budget ends at the next QEMU_CLOCK_VIRTUAL
+ *  deadline, so account all of it as executed, which moves the virtual clock
+ *  straight to the event.  Without a timer armed the budget is just a cap
+ *  and the CPU waits for something else, like a character on the USART or
+ *  the monitor, so don't skip anything then.  Record/replay needs the
+ *  instruction count to stay exact, so leave it alone there too.
+ */
+static bool avr_cpu_skip_idle(CPUState *cs)
+{
+    if (!use_icount || replay_mode != REPLAY_MODE_NONE) {
+        return false;
+    }
+    if (qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL) < 0) {
+        return false;
+    }
+    cs->icount_decr.u16.low = 0;
+    cs->icount_extra = 0;
+    return true;
+}
+
 void helper_sleep(CPUAVRState *env)
 {
     CPUState *cs = CPU(avr_env_get_cpu(env));
 
+    avr_cpu_skip_idle(cs);
+    cs->halted = 1;
     cs->exception_index = EXCP_HLT;
     cpu_loop_exit(cs);
 }
 
+/*
+ *  Called when a TB polling RAM loops back to its start, see
+ *  avr_idle_insn().  PC already points at the loop.  Byte n of @ptrs is
+ *  non-zero if the loop loads through X, Y or Z, for n 0, 1 and 2, and
+ *  counts the bytes from the pointer on it may load.
+ */
+void helper_idle(CPUAVRState *env, uint32_t ptrs)
+{
+    CPUState *cs = CPU(avr_env_get_cpu(env));
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        int r = 26 + i * 2;
+        uint32_t size = extract32(ptrs, i * 8, 8);
+        uint32_t addr = env->r[r] | env->r[r + 1] << 8;
+
+        if (size && !avr_cpu_data_is_ram(cs, addr, size)) {
+            return;
+        }
+    }
+    if (avr_cpu_skip_idle(cs)) {
+        cs->exception_index = EXCP_INTERRUPT;
+        cpu_loop_exit(cs);
+    }
+}
+
 void helper_unsupported(CPUAVRState *env)
 {
     CPUState *cs = CPU(avr_env_get_cpu(env));
@@ -184,13 +395,139 @@ void helper_debug(CPUAVRState *env)
     cpu_loop_exit(cs);
 }
 
-void helper_wdr(CPUAVRState *env)
+/*
+ *  Register a peripheral's registers in the IO dispatch table
+ *
+ *  @addr is the data space address @mr is mapped at, each byte of @mr that
+ *  falls into the IO or extended IO space gets a table entry.  Boards call
+ *  this in addition to mapping @mr into the system address space, which is
+ *  still used by the debugger, DMA and accesses from the TLB fast path.
+ */
+void avr_cpu_map_io(AVRCPU *cpu, hwaddr addr, MemoryRegion *mr)
+{
+    CPUAVRState *env = &cpu->env;
+    uint64_t size = memory_region_size(mr);
+    uint64_t i;
+
+    for (i = 0; i < size; i++) {
+        if (addr + i < NO_CPU_REGISTERS) {
+            continue;
+        }
+        if (addr + i >= NO_CPU_REGISTERS + NO_IO_PORTS) {
+            break;
+        }
+        env->io[addr + i - NO_CPU_REGISTERS].mr = mr;
+        env->io[addr + i - NO_CPU_REGISTERS].offset = i;
+    }
+}
+
+static AVRIOPort *avr_io_port(CPUAVRState *env, uint32_t addr)
+{
+    AVRIOPort *io;
+
+    if (addr < NO_CPU_REGISTERS || addr >= NO_CPU_REGISTERS + NO_IO_PORTS) {
+        return NULL;
+    }
+    io = &env->io[addr - NO_CPU_REGISTERS];
+    return io->mr ? io : NULL;
+}
+
+/*
+ *  Whether data space addresses @addr to @addr + @size - 1 are all RAM,
+ *  rather than CPU registers, IO or other MMIO that reading may change or
+ *  that may change without the CPU storing to it.
+ */
+bool avr_cpu_data_is_ram(CPUState *cs, uint32_t addr, uint32_t size)
+{
+    CPUAVRState *env = &AVR_CPU(cs)->env;
+    MemoryRegionSection section;
+    bool ram;
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        if (addr + i < NO_CPU_REGISTERS || avr_io_port(env, addr + i)) {
+            return false;
+        }
+    }
+
+    section = memory_region_find(cs->as->root, OFFSET_DATA + addr, size);
+    if (!section.mr) {
+        return false;
+    }
+    ram = memory_region_is_ram(section.mr) &&
+          int128_get64(section.size) == size;
+    memory_region_unref(section.mr);
+    return ram;
+}
+
+/*
+ *  Under icount, a device may read the virtual clock, which is only exact
+ *  in the last instruction of a TB.  The translator knows which instructions
+ *  access a device in most cases, see avr_insn_does_io(), for the others
+ *  retranslate the TB to end with this instruction as the TLB does for MMIO.
+ */
+static void avr_io_check(CPUAVRState *env, uintptr_t retaddr)
 {
     CPUState *cs = CPU(avr_env_get_cpu(env));
 
-    /* WD is not implemented yet, placeholder */
-    cs->exception_index = EXCP_DEBUG;
-    cpu_loop_exit(cs);
+    if (use_icount && !cs->can_do_io) {
+        cpu_io_recompile(cs, retaddr);
+    }
+}
+
+/*
+ *  Read a byte from data space address @addr, going straight to the
+ *  peripheral if one is mapped there.  @retaddr is the host PC of the
+ *  helper call.
+ */
+static uint8_t avr_io_read(CPUAVRState *env, uint32_t addr, uintptr_t retaddr)
+{
+    AVRIOPort *io = avr_io_port(env, addr);
+    uint64_t val = 0;
+    uint8_t data = 0;
+    bool locked = false;
+
+    if (!io) {
+        address_space_read(CPU(avr_env_get_cpu(env))->as, OFFSET_DATA + addr,
+                           MEMTXATTRS_UNSPECIFIED, &data, 1);
+        return data;
+    }
+
+    avr_io_check(env, retaddr);
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    memory_region_dispatch_read(io->mr, io->offset, &val, 1,
+                                MEMTXATTRS_UNSPECIFIED);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
+}
+
+static void avr_io_write(CPUAVRState *env, uint32_t addr, uint8_t data,
+                         uintptr_t retaddr)
+{
+    AVRIOPort *io = avr_io_port(env, addr);
+    bool locked = false;
+
+    if (!io) {
+        address_space_write(CPU(avr_env_get_cpu(env))->as, OFFSET_DATA + addr,
+                            MEMTXATTRS_UNSPECIFIED, &data, 1);
+        return;
+    }
+
+    avr_io_check(env, retaddr);
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    memory_region_dispatch_write(io->mr, io->offset, data, 1,
+                                 MEMTXATTRS_UNSPECIFIED);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 /*
@@ -198,12 +535,13 @@ void helper_wdr(CPUAVRState *env)
  *
  * It does the following
  * a.  if an IO register belongs to CPU, its value is read and returned
- * b.  otherwise io address is translated to mem address and physical memory
- *     is read.
+ * b.  otherwise the peripheral mapped at the port is read, or physical
+ *     memory if there is none
  * c.  it caches the value for sake of SBI, SBIC, SBIS & CBI implementation
  *
  */
-target_ulong helper_inb(CPUAVRState *env, uint32_t port)
+static target_ulong avr_inb(CPUAVRState *env, uint32_t port,
+                            uintptr_t retaddr)
 {
     target_ulong data = 0;
 
@@ -232,25 +570,37 @@ target_ulong helper_inb(CPUAVRState *env, uint32_t port)
     case 0x3f: /* SREG */
         data = cpu_get_sreg(env);
         break;
+    case 0x37: /* SPMCSR */
+        if (avr_feature(env, AVR_FEATURE_SPM)) {
+            data = env->spmcsr;
+            break;
+        }
+        /* fall through */
     default:
-        /* not a special register, pass to normal memory access */
-        cpu_physical_memory_read(OFFSET_IO_REGISTERS + port, &data, 1);
+        /* not a special register, pass to the peripheral */
+        data = avr_io_read(env, NO_CPU_REGISTERS + port, retaddr);
     }
 
     return data;
 }
 
+target_ulong helper_inb(CPUAVRState *env, uint32_t port)
+{
+    return avr_inb(env, port, GETPC());
+}
+
 /*
  *  This function implements OUT instruction
  *
  *  It does the following
  *  a.  if an IO register belongs to CPU, its value is written into the register
- *  b.  otherwise io address is translated to mem address and physical memory
- *      is written.
+ *  b.  otherwise the peripheral mapped at the port is written, or physical
+ *      memory if there is none
  *  c.  it caches the value for sake of SBI, SBIC, SBIS & CBI implementation
  *
  */
-void helper_outb(CPUAVRState *env, uint32_t port, uint32_t data)
+static void avr_outb(CPUAVRState *env, uint32_t port, uint32_t data,
+                     uintptr_t retaddr)
 {
     data &= 0x000000ff;
 
@@ -287,14 +637,36 @@ void helper_outb(CPUAVRState *env, uint32_t port, uint32_t data)
         }
         break;
     case 0x3f: /* SREG */
+        if (!cpu_interrupts_enabled(env) && (data & 0x80)) {
+            CPUState *cs = CPU(avr_env_get_cpu(env));
+
+            /*
+             * An interrupt raised while I was clear didn't kick the CPU,
+             * see avr_intc_set_irq(), go and take it now.
+             */
+            if (cs->interrupt_request & CPU_INTERRUPT_HARD) {
+                cpu_exit(cs);
+            }
+        }
         cpu_set_sreg(env, data);
         break;
+    case 0x37: /* SPMCSR */
+        if (avr_feature(env, AVR_FEATURE_SPM)) {
+            env->spmcsr = data;
+            break;
+        }
+        /* fall through */
     default:
-        /* not a special register, pass to normal memory access */
-        cpu_physical_memory_write(OFFSET_IO_REGISTERS + port, &data, 1);
+        /* not a special register, pass to the peripheral */
+        avr_io_write(env, NO_CPU_REGISTERS + port, data, retaddr);
     }
 }
 
+void helper_outb(CPUAVRState *env, uint32_t port, uint32_t data)
+{
+    avr_outb(env, port, data, GETPC());
+}
+
 /*
  *  this function implements LD instruction when there is a posibility to read
  *  from a CPU register
@@ -303,18 +675,19 @@ target_ulong helper_fullrd(CPUAVRState *env, uint32_t addr)
 {
     uint8_t data;
 
-    env->fullacc = false;
-
     if (addr < NO_CPU_REGISTERS) {
         /* CPU registers */
         data = env->r[addr];
     } else if (addr < NO_CPU_REGISTERS + NO_IO_REGISTERS) {
         /* IO registers */
-        data = helper_inb(env, addr - NO_CPU_REGISTERS);
+        data = avr_inb(env, addr - NO_CPU_REGISTERS, GETPC());
     } else {
-        /* memory */
-        cpu_physical_memory_read(OFFSET_DATA + addr, &data, 1);
+        /* extended IO registers and memory */
+        data = avr_io_read(env, addr, GETPC());
     }
+
+    /* Not before the access, which may be retranslated, see avr_io_check() */
+    env->fullacc = false;
     return data;
 }
 
@@ -324,8 +697,6 @@ target_ulong helper_fullrd(CPUAVRState *env, uint32_t addr)
  */
 void helper_fullwr(CPUAVRState *env, uint32_t data, uint32_t addr)
 {
-    env->fullacc = false;
-
     /* Following logic assumes this: */
     assert(OFFSET_CPU_REGISTERS == OFFSET_DATA);
     assert(OFFSET_IO_REGISTERS == OFFSET_CPU_REGISTERS + NO_CPU_REGISTERS);
@@ -335,9 +706,11 @@ void helper_fullwr(CPUAVRState *env, uint32_t data, uint32_t addr)
         env->r[addr] = data;
     } else if (addr < NO_CPU_REGISTERS + NO_IO_REGISTERS) {
         /* IO registers */
-        helper_outb(env, addr - NO_CPU_REGISTERS, data);
+        avr_outb(env, addr - NO_CPU_REGISTERS, data, GETPC());
     } else {
-        /* memory */
-        cpu_physical_memory_write(OFFSET_DATA + addr, &data, 1);
+        /* extended IO registers and memory */
+        avr_io_write(env, addr, data, GETPC());
     }
+
+    env->fullacc = false;
 }
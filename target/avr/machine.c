@@ -100,10 +100,39 @@ static const VMStateInfo vms_eind = {
     .put = put_segment,
 };
 
+static bool spm_needed(void *opaque)
+{
+    AVRCPU *cpu = opaque;
+
+    return avr_feature(&cpu->env, AVR_FEATURE_SPM);
+}
+
+static const VMStateDescription vms_avr_cpu_spm = {
+    .name = "cpu/spm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = spm_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(env.spmcsr, AVRCPU),
+        VMSTATE_UINT8_ARRAY(env.spm_buffer, AVRCPU, AVR_SPM_PAGE_MAX),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* The next TB isn't entered by an edge of the firmware's, see gen_coverage() */
+static int avr_cpu_post_load(void *opaque, int version_id)
+{
+    AVRCPU *cpu = opaque;
+
+    cpu->env.cov_prev = 0;
+    return 0;
+}
+
 const VMStateDescription vms_avr_cpu = {
     .name = "cpu",
     .version_id = 0,
     .minimum_version_id = 0,
+    .post_load = avr_cpu_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(env.pc_w, AVRCPU),
         VMSTATE_UINT32(env.sp, AVRCPU),
@@ -118,5 +147,9 @@ const VMStateDescription vms_avr_cpu = {
         VMSTATE_SINGLE(env.eind, AVRCPU, 0, vms_eind, uint32_t),
 
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vms_avr_cpu_spm,
+        NULL
     }
 };
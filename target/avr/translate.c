@@ -20,6 +20,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/qemu-print.h"
+#include "qemu/error-report.h"
 #include "tcg/tcg.h"
 #include "cpu.h"
 #include "decode.h"
@@ -31,6 +32,7 @@
 #include "exec/helper-gen.h"
 #include "exec/log.h"
 #include "exec/gdbstub.h"
+#include "exec/gen-icount.h"
 
 static TCGv cpu_pc;
 
@@ -43,6 +45,11 @@ static TCGv cpu_Hf;
 static TCGv cpu_Tf;
 static TCGv cpu_If;
 
+static TCGv cpu_cc_op;
+static TCGv cpu_cc_r;
+static TCGv cpu_cc_rd;
+static TCGv cpu_cc_rr;
+
 static TCGv cpu_rampD;
 static TCGv cpu_rampX;
 static TCGv cpu_rampY;
@@ -54,6 +61,32 @@ static TCGv cpu_sp;
 
 #define REG(x) (cpu_r[x])
 
+/* SREG bits */
+enum {
+    SREG_C = 0,
+    SREG_Z = 1,
+    SREG_N = 2,
+    SREG_V = 3,
+    SREG_S = 4,
+    SREG_H = 5,
+    SREG_T = 6,
+    SREG_I = 7,
+};
+
+#define CC_ZNVS ((1 << SREG_Z) | (1 << SREG_N) | (1 << SREG_V) | (1 << SREG_S))
+
+/* Flags each AVRCCOp computes from cpu_cc_*, as a mask of SREG bits */
+static const uint8_t cc_op_live[AVR_CC_OP_NB] = {
+    [AVR_CC_OP_FLAGS] = 0,
+    [AVR_CC_OP_ADD] = (1 << SREG_C) | CC_ZNVS | (1 << SREG_H),
+    [AVR_CC_OP_SUB] = (1 << SREG_C) | CC_ZNVS | (1 << SREG_H),
+    [AVR_CC_OP_ADDW] = (1 << SREG_C) | CC_ZNVS,
+    [AVR_CC_OP_SUBW] = (1 << SREG_C) | CC_ZNVS,
+    [AVR_CC_OP_LOGIC] = CC_ZNVS,
+    [AVR_CC_OP_INC] = CC_ZNVS,
+    [AVR_CC_OP_DEC] = CC_ZNVS,
+};
+
 enum {
     BS_NONE = 0, /* Nothing special (none of the below) */
     BS_STOP = 1, /* We want to stop translation for any reason */
@@ -68,8 +101,11 @@ struct InstInfo {
     target_long cpc;
     target_long npc;
     uint32_t opcode;
+    AVRInsnId insn;
     TranslateFn translate;
     unsigned length;
+    unsigned cycles; /* when not taken, for branches and skips */
+    unsigned count; /* instructions in a PUSH or POP run, see decode_opc() */
 };
 
 /* This is the state at translation time. */
@@ -83,13 +119,57 @@ struct DisasContext {
     int memidx;
     int bstate;
     int singlestep;
+    /* Current AVRCCOp, cpu_cc_op always holds the same value */
+    int cc_op;
+    /* Use avr_decode_flat() instead of avr_decode() */
+    bool flat_decoder;
+    /* Translate runs of PUSH and POP as one instruction */
+    bool fuse_stack;
+    /* Edge coverage bitmap, NULL unless the coverage-shm-id property is set */
+    uint8_t *coverage;
+    /*
+     * Set while the instructions translated so far only poll state that
+     * changes on timer events, see avr_idle_insn()
+     */
+    bool idle_loop;
+    /* Registers and SREG bits read before being written, see IDLE_REG() */
+    uint64_t idle_uses;
+    /* Registers and SREG bits written so far */
+    uint64_t idle_defs;
+    /* Pointers the loop loads through, see avr_idle_ptr() */
+    uint32_t idle_ptrs;
+    /*
+     * Translating the instruction after SEI, leave the TB for the main loop
+     * rather than chaining to the next one, see translate_BSET()
+     */
+    bool irq_shadow;
+    /*
+     * The instruction being translated may access a device under icount,
+     * and runs with can_do_io set, see avr_insn_does_io()
+     */
+    bool io;
 };
 
+static bool avr_idle_jump(DisasContext *ctx, target_ulong dest);
+
 static void gen_goto_tb(DisasContext *ctx, int n, target_ulong dest)
 {
     TranslationBlock *tb = ctx->tb;
 
-    if (ctx->singlestep == 0) {
+    if (ctx->io) {
+        gen_io_end(); /* chained TBs don't go through cpu_tb_exec() */
+    }
+    if (ctx->irq_shadow) {
+        tcg_gen_movi_i32(cpu_pc, dest);
+        tcg_gen_exit_tb(NULL, 0);
+    } else if (ctx->singlestep == 0) {
+        if (avr_idle_jump(ctx, dest)) {
+            TCGv ptrs = tcg_const_i32(ctx->idle_ptrs);
+
+            tcg_gen_movi_i32(cpu_pc, dest);
+            gen_helper_idle(cpu_env, ptrs);
+            tcg_temp_free_i32(ptrs);
+        }
         tcg_gen_goto_tb(n);
         tcg_gen_movi_i32(cpu_pc, dest);
         tcg_gen_exit_tb(tb, n);
@@ -100,44 +180,294 @@ static void gen_goto_tb(DisasContext *ctx, int n, target_ulong dest)
     }
 }
 
-#include "exec/gen-icount.h"
+/*
+ *  End the TB at a PC computed at run time. Rather than returning to the main
+ *  loop, look the destination TB up and jump to it directly; most of these are
+ *  returns into the middle of a caller, whose TB is already translated.
+ */
+static void gen_goto_ptr(DisasContext *ctx)
+{
+    if (ctx->io) {
+        gen_io_end();
+    }
+    if (ctx->irq_shadow) {
+        tcg_gen_exit_tb(NULL, 0);
+    } else if (ctx->singlestep == 0) {
+        tcg_gen_lookup_and_goto_ptr();
+    } else {
+        gen_helper_debug(cpu_env);
+        tcg_gen_exit_tb(NULL, 0);
+    }
+}
+
+/*
+ *  Count the edge into this TB, the way AFL does: each TB has a pseudo-random
+ *  location and the edge's counter is the one at the previous location,
+ *  shifted so A->B and B->A differ, xor this one.  It is all inline, chained
+ *  TBs jump to the start of their host code, so direct edges go through here
+ *  as well as returns and the other indirect jumps.  Counters are bytes and
+ *  may wrap, as in AFL.
+ */
+static void gen_coverage(DisasContext *ctx, target_ulong pc)
+{
+    uint32_t loc = (pc * 0x9e3779b1u) >> (32 - AVR_COVERAGE_BITS);
+    TCGv prev = tcg_temp_new_i32();
+    TCGv count = tcg_temp_new_i32();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    tcg_gen_ld_i32(prev, cpu_env, offsetof(CPUAVRState, cov_prev));
+    tcg_gen_xori_i32(prev, prev, loc);
+    tcg_gen_ext_i32_ptr(ptr, prev);
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)ctx->coverage);
+    tcg_gen_ld8u_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st8_i32(count, ptr, 0);
+    tcg_gen_movi_i32(prev, loc >> 1);
+    tcg_gen_st_i32(prev, cpu_env, offsetof(CPUAVRState, cov_prev));
+
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_i32(prev);
+}
+
 #include "translate-inst.h"
 
-static void gen_add_CHf(TCGv R, TCGv Rd, TCGv Rr)
+/*
+ *  A TB that jumps back to its own start without storing anything, and
+ *  without carrying a value from one iteration to the next in registers or
+ *  SREG, is polling RAM, e.g. avr-gcc's code for while (!flag).  The flag
+ *  can only change in an interrupt handler.  Devices raise interrupts on
+ *  timer events, or on input from outside, like a character the USART
+ *  receives, which isn't tied to virtual time anyway.  So under icount, if
+ *  a timer is armed, the time up to its deadline can be skipped rather than
+ *  spent in the loop.  Without one there is nothing to skip to, see
+ *  avr_cpu_skip_idle().
+ *
+ *  Loops polling IO registers aren't skipped: devices like avr-timer16
+ *  compute their registers when they are read and only run a timer for the
+ *  events that raise an enabled interrupt, so a flag polled with the
+ *  interrupt disabled may change without any event.  LDS is checked to
+ *  load from RAM here, loads through X, Y or Z by helper_idle().
+ *
+ *  Only instructions commonly found in such loops are recognised, anything
+ *  else stops the TB from being treated as one.
+ */
+#define IDLE_REG(r) (UINT64_C(1) << (r))
+#define IDLE_SREG(b) (UINT64_C(1) << (NO_CPU_REGISTERS + (b)))
+#define IDLE_PAIR(r) (IDLE_REG(r) | IDLE_REG((r) + 1))
+#define IDLE_ZNVS (IDLE_SREG(SREG_Z) | IDLE_SREG(SREG_N) | \
+                   IDLE_SREG(SREG_V) | IDLE_SREG(SREG_S))
+#define IDLE_CMP (IDLE_ZNVS | IDLE_SREG(SREG_C) | IDLE_SREG(SREG_H))
+
+/*
+ *  Record a load through pointer @ptr, 0 for X, 1 for Y and 2 for Z, with
+ *  displacement @q.  Byte @ptr of idle_ptrs holds one more than the largest
+ *  displacement, helper_idle() checks the bytes up to it are RAM.
+ */
+static void avr_idle_ptr(DisasContext *ctx, int ptr, int q)
 {
-    TCGv t1 = tcg_temp_new_i32();
-    TCGv t2 = tcg_temp_new_i32();
-    TCGv t3 = tcg_temp_new_i32();
+    int shift = ptr * 8;
 
-    tcg_gen_and_tl(t1, Rd, Rr); /* t1 = Rd & Rr */
-    tcg_gen_andc_tl(t2, Rd, R); /* t2 = Rd & ~R */
-    tcg_gen_andc_tl(t3, Rr, R); /* t3 = Rr & ~R */
-    tcg_gen_or_tl(t1, t1, t2); /* t1 = t1 | t2 | t3 */
-    tcg_gen_or_tl(t1, t1, t3);
+    if (extract32(ctx->idle_ptrs, shift, 8) < q + 1) {
+        ctx->idle_ptrs = deposit32(ctx->idle_ptrs, shift, 8, q + 1);
+    }
+}
 
-    tcg_gen_shri_tl(cpu_Cf, t1, 7); /* Cf = t1(7) */
-    tcg_gen_shri_tl(cpu_Hf, t1, 3); /* Hf = t1(3) */
-    tcg_gen_andi_tl(cpu_Hf, cpu_Hf, 1);
+static void avr_idle_insn(DisasContext *ctx, InstInfo *inst)
+{
+    uint32_t opcode = inst->opcode;
+    uint64_t uses = 0;
+    uint64_t defs = 0;
 
-    tcg_temp_free_i32(t3);
-    tcg_temp_free_i32(t2);
-    tcg_temp_free_i32(t1);
+    if (!ctx->idle_loop) {
+        return;
+    }
+
+    switch (inst->insn) {
+    case AVR_INSN_LDS:
+        if (!avr_cpu_data_is_ram(CPU(avr_env_get_cpu(ctx->env)),
+                                 LDS_Imm(opcode), 1)) {
+            ctx->idle_loop = false; /* reads a register, IO or MMIO */
+            return;
+        }
+        defs = IDLE_REG(LDS_Rd(opcode));
+        break;
+    case AVR_INSN_LDX1:
+        avr_idle_ptr(ctx, 0, 0);
+        uses = IDLE_PAIR(26);
+        defs = IDLE_REG(LDX1_Rd(opcode));
+        break;
+    case AVR_INSN_LDDY:
+        avr_idle_ptr(ctx, 1, LDDY_Imm(opcode));
+        uses = IDLE_PAIR(28);
+        defs = IDLE_REG(LDDY_Rd(opcode));
+        break;
+    case AVR_INSN_LDDZ:
+        avr_idle_ptr(ctx, 2, LDDZ_Imm(opcode));
+        uses = IDLE_PAIR(30);
+        defs = IDLE_REG(LDDZ_Rd(opcode));
+        break;
+    case AVR_INSN_MOV:
+        uses = IDLE_REG(MOV_Rr(opcode));
+        defs = IDLE_REG(MOV_Rd(opcode));
+        break;
+    case AVR_INSN_AND:
+        uses = IDLE_REG(AND_Rd(opcode)) | IDLE_REG(AND_Rr(opcode));
+        defs = IDLE_REG(AND_Rd(opcode)) | IDLE_ZNVS;
+        break;
+    case AVR_INSN_OR:
+        uses = IDLE_REG(OR_Rd(opcode)) | IDLE_REG(OR_Rr(opcode));
+        defs = IDLE_REG(OR_Rd(opcode)) | IDLE_ZNVS;
+        break;
+    case AVR_INSN_EOR:
+        uses = IDLE_REG(EOR_Rd(opcode)) | IDLE_REG(EOR_Rr(opcode));
+        defs = IDLE_REG(EOR_Rd(opcode)) | IDLE_ZNVS;
+        break;
+    case AVR_INSN_ANDI:
+        uses = IDLE_REG(16 + ANDI_Rd(opcode));
+        defs = IDLE_REG(16 + ANDI_Rd(opcode)) | IDLE_ZNVS;
+        break;
+    case AVR_INSN_ORI:
+        uses = IDLE_REG(16 + ORI_Rd(opcode));
+        defs = IDLE_REG(16 + ORI_Rd(opcode)) | IDLE_ZNVS;
+        break;
+    case AVR_INSN_CP:
+        uses = IDLE_REG(CP_Rd(opcode)) | IDLE_REG(CP_Rr(opcode));
+        defs = IDLE_CMP;
+        break;
+    case AVR_INSN_CPC:
+        uses = IDLE_REG(CPC_Rd(opcode)) | IDLE_REG(CPC_Rr(opcode)) |
+               IDLE_SREG(SREG_C) | IDLE_SREG(SREG_Z);
+        defs = IDLE_CMP;
+        break;
+    case AVR_INSN_CPI:
+        uses = IDLE_REG(16 + CPI_Rd(opcode));
+        defs = IDLE_CMP;
+        break;
+    case AVR_INSN_CPSE:
+        uses = IDLE_REG(CPSE_Rd(opcode)) | IDLE_REG(CPSE_Rr(opcode));
+        break;
+    case AVR_INSN_SBRC:
+        uses = IDLE_REG(SBRC_Rr(opcode));
+        break;
+    case AVR_INSN_SBRS:
+        uses = IDLE_REG(SBRS_Rr(opcode));
+        break;
+    case AVR_INSN_BRBC:
+        uses = IDLE_SREG(BRBC_Bit(opcode));
+        break;
+    case AVR_INSN_BRBS:
+        uses = IDLE_SREG(BRBS_Bit(opcode));
+        break;
+    case AVR_INSN_RJMP:
+    case AVR_INSN_NOP:
+    case AVR_INSN_WDR: /* repeating it only matters at the watchdog's timer */
+        break;
+    default:
+        ctx->idle_loop = false;
+        return;
+    }
+
+    /* Reject values carried over from one iteration to the next */
+    ctx->idle_uses |= uses & ~ctx->idle_defs;
+    ctx->idle_defs |= defs;
+    if (ctx->idle_uses & ctx->idle_defs) {
+        ctx->idle_loop = false;
+    }
 }
 
-static void gen_add_Vf(TCGv R, TCGv Rd, TCGv Rr)
+/*
+ *  Whether jumping to dest from the end of the TB loops back to its start,
+ *  either directly or through an RJMP following a skip instruction.
+ */
+static bool avr_idle_jump(DisasContext *ctx, target_ulong dest)
 {
-    TCGv t1 = tcg_temp_new_i32();
-    TCGv t2 = tcg_temp_new_i32();
+    InstInfo *next = &ctx->inst[1];
+    target_ulong start = ctx->tb->pc / 2;
 
-        /* t1 = Rd & Rr & ~R | ~Rd & ~Rr & R = (Rd ^ R) & ~(Rd ^ Rr) */
-    tcg_gen_xor_tl(t1, Rd, R);
-    tcg_gen_xor_tl(t2, Rd, Rr);
-    tcg_gen_andc_tl(t1, t1, t2);
+    if (!ctx->idle_loop) {
+        return false;
+    }
+    if (dest == next->cpc && next->insn == AVR_INSN_RJMP) {
+        dest = next->npc + sextract32(RJMP_Imm(next->opcode), 0, 12);
+    }
+    return dest == start;
+}
 
-    tcg_gen_shri_tl(cpu_Vf, t1, 7); /* Vf = t1(7) */
+/*
+ *  The cycles a branch or skip takes on top of insn_cycles[] when it is
+ *  taken.  @next is the instruction after @inst, or NULL if it isn't
+ *  decoded yet, which counts as the longest one.
+ */
+static int avr_insn_taken_cycles(InstInfo *inst, InstInfo *next)
+{
+    switch (inst->insn) {
+    case AVR_INSN_BRBC:
+    case AVR_INSN_BRBS:
+        return 1;
+    case AVR_INSN_CPSE:
+    case AVR_INSN_SBIC:
+    case AVR_INSN_SBIS:
+    case AVR_INSN_SBRC:
+    case AVR_INSN_SBRS:
+        return next ? next->length / 16 : 2;
+    default:
+        return 0;
+    }
+}
 
-    tcg_temp_free_i32(t2);
-    tcg_temp_free_i32(t1);
+/*
+ *  A TB is charged as if its branch or skip is taken, so that the budget
+ *  checked on entry covers either path.  Give the extra cycles back on the
+ *  path not taken.  The counter can't wrap, it was at least that much
+ *  higher on entry.
+ */
+static void gen_refund_cycles(DisasContext *ctx, int cycles)
+{
+    TCGv_i32 count;
+
+    if (!(tb_cflags(ctx->tb) & CF_USE_ICOUNT)) {
+        return;
+    }
+
+    count = tcg_temp_new_i32();
+    tcg_gen_ld16u_i32(count, cpu_env,
+                      -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.low));
+    tcg_gen_addi_i32(count, count, cycles);
+    tcg_gen_st16_i32(count, cpu_env,
+                     -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.low));
+    tcg_temp_free_i32(count);
+}
+
+/*
+ *  A TB for cpu_exec_nocache() fits in the budget left, but its first
+ *  instruction, or SEI and the one after it, may take more than that: the
+ *  deadline falls inside them.  They still run in full and the virtual
+ *  clock goes past the deadline, the cycles over the budget are added to
+ *  icount_budget on entry, which cpu_update_icount() accounts as executed.
+ *  Returns the op whose immediate is set to those cycles once they're
+ *  known.
+ */
+static TCGOp *gen_icount_overrun(void)
+{
+    TCGv_i32 overrun = tcg_temp_new_i32();
+    TCGv_i64 budget = tcg_temp_new_i64();
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGOp *op;
+
+    tcg_gen_movi_i32(overrun, 0xdeadbeef);
+    op = tcg_last_op();
+    tcg_gen_extu_i32_i64(t0, overrun);
+    tcg_gen_ld_i64(budget, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, icount_budget));
+    tcg_gen_add_i64(budget, budget, t0);
+    tcg_gen_st_i64(budget, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, icount_budget));
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(budget);
+    tcg_temp_free_i32(overrun);
+    return op;
 }
 
 static void gen_sub_CHf(TCGv R, TCGv Rd, TCGv Rr)
@@ -191,11 +521,237 @@ static void gen_NSf(TCGv R)
     tcg_gen_xor_tl(cpu_Sf, cpu_Nf, cpu_Vf); /* Sf = Nf ^ Vf */
 }
 
-static void gen_ZNSf(TCGv R)
+static TCGv sreg_flag(int bit)
+{
+    switch (bit) {
+    case SREG_C:
+        return cpu_Cf;
+    case SREG_Z:
+        return cpu_Zf;
+    case SREG_N:
+        return cpu_Nf;
+    case SREG_V:
+        return cpu_Vf;
+    case SREG_S:
+        return cpu_Sf;
+    case SREG_H:
+        return cpu_Hf;
+    case SREG_T:
+        return cpu_Tf;
+    case SREG_I:
+        return cpu_If;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ *  Lazy flags, see AVRCCOp. The helpers below mirror avr_cpu_compute_flags(),
+ *  keep the two in sync.
+ */
+static void gen_cc_carries(int cc_op, TCGv carries)
 {
-    tcg_gen_mov_tl(cpu_Zf, R); /* Zf = R */
-    tcg_gen_shri_tl(cpu_Nf, R, 7); /* Nf = R(7) */
-    tcg_gen_xor_tl(cpu_Sf, cpu_Nf, cpu_Vf); /* Sf = Nf ^ Vf */
+    TCGv t1 = tcg_temp_new_i32();
+    TCGv t2 = tcg_temp_new_i32();
+
+    switch (cc_op) {
+    case AVR_CC_OP_ADD:
+        /* carries = Rd & Rr | Rd & ~R | Rr & ~R */
+        tcg_gen_and_tl(t1, cpu_cc_rd, cpu_cc_rr);
+        tcg_gen_andc_tl(t2, cpu_cc_rd, cpu_cc_r);
+        tcg_gen_or_tl(t1, t1, t2);
+        tcg_gen_andc_tl(t2, cpu_cc_rr, cpu_cc_r);
+        tcg_gen_or_tl(carries, t1, t2);
+        break;
+    case AVR_CC_OP_SUB:
+        /* carries = ~Rd & Rr | ~Rd & R | R & Rr */
+        tcg_gen_andc_tl(t1, cpu_cc_rr, cpu_cc_rd);
+        tcg_gen_orc_tl(t2, cpu_cc_rr, cpu_cc_rd);
+        tcg_gen_and_tl(t2, t2, cpu_cc_r);
+        tcg_gen_or_tl(carries, t1, t2);
+        break;
+    case AVR_CC_OP_ADDW:
+        tcg_gen_andc_tl(carries, cpu_cc_rd, cpu_cc_r); /* Rd & ~R */
+        break;
+    case AVR_CC_OP_SUBW:
+        tcg_gen_andc_tl(carries, cpu_cc_r, cpu_cc_rd); /* R & ~Rd */
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t1);
+}
+
+static void gen_cc_overflow(int cc_op, TCGv Vf)
+{
+    TCGv t1 = tcg_temp_new_i32();
+    TCGv t2 = tcg_temp_new_i32();
+
+    switch (cc_op) {
+    case AVR_CC_OP_ADD:
+        /* Vf = ((Rd ^ R) & ~(Rd ^ Rr))(7) */
+        tcg_gen_xor_tl(t1, cpu_cc_rd, cpu_cc_r);
+        tcg_gen_xor_tl(t2, cpu_cc_rd, cpu_cc_rr);
+        tcg_gen_andc_tl(t1, t1, t2);
+        tcg_gen_extract_tl(Vf, t1, 7, 1);
+        break;
+    case AVR_CC_OP_SUB:
+        /* Vf = ((Rd ^ R) & (Rd ^ Rr))(7) */
+        tcg_gen_xor_tl(t1, cpu_cc_rd, cpu_cc_r);
+        tcg_gen_xor_tl(t2, cpu_cc_rd, cpu_cc_rr);
+        tcg_gen_and_tl(t1, t1, t2);
+        tcg_gen_extract_tl(Vf, t1, 7, 1);
+        break;
+    case AVR_CC_OP_ADDW:
+        tcg_gen_andc_tl(t1, cpu_cc_r, cpu_cc_rd); /* Vf = (R & ~Rd)(15) */
+        tcg_gen_extract_tl(Vf, t1, 15, 1);
+        break;
+    case AVR_CC_OP_SUBW:
+        tcg_gen_andc_tl(t1, cpu_cc_rd, cpu_cc_r); /* Vf = (Rd & ~R)(15) */
+        tcg_gen_extract_tl(Vf, t1, 15, 1);
+        break;
+    case AVR_CC_OP_LOGIC:
+        tcg_gen_movi_tl(Vf, 0);
+        break;
+    case AVR_CC_OP_INC:
+        tcg_gen_setcondi_tl(TCG_COND_EQ, Vf, cpu_cc_r, 0x80);
+        break;
+    case AVR_CC_OP_DEC:
+        tcg_gen_setcondi_tl(TCG_COND_EQ, Vf, cpu_cc_r, 0x7f);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t1);
+}
+
+/* Compute SREG bit @bit from the current lazy flags operation */
+static void gen_cc_compute(DisasContext *ctx, TCGv flag, int bit)
+{
+    int msb = ctx->cc_op == AVR_CC_OP_ADDW
+           || ctx->cc_op == AVR_CC_OP_SUBW ? 15 : 7;
+    TCGv t0 = tcg_temp_new_i32();
+    TCGv t1 = tcg_temp_new_i32();
+
+    switch (bit) {
+    case SREG_C:
+        gen_cc_carries(ctx->cc_op, t0);
+        tcg_gen_extract_tl(flag, t0, msb, 1);
+        break;
+    case SREG_H:
+        gen_cc_carries(ctx->cc_op, t0);
+        tcg_gen_extract_tl(flag, t0, 3, 1);
+        break;
+    case SREG_Z:
+        tcg_gen_mov_tl(flag, cpu_cc_r); /* Zf = R */
+        break;
+    case SREG_N:
+        tcg_gen_extract_tl(flag, cpu_cc_r, msb, 1); /* Nf = R(msb) */
+        break;
+    case SREG_V:
+        gen_cc_overflow(ctx->cc_op, flag);
+        break;
+    case SREG_S:
+        gen_cc_overflow(ctx->cc_op, t0);
+        tcg_gen_extract_tl(t1, cpu_cc_r, msb, 1);
+        tcg_gen_xor_tl(flag, t1, t0); /* Sf = Nf ^ Vf */
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t0);
+}
+
+/*
+ *  Switch to a new lazy flags operation. Flags the old operation computed but
+ *  the new one doesn't are written back to their cpu_*f globals first.
+ */
+static void gen_set_cc_op(DisasContext *ctx, int cc_op)
+{
+    int dead = cc_op_live[ctx->cc_op] & ~cc_op_live[cc_op];
+    int bit;
+
+    for (bit = 0; bit < SREG_T; bit++) {
+        if (dead & (1 << bit)) {
+            gen_cc_compute(ctx, sreg_flag(bit), bit);
+        }
+    }
+    if (ctx->cc_op != cc_op) {
+        ctx->cc_op = cc_op;
+        tcg_gen_movi_tl(cpu_cc_op, cc_op);
+    }
+}
+
+/* Record a lazy flags operation, Rd and Rr may be NULL if it doesn't use them */
+static void gen_set_cc(DisasContext *ctx, int cc_op, TCGv R, TCGv Rd, TCGv Rr)
+{
+    gen_set_cc_op(ctx, cc_op);
+    tcg_gen_mov_tl(cpu_cc_r, R);
+    if (Rd) {
+        tcg_gen_mov_tl(cpu_cc_rd, Rd);
+    }
+    if (Rr) {
+        tcg_gen_mov_tl(cpu_cc_rr, Rr);
+    }
+}
+
+/* Bring all flags into their cpu_*f globals */
+static void gen_flush_flags(DisasContext *ctx)
+{
+    gen_set_cc_op(ctx, AVR_CC_OP_FLAGS);
+}
+
+/* Return a temporary holding SREG bit @bit, in the form of its cpu_*f global */
+static TCGv gen_get_flag(DisasContext *ctx, int bit)
+{
+    TCGv flag = tcg_temp_new_i32();
+
+    if (cc_op_live[ctx->cc_op] & (1 << bit)) {
+        gen_cc_compute(ctx, flag, bit);
+    } else {
+        tcg_gen_mov_tl(flag, sreg_flag(bit));
+    }
+
+    return flag;
+}
+
+/* Branch to @taken if SREG bit @bit is @set */
+static void gen_brcond_flag(DisasContext *ctx, int bit, bool set,
+                            TCGLabel *taken)
+{
+    TCGv t0;
+    TCGv t1;
+
+    if (ctx->cc_op == AVR_CC_OP_SUB) {
+        /* Compare the operands directly for the common CP/BRxx pairs */
+        switch (bit) {
+        case SREG_C:
+            tcg_gen_brcond_tl(set ? TCG_COND_LTU : TCG_COND_GEU,
+                              cpu_cc_rd, cpu_cc_rr, taken);
+            return;
+        case SREG_S:
+            t0 = tcg_temp_new_i32();
+            t1 = tcg_temp_new_i32();
+            tcg_gen_ext8s_tl(t0, cpu_cc_rd);
+            tcg_gen_ext8s_tl(t1, cpu_cc_rr);
+            tcg_gen_brcond_tl(set ? TCG_COND_LT : TCG_COND_GE, t0, t1, taken);
+            tcg_temp_free_i32(t1);
+            tcg_temp_free_i32(t0);
+            return;
+        }
+    }
+
+    t0 = gen_get_flag(ctx, bit);
+    /* Zf has negative logic */
+    tcg_gen_brcondi_tl(set == (bit == SREG_Z) ? TCG_COND_EQ : TCG_COND_NE,
+                       t0, 0, taken);
+    tcg_temp_free_i32(t0);
 }
 
 static void gen_push_ret(DisasContext *ctx, int ret)
@@ -264,17 +820,17 @@ static void gen_pop_ret(DisasContext *ctx, TCGv ret)
     }
 }
 
-static void gen_jmp_ez(void)
+static void gen_jmp_ez(DisasContext *ctx)
 {
     tcg_gen_deposit_tl(cpu_pc, cpu_r[30], cpu_r[31], 8, 8);
     tcg_gen_or_tl(cpu_pc, cpu_pc, cpu_eind);
-    tcg_gen_exit_tb(NULL, 0);
+    gen_goto_ptr(ctx);
 }
 
-static void gen_jmp_z(void)
+static void gen_jmp_z(DisasContext *ctx)
 {
     tcg_gen_deposit_tl(cpu_pc, cpu_r[30], cpu_r[31], 8, 8);
-    tcg_gen_exit_tb(NULL, 0);
+    gen_goto_ptr(ctx);
 }
 
 /*
@@ -282,15 +838,15 @@ static void gen_jmp_z(void)
  *  H assumed to be in 0x00ff0000 format
  *  M assumed to be in 0x000000ff format
  *  L assumed to be in 0x000000ff format
+ *
+ *  The registers are TCG globals so the pair is usually in host registers
+ *  already, splitting and joining it are single ops.  Loads and stores
+ *  don't apply RAMPX, RAMPY or RAMPZ, so gen_get_addr() only joins M:L.
  */
 static void gen_set_addr(TCGv addr, TCGv H, TCGv M, TCGv L)
 {
-
     tcg_gen_andi_tl(L, addr, 0x000000ff);
-
-    tcg_gen_andi_tl(M, addr, 0x0000ff00);
-    tcg_gen_shri_tl(M, M, 8);
-
+    tcg_gen_extract_tl(M, addr, 8, 8);
     tcg_gen_andi_tl(H, addr, 0x00ff0000);
 }
 
@@ -309,29 +865,29 @@ static void gen_set_zaddr(TCGv addr)
     gen_set_addr(addr, cpu_rampZ, cpu_r[31], cpu_r[30]);
 }
 
-static TCGv gen_get_addr(TCGv H, TCGv M, TCGv L)
+/* The address is a local temp as gen_data_load/store() branch on it */
+static TCGv gen_get_addr(TCGv M, TCGv L)
 {
-    TCGv addr = tcg_temp_new_i32();
+    TCGv addr = tcg_temp_local_new_i32();
 
-    tcg_gen_deposit_tl(addr, M, H, 8, 8);
-    tcg_gen_deposit_tl(addr, L, addr, 8, 16);
+    tcg_gen_deposit_tl(addr, L, M, 8, 8);
 
     return addr;
 }
 
 static TCGv gen_get_xaddr(void)
 {
-    return gen_get_addr(cpu_rampX, cpu_r[27], cpu_r[26]);
+    return gen_get_addr(cpu_r[27], cpu_r[26]);
 }
 
 static TCGv gen_get_yaddr(void)
 {
-    return gen_get_addr(cpu_rampY, cpu_r[29], cpu_r[28]);
+    return gen_get_addr(cpu_r[29], cpu_r[28]);
 }
 
 static TCGv gen_get_zaddr(void)
 {
-    return gen_get_addr(cpu_rampZ, cpu_r[31], cpu_r[30]);
+    return gen_get_addr(cpu_r[31], cpu_r[30]);
 }
 
 /*
@@ -343,19 +899,19 @@ static int translate_ADC(DisasContext *ctx, uint32_t opcode)
     TCGv Rd = cpu_r[ADC_Rd(opcode)];
     TCGv Rr = cpu_r[ADC_Rr(opcode)];
     TCGv R = tcg_temp_new_i32();
+    TCGv Cf = gen_get_flag(ctx, SREG_C);
 
     /* op */
     tcg_gen_add_tl(R, Rd, Rr); /* R = Rd + Rr + Cf */
-    tcg_gen_add_tl(R, R, cpu_Cf);
+    tcg_gen_add_tl(R, R, Cf);
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_add_CHf(R, Rd, Rr);
-    gen_add_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_ADD, R, Rd, Rr);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
 
+    tcg_temp_free_i32(Cf);
     tcg_temp_free_i32(R);
 
     return BS_NONE;
@@ -375,9 +931,7 @@ static int translate_ADD(DisasContext *ctx, uint32_t opcode)
     tcg_gen_add_tl(R, Rd, Rr); /* Rd = Rd + Rr */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_add_CHf(R, Rd, Rr);
-    gen_add_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_ADD, R, Rd, Rr);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
@@ -413,22 +967,7 @@ static int translate_ADIW(DisasContext *ctx, uint32_t opcode)
     tcg_gen_addi_tl(R, Rd, Imm); /* R = Rd + Imm */
     tcg_gen_andi_tl(R, R, 0xffff); /* make it 16 bits */
 
-    /* Cf */
-    tcg_gen_andc_tl(cpu_Cf, Rd, R); /* Cf = Rd & ~R */
-    tcg_gen_shri_tl(cpu_Cf, cpu_Cf, 15);
-
-    /* Vf */
-    tcg_gen_andc_tl(cpu_Vf, R, Rd); /* Vf = R & ~Rd */
-    tcg_gen_shri_tl(cpu_Vf, cpu_Vf, 15);
-
-    /* Zf */
-    tcg_gen_mov_tl(cpu_Zf, R); /* Zf = R */
-
-    /* Nf */
-    tcg_gen_shri_tl(cpu_Nf, R, 15); /* Nf = R(15) */
-
-    /* Sf */
-    tcg_gen_xor_tl(cpu_Sf, cpu_Nf, cpu_Vf);/* Sf = Nf ^ Vf */
+    gen_set_cc(ctx, AVR_CC_OP_ADDW, R, Rd, NULL);
 
     /* R */
     tcg_gen_andi_tl(RdL, R, 0xff);
@@ -453,13 +992,7 @@ static int translate_AND(DisasContext *ctx, uint32_t opcode)
     /* op */
     tcg_gen_and_tl(R, Rd, Rr); /* Rd = Rd and Rr */
 
-    /* Vf */
-    tcg_gen_movi_tl(cpu_Vf, 0x00); /* Vf = 0 */
-
-    /* Zf */
-    tcg_gen_mov_tl(cpu_Zf, R); /* Zf = R */
-
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, R, NULL, NULL);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
@@ -481,8 +1014,7 @@ static int translate_ANDI(DisasContext *ctx, uint32_t opcode)
     /* op */
     tcg_gen_andi_tl(Rd, Rd, Imm); /* Rd = Rd & Imm */
 
-    tcg_gen_movi_tl(cpu_Vf, 0x00); /* Vf = 0 */
-    gen_ZNSf(Rd);
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, Rd, NULL, NULL);
 
     return BS_NONE;
 }
@@ -498,6 +1030,8 @@ static int translate_ASR(DisasContext *ctx, uint32_t opcode)
     TCGv Rd = cpu_r[ASR_Rd(opcode)];
     TCGv t0 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     /* Cf */
     tcg_gen_andi_tl(cpu_Cf, Rd, 1); /* Cf = Rd(0) */
 
@@ -518,6 +1052,10 @@ static int translate_ASR(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_BCLR(DisasContext *ctx, uint32_t opcode)
 {
+    if (cc_op_live[ctx->cc_op] & (1 << BCLR_Bit(opcode))) {
+        gen_flush_flags(ctx);
+    }
+
     switch (BCLR_Bit(opcode)) {
     case 0x00:
         tcg_gen_movi_tl(cpu_Cf, 0x00);
@@ -577,33 +1115,9 @@ static int translate_BRBC(DisasContext *ctx, uint32_t opcode)
     TCGLabel *taken = gen_new_label();
     int Imm = sextract32(BRBC_Imm(opcode), 0, 7);
 
-    switch (BRBC_Bit(opcode)) {
-    case 0x00:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Cf, 0, taken);
-        break;
-    case 0x01:
-        tcg_gen_brcondi_i32(TCG_COND_NE, cpu_Zf, 0, taken);
-        break;
-    case 0x02:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Nf, 0, taken);
-        break;
-    case 0x03:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Vf, 0, taken);
-        break;
-    case 0x04:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Sf, 0, taken);
-        break;
-    case 0x05:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Hf, 0, taken);
-        break;
-    case 0x06:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Tf, 0, taken);
-        break;
-    case 0x07:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_If, 0, taken);
-        break;
-    }
+    gen_brcond_flag(ctx, BRBC_Bit(opcode), false, taken);
 
+    gen_refund_cycles(ctx, 1);
     gen_goto_tb(ctx, 1, ctx->inst[0].npc);
     gen_set_label(taken);
     gen_goto_tb(ctx, 0, ctx->inst[0].npc + Imm);
@@ -622,33 +1136,9 @@ static int translate_BRBS(DisasContext *ctx, uint32_t opcode)
     TCGLabel *taken = gen_new_label();
     int Imm = sextract32(BRBS_Imm(opcode), 0, 7);
 
-    switch (BRBS_Bit(opcode)) {
-    case 0x00:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Cf, 1, taken);
-        break;
-    case 0x01:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Zf, 0, taken);
-        break;
-    case 0x02:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Nf, 1, taken);
-        break;
-    case 0x03:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Vf, 1, taken);
-        break;
-    case 0x04:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Sf, 1, taken);
-        break;
-    case 0x05:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Hf, 1, taken);
-        break;
-    case 0x06:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_Tf, 1, taken);
-        break;
-    case 0x07:
-        tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_If, 1, taken);
-        break;
-    }
+    gen_brcond_flag(ctx, BRBS_Bit(opcode), true, taken);
 
+    gen_refund_cycles(ctx, 1);
     gen_goto_tb(ctx, 1, ctx->inst[0].npc);
     gen_set_label(taken);
     gen_goto_tb(ctx, 0, ctx->inst[0].npc + Imm);
@@ -661,6 +1151,10 @@ static int translate_BRBS(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_BSET(DisasContext *ctx, uint32_t opcode)
 {
+    if (cc_op_live[ctx->cc_op] & (1 << BSET_Bit(opcode))) {
+        gen_flush_flags(ctx);
+    }
+
     switch (BSET_Bit(opcode)) {
     case 0x00:
         tcg_gen_movi_tl(cpu_Cf, 0x01);
@@ -685,12 +1179,23 @@ static int translate_BSET(DisasContext *ctx, uint32_t opcode)
         break;
     case 0x07:
         tcg_gen_movi_tl(cpu_If, 0x01);
+        /*
+         * The instruction after SEI runs before any pending interrupt, so
+         * that sei; sleep can't miss the interrupt it waits for.
+         * gen_intermediate_code() translates it into this TB, then returns
+         * to the main loop so interrupts raised while I was clear are taken.
+         */
         break;
     }
 
     return BS_NONE;
 }
 
+static bool avr_insn_is_sei(InstInfo *inst)
+{
+    return inst->insn == AVR_INSN_BSET && BSET_Bit(inst->opcode) == 0x07;
+}
+
 /*
  *  The BREAK instruction is used by the On-chip Debug system, and is
  *  normally not used in the application software. When the BREAK instruction is
@@ -786,9 +1291,8 @@ static int translate_COM(DisasContext *ctx, uint32_t opcode)
 
     tcg_gen_xori_tl(Rd, Rd, 0xff);
 
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, Rd, NULL, NULL);
     tcg_gen_movi_tl(cpu_Cf, 1); /* Cf = 1 */
-    tcg_gen_movi_tl(cpu_Vf, 0); /* Vf = 0 */
-    gen_ZNSf(Rd);
 
     tcg_temp_free_i32(R);
 
@@ -810,9 +1314,7 @@ static int translate_CP(DisasContext *ctx, uint32_t opcode)
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_sub_CHf(R, Rd, Rr);
-    gen_sub_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_SUB, R, Rd, Rr);
 
     tcg_temp_free_i32(R);
 
@@ -830,6 +1332,8 @@ static int translate_CPC(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = cpu_r[CPC_Rr(opcode)];
     TCGv R = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     /* op */
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr - Cf */
     tcg_gen_sub_tl(R, R, cpu_Cf);
@@ -866,9 +1370,7 @@ static int translate_CPI(DisasContext *ctx, uint32_t opcode)
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_sub_CHf(R, Rd, Rr);
-    gen_sub_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_SUB, R, Rd, Rr);
 
     tcg_temp_free_i32(R);
     tcg_temp_free_i32(Rr);
@@ -886,12 +1388,11 @@ static int translate_CPSE(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = cpu_r[CPSE_Rr(opcode)];
     TCGLabel *skip = gen_new_label();
 
-        /* PC if next inst is skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[1].npc);
     tcg_gen_brcond_i32(TCG_COND_EQ, Rd, Rr, skip);
-        /* PC if next inst is not skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+    gen_refund_cycles(ctx, ctx->inst[1].length / 16);
+    gen_goto_tb(ctx, 1, ctx->inst[0].npc); /* next inst is not skipped */
     gen_set_label(skip);
+    gen_goto_tb(ctx, 0, ctx->inst[1].npc); /* next inst is skipped */
 
     return BS_BRANCH;
 }
@@ -911,9 +1412,7 @@ static int translate_DEC(DisasContext *ctx, uint32_t opcode)
     tcg_gen_subi_tl(Rd, Rd, 1); /* Rd = Rd - 1 */
     tcg_gen_andi_tl(Rd, Rd, 0xff); /* make it 8 bits */
 
-        /* cpu_Vf = Rd == 0x7f */
-    tcg_gen_setcondi_tl(TCG_COND_EQ, cpu_Vf, Rd, 0x7f);
-    gen_ZNSf(Rd);
+    gen_set_cc(ctx, AVR_CC_OP_DEC, Rd, NULL, NULL);
 
     return BS_NONE;
 }
@@ -970,7 +1469,7 @@ static int translate_EICALL(DisasContext *ctx, uint32_t opcode)
 
     gen_push_ret(ctx, ret);
 
-    gen_jmp_ez();
+    gen_jmp_ez(ctx);
 
     return BS_BRANCH;
 }
@@ -990,7 +1489,7 @@ static int translate_EIJMP(DisasContext *ctx, uint32_t opcode)
         return BS_EXCP;
     }
 
-    gen_jmp_ez();
+    gen_jmp_ez(ctx);
 
     return BS_BRANCH;
 }
@@ -1080,8 +1579,7 @@ static int translate_EOR(DisasContext *ctx, uint32_t opcode)
 
     tcg_gen_xor_tl(Rd, Rd, Rr);
 
-    tcg_gen_movi_tl(cpu_Vf, 0);
-    gen_ZNSf(Rd);
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, Rd, NULL, NULL);
 
     return BS_NONE;
 }
@@ -1104,12 +1602,13 @@ static int translate_FMUL(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = cpu_r[16 + FMUL_Rr(opcode)];
     TCGv R = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_mul_tl(R, Rd, Rr); /* R = Rd *Rr */
     tcg_gen_shli_tl(R, R, 1);
 
     tcg_gen_andi_tl(R0, R, 0xff);
-    tcg_gen_shri_tl(R1, R, 8);
-    tcg_gen_andi_tl(R1, R1, 0xff);
+    tcg_gen_extract_tl(R1, R, 8, 8);
 
     tcg_gen_shri_tl(cpu_Cf, R, 16); /* Cf = R(16) */
     tcg_gen_andi_tl(cpu_Zf, R, 0x0000ffff);
@@ -1139,14 +1638,15 @@ static int translate_FMULS(DisasContext *ctx, uint32_t opcode)
     TCGv t0 = tcg_temp_new_i32();
     TCGv t1 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_ext8s_tl(t0, Rd); /* make Rd full 32 bit signed */
     tcg_gen_ext8s_tl(t1, Rr); /* make Rr full 32 bit signed */
     tcg_gen_mul_tl(R, t0, t1); /* R = Rd *Rr */
     tcg_gen_shli_tl(R, R, 1);
 
     tcg_gen_andi_tl(R0, R, 0xff);
-    tcg_gen_shri_tl(R1, R, 8);
-    tcg_gen_andi_tl(R1, R1, 0xff);
+    tcg_gen_extract_tl(R1, R, 8, 8);
 
     tcg_gen_shri_tl(cpu_Cf, R, 16); /* Cf = R(16) */
     tcg_gen_andi_tl(cpu_Zf, R, 0x0000ffff);
@@ -1177,13 +1677,14 @@ static int translate_FMULSU(DisasContext *ctx, uint32_t opcode)
     TCGv R = tcg_temp_new_i32();
     TCGv t0 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_ext8s_tl(t0, Rd); /* make Rd full 32 bit signed */
     tcg_gen_mul_tl(R, t0, Rr); /* R = Rd *Rr */
     tcg_gen_shli_tl(R, R, 1);
 
     tcg_gen_andi_tl(R0, R, 0xff);
-    tcg_gen_shri_tl(R1, R, 8);
-    tcg_gen_andi_tl(R1, R1, 0xff);
+    tcg_gen_extract_tl(R1, R, 8, 8);
 
     tcg_gen_shri_tl(cpu_Cf, R, 16); /* Cf = R(16) */
     tcg_gen_andi_tl(cpu_Zf, R, 0x0000ffff);
@@ -1212,7 +1713,7 @@ static int translate_ICALL(DisasContext *ctx, uint32_t opcode)
     int ret = ctx->inst[0].npc;
 
     gen_push_ret(ctx, ret);
-    gen_jmp_z();
+    gen_jmp_z(ctx);
 
     return BS_BRANCH;
 }
@@ -1232,7 +1733,7 @@ static int translate_IJMP(DisasContext *ctx, uint32_t opcode)
         return BS_EXCP;
     }
 
-    gen_jmp_z();
+    gen_jmp_z(ctx);
 
     return BS_BRANCH;
 }
@@ -1269,9 +1770,7 @@ static int translate_INC(DisasContext *ctx, uint32_t opcode)
     tcg_gen_addi_tl(Rd, Rd, 1);
     tcg_gen_andi_tl(Rd, Rd, 0xff);
 
-        /* cpu_Vf = Rd == 0x80 */
-    tcg_gen_setcondi_tl(TCG_COND_EQ, cpu_Vf, Rd, 0x80);
-    gen_ZNSf(Rd);
+    gen_set_cc(ctx, AVR_CC_OP_INC, Rd, NULL, NULL);
     return BS_NONE;
 }
 
@@ -1293,33 +1792,215 @@ static int translate_JMP(DisasContext *ctx, uint32_t opcode)
 }
 
 /*
- *  Load one byte indirect from data space to register and stores an clear
- *  the bits in data space specified by the register. The instruction can only
- *  be used towards internal SRAM.  The data location is pointed to by the Z (16
- *  bits) Pointer Register in the Register File. Memory access is limited to the
- *  current data segment of 64KB. To access another data segment in devices with
- *  more than 64KB data space, the RAMPZ in register in the I/O area has to be
- *  changed.  The Z-pointer Register is left unchanged by the operation. This
- *  instruction is especially suited for clearing status bits stored in SRAM.
+ *  The first page of the data space holds the register file, the IO registers
+ *  and the extended IO registers, none of which can be accessed through the
+ *  TLB. Accesses that may land there check the address at run time and go
+ *  through helper_fullrd() or helper_fullwr() if it is in that page, and are
+ *  inline softmmu accesses otherwise. As this branches, @data and @addr must
+ *  be globals or local temps.
  */
 static void gen_data_store(DisasContext *ctx, TCGv data, TCGv addr)
 {
+    TCGLabel *slow;
+    TCGLabel *done;
+
+    /* This may write SREG, so don't leave the flags lazy across it */
+    gen_flush_flags(ctx);
+
     if (ctx->tb->flags & TB_FLAGS_FULL_ACCESS) {
         gen_helper_fullwr(cpu_env, data, addr);
-    } else {
-        tcg_gen_qemu_st8(data, addr, MMU_DATA_IDX); /* mem[addr] = data */
+        return;
     }
+
+    slow = gen_new_label();
+    done = gen_new_label();
+    tcg_gen_brcondi_tl(TCG_COND_LTU, addr, TARGET_PAGE_SIZE, slow);
+    tcg_gen_qemu_st8(data, addr, MMU_DATA_IDX); /* mem[addr] = data */
+    tcg_gen_br(done);
+    gen_set_label(slow);
+    gen_helper_fullwr(cpu_env, data, addr);
+    gen_set_label(done);
 }
 
 static void gen_data_load(DisasContext *ctx, TCGv data, TCGv addr)
 {
+    TCGLabel *slow;
+    TCGLabel *done;
+
     if (ctx->tb->flags & TB_FLAGS_FULL_ACCESS) {
         gen_helper_fullrd(data, cpu_env, addr);
+        return;
+    }
+
+    slow = gen_new_label();
+    done = gen_new_label();
+    tcg_gen_brcondi_tl(TCG_COND_LTU, addr, TARGET_PAGE_SIZE, slow);
+    tcg_gen_qemu_ld8u(data, addr, MMU_DATA_IDX); /* data = mem[addr] */
+    tcg_gen_br(done);
+    gen_set_label(slow);
+    gen_helper_fullrd(data, cpu_env, addr);
+    gen_set_label(done);
+}
+
+/*
+ *  Store the registers of a run of n PUSH instructions, starting with the
+ *  current one, with a single big-endian access below SP.  The first
+ *  register pushed ends up at the highest address.  If any of the bytes
+ *  may hit the first page of the data space, push them one at a time.
+ */
+static void gen_push_run(DisasContext *ctx, int n)
+{
+    TCGLabel *slow = gen_new_label();
+    TCGLabel *done = gen_new_label();
+    int reg[4];
+    int i;
+
+    assert(n == 2 || n == 4);
+    for (i = 0; i < n; i++) {
+        reg[i] = PUSH_Rd(cpu_lduw_code(ctx->env, (ctx->inst[0].cpc + i) * 2));
+    }
+
+    /* This may write SREG, so don't leave the flags lazy across it */
+    gen_flush_flags(ctx);
+
+    if (!(ctx->tb->flags & TB_FLAGS_FULL_ACCESS)) {
+        TCGv data = tcg_temp_new_i32();
+        TCGv addr = tcg_temp_new_i32();
+
+        tcg_gen_brcondi_tl(TCG_COND_LTU, cpu_sp, TARGET_PAGE_SIZE + n - 1,
+                           slow);
+        tcg_gen_mov_tl(data, cpu_r[reg[0]]);
+        for (i = 1; i < n; i++) {
+            tcg_gen_deposit_tl(data, data, cpu_r[reg[i]], 8 * i, 8);
+        }
+        tcg_gen_subi_tl(addr, cpu_sp, n - 1);
+        tcg_gen_qemu_st_tl(data, addr, MMU_DATA_IDX,
+                           n == 2 ? MO_BEUW : MO_BEUL);
+        tcg_gen_subi_tl(cpu_sp, cpu_sp, n);
+        tcg_gen_br(done);
+
+        tcg_temp_free_i32(addr);
+        tcg_temp_free_i32(data);
+    }
+
+    gen_set_label(slow);
+    for (i = 0; i < n; i++) {
+        gen_helper_fullwr(cpu_env, cpu_r[reg[i]], cpu_sp);
+        tcg_gen_subi_tl(cpu_sp, cpu_sp, 1);
+    }
+    gen_set_label(done);
+}
+
+/*
+ *  Load the registers of a run of n POP instructions, starting with the
+ *  current one, with a single big-endian access above SP, see
+ *  gen_push_run().
+ */
+static void gen_pop_run(DisasContext *ctx, int n)
+{
+    TCGLabel *slow = gen_new_label();
+    TCGLabel *done = gen_new_label();
+    int reg[4];
+    int i;
+
+    assert(n == 2 || n == 4);
+    for (i = 0; i < n; i++) {
+        reg[i] = POP_Rd(cpu_lduw_code(ctx->env, (ctx->inst[0].cpc + i) * 2));
+    }
+
+    if (!(ctx->tb->flags & TB_FLAGS_FULL_ACCESS)) {
+        TCGv data = tcg_temp_new_i32();
+        TCGv addr = tcg_temp_new_i32();
+
+        tcg_gen_brcondi_tl(TCG_COND_LTU, cpu_sp, TARGET_PAGE_SIZE - 1, slow);
+        tcg_gen_addi_tl(addr, cpu_sp, 1);
+        tcg_gen_qemu_ld_tl(data, addr, MMU_DATA_IDX,
+                           n == 2 ? MO_BEUW : MO_BEUL);
+        for (i = 0; i < n; i++) {
+            tcg_gen_extract_tl(cpu_r[reg[i]], data, 8 * (n - 1 - i), 8);
+        }
+        tcg_gen_addi_tl(cpu_sp, cpu_sp, n);
+        tcg_gen_br(done);
+
+        tcg_temp_free_i32(addr);
+        tcg_temp_free_i32(data);
+    }
+
+    gen_set_label(slow);
+    for (i = 0; i < n; i++) {
+        tcg_gen_addi_tl(cpu_sp, cpu_sp, 1);
+        gen_helper_fullrd(cpu_r[reg[i]], cpu_env, cpu_sp);
+    }
+    gen_set_label(done);
+}
+
+/*
+ *  LDS and STS have a constant address unless RAMPD is in use, so without
+ *  RAMPD it is known at translation time which path the access takes, and
+ *  with it only the low addresses need checking.
+ */
+static void gen_data_store_imm(DisasContext *ctx, TCGv data, int imm)
+{
+    bool rampd = avr_feature(ctx->env, AVR_FEATURE_RAMPD);
+    TCGv addr;
+
+    if (!rampd && imm < NO_CPU_REGISTERS) {
+        tcg_gen_mov_tl(cpu_r[imm], data);
+        return;
+    }
+
+    addr = tcg_temp_local_new_i32();
+    tcg_gen_ori_tl(addr, cpu_rampD, imm); /* addr = H:M:L */
+
+    if (imm >= TARGET_PAGE_SIZE) {
+        tcg_gen_qemu_st8(data, addr, MMU_DATA_IDX); /* mem[addr] = data */
+    } else if (!rampd) {
+        gen_helper_fullwr(cpu_env, data, addr);
+        if (imm == NO_CPU_REGISTERS + 0x3f) {
+            /* SREG was written, cpu_set_sreg() has reset the lazy flags */
+            ctx->cc_op = AVR_CC_OP_FLAGS;
+        }
     } else {
+        gen_data_store(ctx, data, addr);
+    }
+
+    tcg_temp_free_i32(addr);
+}
+
+static void gen_data_load_imm(DisasContext *ctx, TCGv data, int imm)
+{
+    bool rampd = avr_feature(ctx->env, AVR_FEATURE_RAMPD);
+    TCGv addr;
+
+    if (!rampd && imm < NO_CPU_REGISTERS) {
+        tcg_gen_mov_tl(data, cpu_r[imm]);
+        return;
+    }
+
+    addr = tcg_temp_local_new_i32();
+    tcg_gen_ori_tl(addr, cpu_rampD, imm); /* addr = H:M:L */
+
+    if (imm >= TARGET_PAGE_SIZE) {
         tcg_gen_qemu_ld8u(data, addr, MMU_DATA_IDX); /* data = mem[addr] */
+    } else if (!rampd) {
+        gen_helper_fullrd(data, cpu_env, addr);
+    } else {
+        gen_data_load(ctx, data, addr);
     }
+
+    tcg_temp_free_i32(addr);
 }
 
+/*
+ *  Load one byte indirect from data space to register and stores an clear
+ *  the bits in data space specified by the register. The instruction can only
+ *  be used towards internal SRAM.  The data location is pointed to by the Z (16
+ *  bits) Pointer Register in the Register File. Memory access is limited to the
+ *  current data segment of 64KB. To access another data segment in devices with
+ *  more than 64KB data space, the RAMPZ in register in the I/O area has to be
+ *  changed.  The Z-pointer Register is left unchanged by the operation. This
+ *  instruction is especially suited for clearing status bits stored in SRAM.
+ */
 static int translate_LAC(DisasContext *ctx, uint32_t opcode)
 {
     if (avr_feature(ctx->env, AVR_FEATURE_RMW) == false) {
@@ -1330,8 +2011,8 @@ static int translate_LAC(DisasContext *ctx, uint32_t opcode)
 
     TCGv Rr = cpu_r[LAC_Rr(opcode)];
     TCGv addr = gen_get_zaddr();
-    TCGv t0 = tcg_temp_new_i32();
-    TCGv t1 = tcg_temp_new_i32();
+    TCGv t0 = tcg_temp_local_new_i32();
+    TCGv t1 = tcg_temp_local_new_i32();
 
     gen_data_load(ctx, t0, addr); /* t0 = mem[addr] */
         /* t1 = t0 & (0xff - Rr) = t0 and ~Rr */
@@ -1367,8 +2048,8 @@ static int translate_LAS(DisasContext *ctx, uint32_t opcode)
 
     TCGv Rr = cpu_r[LAS_Rr(opcode)];
     TCGv addr = gen_get_zaddr();
-    TCGv t0 = tcg_temp_new_i32();
-    TCGv t1 = tcg_temp_new_i32();
+    TCGv t0 = tcg_temp_local_new_i32();
+    TCGv t1 = tcg_temp_local_new_i32();
 
     gen_data_load(ctx, t0, addr); /* t0 = mem[addr] */
     tcg_gen_or_tl(t1, t0, Rr);
@@ -1403,8 +2084,8 @@ static int translate_LAT(DisasContext *ctx, uint32_t opcode)
 
     TCGv Rr = cpu_r[LAT_Rr(opcode)];
     TCGv addr = gen_get_zaddr();
-    TCGv t0 = tcg_temp_new_i32();
-    TCGv t1 = tcg_temp_new_i32();
+    TCGv t0 = tcg_temp_local_new_i32();
+    TCGv t1 = tcg_temp_local_new_i32();
 
     gen_data_load(ctx, t0, addr); /* t0 = mem[addr] */
     tcg_gen_xor_tl(t1, t0, Rr);
@@ -1653,16 +2334,8 @@ static int translate_LDI(DisasContext *ctx, uint32_t opcode)
 static int translate_LDS(DisasContext *ctx, uint32_t opcode)
 {
     TCGv Rd = cpu_r[LDS_Rd(opcode)];
-    TCGv addr = tcg_temp_new_i32();
-    TCGv H = cpu_rampD;
-
-    tcg_gen_mov_tl(addr, H); /* addr = H:M:L */
-    tcg_gen_shli_tl(addr, addr, 16);
-    tcg_gen_ori_tl(addr, addr, LDS_Imm(opcode));
-
-    gen_data_load(ctx, Rd, addr);
 
-    tcg_temp_free_i32(addr);
+    gen_data_load_imm(ctx, Rd, LDS_Imm(opcode));
 
     return BS_NONE;
 }
@@ -1767,6 +2440,8 @@ static int translate_LSR(DisasContext *ctx, uint32_t opcode)
 {
     TCGv Rd = cpu_r[LSR_Rd(opcode)];
 
+    gen_flush_flags(ctx);
+
     tcg_gen_andi_tl(cpu_Cf, Rd, 1);
 
     tcg_gen_shri_tl(Rd, Rd, 1);
@@ -1837,6 +2512,8 @@ static int translate_MUL(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = cpu_r[MUL_Rr(opcode)];
     TCGv R = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_mul_tl(R, Rd, Rr); /* R = Rd *Rr */
 
     tcg_gen_andi_tl(R0, R, 0xff);
@@ -1869,6 +2546,8 @@ static int translate_MULS(DisasContext *ctx, uint32_t opcode)
     TCGv t0 = tcg_temp_new_i32();
     TCGv t1 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_ext8s_tl(t0, Rd); /* make Rd full 32 bit signed */
     tcg_gen_ext8s_tl(t1, Rr); /* make Rr full 32 bit signed */
     tcg_gen_mul_tl(R, t0, t1); /* R = Rd * Rr */
@@ -1905,6 +2584,8 @@ static int translate_MULSU(DisasContext *ctx, uint32_t opcode)
     TCGv R = tcg_temp_new_i32();
     TCGv t0 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_ext8s_tl(t0, Rd); /* make Rd full 32 bit signed */
     tcg_gen_mul_tl(R, t0, Rr); /* R = Rd *Rr */
 
@@ -1934,9 +2615,7 @@ static int translate_NEG(DisasContext *ctx, uint32_t opcode)
     tcg_gen_sub_tl(R, t0, Rd); /* R = 0 - Rd */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_sub_CHf(R, t0, Rd);
-    gen_sub_Vf(R, t0, Rd);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_SUB, R, t0, Rd);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
@@ -1970,8 +2649,7 @@ static int translate_OR(DisasContext *ctx, uint32_t opcode)
 
     tcg_gen_or_tl(R, Rd, Rr);
 
-    tcg_gen_movi_tl(cpu_Vf, 0);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, R, NULL, NULL);
 
     tcg_gen_mov_tl(Rd, R);
 
@@ -1991,8 +2669,7 @@ static int translate_ORI(DisasContext *ctx, uint32_t opcode)
 
     tcg_gen_ori_tl(Rd, Rd, Imm); /* Rd = Rd | Imm */
 
-    tcg_gen_movi_tl(cpu_Vf, 0x00); /* Vf = 0 */
-    gen_ZNSf(Rd);
+    gen_set_cc(ctx, AVR_CC_OP_LOGIC, Rd, NULL, NULL);
 
     return BS_NONE;
 }
@@ -2008,6 +2685,10 @@ static int translate_OUT(DisasContext *ctx, uint32_t opcode)
     TCGv port = tcg_const_i32(Imm);
 
     gen_helper_outb(cpu_env, port, Rd);
+    if (Imm == 0x3f) {
+        /* SREG was written, cpu_set_sreg() has reset the lazy flags */
+        ctx->cc_op = AVR_CC_OP_FLAGS;
+    }
 
     tcg_temp_free_i32(port);
 
@@ -2022,6 +2703,11 @@ static int translate_OUT(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_POP(DisasContext *ctx, uint32_t opcode)
 {
+    if (ctx->inst[0].count > 1) {
+        gen_pop_run(ctx, ctx->inst[0].count);
+        return BS_NONE;
+    }
+
     /*
      * Using a temp to work around some strange behaviour:
      * tcg_gen_addi_tl(cpu_sp, cpu_sp, 1);
@@ -2029,13 +2715,15 @@ static int translate_POP(DisasContext *ctx, uint32_t opcode)
      * seems to cause the add to happen twice.
      * This doesn't happen if either the add or the load is removed.
      */
-    TCGv t1 = tcg_temp_new_i32();
+    TCGv t1 = tcg_temp_local_new_i32();
     TCGv Rd = cpu_r[POP_Rd(opcode)];
 
     tcg_gen_addi_tl(t1, cpu_sp, 1);
     gen_data_load(ctx, Rd, t1);
     tcg_gen_mov_tl(cpu_sp, t1);
 
+    tcg_temp_free_i32(t1);
+
     return BS_NONE;
 }
 
@@ -2049,6 +2737,11 @@ static int translate_PUSH(DisasContext *ctx, uint32_t opcode)
 {
     TCGv Rd = cpu_r[PUSH_Rd(opcode)];
 
+    if (ctx->inst[0].count > 1) {
+        gen_push_run(ctx, ctx->inst[0].count);
+        return BS_NONE;
+    }
+
     gen_data_store(ctx, Rd, cpu_sp);
     tcg_gen_subi_tl(cpu_sp, cpu_sp, 1);
 
@@ -2082,7 +2775,7 @@ static int translate_RET(DisasContext *ctx, uint32_t opcode)
 {
     gen_pop_ret(ctx, cpu_pc);
 
-    tcg_gen_exit_tb(NULL, 0);
+    gen_goto_ptr(ctx);
 
     return BS_BRANCH;
 }
@@ -2101,6 +2794,10 @@ static int translate_RETI(DisasContext *ctx, uint32_t opcode)
 
     tcg_gen_movi_tl(cpu_If, 1);
 
+    /*
+     * Setting I may unmask an interrupt that was raised while it was clear,
+     * and only the main loop looks at interrupt_request again, so don't chain.
+     */
     tcg_gen_exit_tb(NULL, 0);
 
     return BS_BRANCH;
@@ -2133,6 +2830,8 @@ static int translate_ROR(DisasContext *ctx, uint32_t opcode)
     TCGv Rd = cpu_r[ROR_Rd(opcode)];
     TCGv t0 = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     tcg_gen_shli_tl(t0, cpu_Cf, 7);
     tcg_gen_andi_tl(cpu_Cf, Rd, 1);
     tcg_gen_shri_tl(Rd, Rd, 1);
@@ -2155,6 +2854,8 @@ static int translate_SBC(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = cpu_r[SBC_Rr(opcode)];
     TCGv R = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     /* op */
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr - Cf */
     tcg_gen_sub_tl(R, R, cpu_Cf);
@@ -2187,6 +2888,8 @@ static int translate_SBCI(DisasContext *ctx, uint32_t opcode)
     TCGv Rr = tcg_const_i32(SBCI_Imm(opcode));
     TCGv R = tcg_temp_new_i32();
 
+    gen_flush_flags(ctx);
+
     /* op */
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr - Cf */
     tcg_gen_sub_tl(R, R, cpu_Cf);
@@ -2243,13 +2946,12 @@ static int translate_SBIC(DisasContext *ctx, uint32_t opcode)
 
     gen_helper_inb(data, cpu_env, port);
 
-        /* PC if next inst is skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[1].npc);
     tcg_gen_andi_tl(data, data, 1 << SBIC_Bit(opcode));
     tcg_gen_brcondi_i32(TCG_COND_EQ, data, 0, skip);
-        /* PC if next inst is not skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+    gen_refund_cycles(ctx, ctx->inst[1].length / 16);
+    gen_goto_tb(ctx, 1, ctx->inst[0].npc); /* next inst is not skipped */
     gen_set_label(skip);
+    gen_goto_tb(ctx, 0, ctx->inst[1].npc); /* next inst is skipped */
 
     tcg_temp_free_i32(port);
     tcg_temp_free_i32(data);
@@ -2270,13 +2972,12 @@ static int translate_SBIS(DisasContext *ctx, uint32_t opcode)
 
     gen_helper_inb(data, cpu_env, port);
 
-        /* PC if next inst is skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[1].npc);
     tcg_gen_andi_tl(data, data, 1 << SBIS_Bit(opcode));
     tcg_gen_brcondi_i32(TCG_COND_NE, data, 0, skip);
-        /* PC if next inst is not skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+    gen_refund_cycles(ctx, ctx->inst[1].length / 16);
+    gen_goto_tb(ctx, 1, ctx->inst[0].npc); /* next inst is not skipped */
     gen_set_label(skip);
+    gen_goto_tb(ctx, 0, ctx->inst[1].npc); /* next inst is skipped */
 
     tcg_temp_free_i32(port);
     tcg_temp_free_i32(data);
@@ -2310,22 +3011,7 @@ static int translate_SBIW(DisasContext *ctx, uint32_t opcode)
     tcg_gen_subi_tl(R, Rd, Imm); /* R = Rd - Imm */
     tcg_gen_andi_tl(R, R, 0xffff); /* make it 16 bits */
 
-    /* Cf */
-    tcg_gen_andc_tl(cpu_Cf, R, Rd);
-    tcg_gen_shri_tl(cpu_Cf, cpu_Cf, 15); /* Cf = R & ~Rd */
-
-    /* Vf */
-    tcg_gen_andc_tl(cpu_Vf, Rd, R);
-    tcg_gen_shri_tl(cpu_Vf, cpu_Vf, 15); /* Vf = Rd & ~R */
-
-    /* Zf */
-    tcg_gen_mov_tl(cpu_Zf, R); /* Zf = R */
-
-    /* Nf */
-    tcg_gen_shri_tl(cpu_Nf, R, 15); /* Nf = R(15) */
-
-    /* Sf */
-    tcg_gen_xor_tl(cpu_Sf, cpu_Nf, cpu_Vf); /* Sf = Nf ^ Vf */
+    gen_set_cc(ctx, AVR_CC_OP_SUBW, R, Rd, NULL);
 
     /* R */
     tcg_gen_andi_tl(RdL, R, 0xff);
@@ -2347,13 +3033,12 @@ static int translate_SBRC(DisasContext *ctx, uint32_t opcode)
     TCGv t0 = tcg_temp_new_i32();
     TCGLabel *skip = gen_new_label();
 
-        /* PC if next inst is skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[1].npc);
     tcg_gen_andi_tl(t0, Rr, 1 << SBRC_Bit(opcode));
     tcg_gen_brcondi_i32(TCG_COND_EQ, t0, 0, skip);
-        /* PC if next inst is not skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+    gen_refund_cycles(ctx, ctx->inst[1].length / 16);
+    gen_goto_tb(ctx, 1, ctx->inst[0].npc); /* next inst is not skipped */
     gen_set_label(skip);
+    gen_goto_tb(ctx, 0, ctx->inst[1].npc); /* next inst is skipped */
 
     tcg_temp_free_i32(t0);
 
@@ -2370,13 +3055,12 @@ static int translate_SBRS(DisasContext *ctx, uint32_t opcode)
     TCGv t0 = tcg_temp_new_i32();
     TCGLabel *skip = gen_new_label();
 
-        /* PC if next inst is skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[1].npc);
     tcg_gen_andi_tl(t0, Rr, 1 << SBRS_Bit(opcode));
     tcg_gen_brcondi_i32(TCG_COND_NE, t0, 0, skip);
-        /* PC if next inst is not skipped */
-    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+    gen_refund_cycles(ctx, ctx->inst[1].length / 16);
+    gen_goto_tb(ctx, 1, ctx->inst[0].npc); /* next inst is not skipped */
     gen_set_label(skip);
+    gen_goto_tb(ctx, 0, ctx->inst[1].npc); /* next inst is skipped */
 
     tcg_temp_free_i32(t0);
 
@@ -2389,6 +3073,7 @@ static int translate_SBRS(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_SLEEP(DisasContext *ctx, uint32_t opcode)
 {
+    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
     gen_helper_sleep(cpu_env);
 
     return BS_EXCP;
@@ -2413,26 +3098,46 @@ static int translate_SLEEP(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_SPM(DisasContext *ctx, uint32_t opcode)
 {
-    /* TODO */
     if (avr_feature(ctx->env, AVR_FEATURE_SPM) == false) {
         gen_helper_unsupported(cpu_env);
 
         return BS_EXCP;
     }
 
-    return BS_NONE;
+    gen_helper_spm(cpu_env);
+
+    /* the write may have invalidated the TBs that follow, don't chain */
+    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+
+    return BS_EXCP;
 }
 
+/*
+ *  SPM Z+ only exists on XMEGA devices, which program flash through their
+ *  NVM controller rather than SPMCSR.  That isn't modelled, so no CPU model
+ *  sets AVR_FEATURE_SPMX.
+ */
 static int translate_SPMX(DisasContext *ctx, uint32_t opcode)
 {
-    /* TODO */
     if (avr_feature(ctx->env, AVR_FEATURE_SPMX) == false) {
         gen_helper_unsupported(cpu_env);
 
         return BS_EXCP;
     }
 
-    return BS_NONE;
+    TCGv addr = gen_get_zaddr();
+
+    gen_helper_spm(cpu_env);
+
+    tcg_gen_addi_tl(addr, addr, 2); /* addr = addr + 2 */
+    gen_set_zaddr(addr);
+
+    tcg_temp_free_i32(addr);
+
+    /* the write may have invalidated the TBs that follow, don't chain */
+    tcg_gen_movi_tl(cpu_pc, ctx->inst[0].npc);
+
+    return BS_EXCP;
 }
 
 static int translate_STX1(DisasContext *ctx, uint32_t opcode)
@@ -2576,16 +3281,8 @@ static int translate_STDZ(DisasContext *ctx, uint32_t opcode)
 static int translate_STS(DisasContext *ctx, uint32_t opcode)
 {
     TCGv Rd = cpu_r[STS_Rd(opcode)];
-    TCGv addr = tcg_temp_new_i32();
-    TCGv H = cpu_rampD;
-
-    tcg_gen_mov_tl(addr, H); /* addr = H:M:L */
-    tcg_gen_shli_tl(addr, addr, 16);
-    tcg_gen_ori_tl(addr, addr, STS_Imm(opcode));
-
-    gen_data_store(ctx, Rd, addr);
 
-    tcg_temp_free_i32(addr);
+    gen_data_store_imm(ctx, Rd, STS_Imm(opcode));
 
     return BS_NONE;
 }
@@ -2604,9 +3301,7 @@ static int translate_SUB(DisasContext *ctx, uint32_t opcode)
     tcg_gen_sub_tl(R, Rd, Rr); /* R = Rd - Rr */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_sub_CHf(R, Rd, Rr);
-    gen_sub_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_SUB, R, Rd, Rr);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
@@ -2632,9 +3327,7 @@ static int translate_SUBI(DisasContext *ctx, uint32_t opcode)
                                                     /* R = Rd - Imm */
     tcg_gen_andi_tl(R, R, 0xff); /* make it 8 bits */
 
-    gen_sub_CHf(R, Rd, Rr);
-    gen_sub_Vf(R, Rd, Rr);
-    gen_ZNSf(R);
+    gen_set_cc(ctx, AVR_CC_OP_SUB, R, Rd, Rr);
 
     /* R */
     tcg_gen_mov_tl(Rd, R);
@@ -2673,7 +3366,11 @@ static int translate_SWAP(DisasContext *ctx, uint32_t opcode)
  */
 static int translate_WDR(DisasContext *ctx, uint32_t opcode)
 {
-    gen_helper_wdr(cpu_env);
+    TCGv one = tcg_const_i32(1);
+
+    /* The watchdog looks for it on its own time, see hw/watchdog/avr_wdt.c */
+    tcg_gen_st_i32(one, cpu_env, offsetof(CPUAVRState, wdr));
+    tcg_temp_free_i32(one);
 
     return BS_NONE;
 }
@@ -2696,7 +3393,7 @@ static int translate_XCH(DisasContext *ctx, uint32_t opcode)
     }
 
     TCGv Rd = cpu_r[XCH_Rd(opcode)];
-    TCGv t0 = tcg_temp_new_i32();
+    TCGv t0 = tcg_temp_local_new_i32();
     TCGv addr = gen_get_zaddr();
 
     gen_data_load(ctx, t0, addr);
@@ -2709,113 +3406,17 @@ static int translate_XCH(DisasContext *ctx, uint32_t opcode)
     return BS_NONE;
 }
 
+/* Translation functions, indexed by AVRInsnId */
+static const TranslateFn avr_translators[] = {
+#define AVR_INSN(name, pattern) [AVR_INSN_##name] = translate_##name,
+#include "insn.def"
+#undef AVR_INSN
+};
+
 void avr_cpu_tcg_init(void)
 {
     int i;
 
-    /* Table of instructions in human readable form */
-    const Instruction instructions[] = {
-        {"ADC", "0001_11**_****_****", translate_ADC},
-        {"ADD", "0000_11**_****_****", translate_ADD},
-        {"ADIW", "1001_0110_****_****", translate_ADIW},
-        {"AND", "0010_00**_****_****", translate_AND},
-        {"ANDI", "0111_****_****_****", translate_ANDI},
-        {"ASR", "1001_010*_****_0101", translate_ASR},
-        {"BCLR", "1001_0100_1***_1000", translate_BCLR},
-        {"BLD", "1111_100*_****_0***", translate_BLD},
-        {"BRBC", "1111_01**_****_****", translate_BRBC},
-        {"BRBS", "1111_00**_****_****", translate_BRBS},
-        {"BREAK", "1001_0101_1001_1000", translate_BREAK},
-        {"BSET", "1001_0100_0***_1000", translate_BSET},
-        {"BST", "1111_101*_****_0***", translate_BST},
-        {"CALL", "1001_010*_****_111*__****_****_****_****", translate_CALL},
-        {"CBI", "1001_1000_****_****", translate_CBI},
-        {"COM", "1001_010*_****_0000", translate_COM},
-        {"CP", "0001_01**_****_****", translate_CP},
-        {"CPC", "0000_01**_****_****", translate_CPC},
-        {"CPI", "0011_****_****_****", translate_CPI},
-        {"CPSE", "0001_00**_****_****", translate_CPSE},
-        {"DEC", "1001_010*_****_1010", translate_DEC},
-        {"DES", "1001_0100_****_1011", translate_DES},
-        {"EICALL", "1001_0101_0001_1001", translate_EICALL},
-        {"EIJMP", "1001_0100_0001_1001", translate_EIJMP},
-        {"ELPM1", "1001_0101_1101_1000", translate_ELPM1},
-        {"ELPM2", "1001_000*_****_0110", translate_ELPM2},
-        {"ELPMX", "1001_000*_****_0111", translate_ELPMX},
-        {"EOR", "0010_01**_****_****", translate_EOR},
-        {"FMUL", "0000_0011_0***_1***", translate_FMUL},
-        {"FMULS", "0000_0011_1***_0***", translate_FMULS},
-        {"FMULSU", "0000_0011_1***_1***", translate_FMULSU},
-        {"ICALL", "1001_0101_0000_1001", translate_ICALL},
-        {"IJMP", "1001_0100_0000_1001", translate_IJMP},
-        {"IN", "1011_0***_****_****", translate_IN},
-        {"INC", "1001_010*_****_0011", translate_INC},
-        {"JMP", "1001_010*_****_110*__****_****_****_****", translate_JMP},
-        {"LAC", "1001_001*_****_0110", translate_LAC},
-        {"LAS", "1001_001*_****_0101", translate_LAS},
-        {"LAT", "1001_001*_****_0111", translate_LAT},
-        {"LDX1", "1001_000*_****_1100", translate_LDX1},
-        {"LDX2", "1001_000*_****_1101", translate_LDX2},
-        {"LDX3", "1001_000*_****_1110", translate_LDX3},
-        {"LDY2", "1001_000*_****_1001", translate_LDY2},
-        {"LDY3", "1001_000*_****_1010", translate_LDY3},
-        {"LDDY", "10*0_**0*_****_1***", translate_LDDY},
-        {"LDZ2", "1001_000*_****_0001", translate_LDZ2},
-        {"LDZ3", "1001_000*_****_0010", translate_LDZ3},
-        {"LDDZ", "10*0_**0*_****_0***", translate_LDDZ},
-        {"LDI", "1110_****_****_****", translate_LDI},
-        {"LDS", "1001_000*_****_0000__****_****_****_****", translate_LDS},
-        {"LPM1", "1001_0101_1100_1000", translate_LPM1},
-        {"LPM2", "1001_000*_****_0100", translate_LPM2},
-        {"LPMX", "1001_000*_****_0101", translate_LPMX},
-        {"LSR", "1001_010*_****_0110", translate_LSR},
-        {"MOV", "0010_11**_****_****", translate_MOV},
-        {"MOVW", "0000_0001_****_****", translate_MOVW},
-        {"MUL", "1001_11**_****_****", translate_MUL},
-        {"MULS", "0000_0010_****_****", translate_MULS},
-        {"MULSU", "0000_0011_0***_0***", translate_MULSU},
-        {"NEG", "1001_010*_****_0001", translate_NEG},
-        {"NOP", "0000_0000_0000_0000", translate_NOP},
-        {"OR", "0010_10**_****_****", translate_OR},
-        {"ORI", "0110_****_****_****", translate_ORI},
-        {"OUT", "1011_1***_****_****", translate_OUT},
-        {"POP", "1001_000*_****_1111", translate_POP},
-        {"PUSH", "1001_001*_****_1111", translate_PUSH},
-        {"RCALL", "1101_****_****_****", translate_RCALL},
-        {"RET", "1001_0101_0000_1000", translate_RET},
-        {"RETI", "1001_0101_0001_1000", translate_RETI},
-        {"RJMP", "1100_****_****_****", translate_RJMP},
-        {"ROR", "1001_010*_****_0111", translate_ROR},
-        {"SBC", "0000_10**_****_****", translate_SBC},
-        {"SBCI", "0100_****_****_****", translate_SBCI},
-        {"SBI", "1001_1010_****_****", translate_SBI},
-        {"SBIC", "1001_1001_****_****", translate_SBIC},
-        {"SBIS", "1001_1011_****_****", translate_SBIS},
-        {"SBIW", "1001_0111_****_****", translate_SBIW},
-        {"SBRC", "1111_110*_****_0***", translate_SBRC},
-        {"SBRS", "1111_111*_****_0***", translate_SBRS},
-        {"SLEEP", "1001_0101_1000_1000", translate_SLEEP},
-        {"SPM", "1001_0101_1110_1000", translate_SPM},
-        {"SPMX", "1001_0101_1111_1000", translate_SPMX},
-        {"STX1", "1001_001*_****_1100", translate_STX1},
-        {"STX2", "1001_001*_****_1101", translate_STX2},
-        {"STX3", "1001_001*_****_1110", translate_STX3},
-        {"STY2", "1001_001*_****_1001", translate_STY2},
-        {"STY3", "1001_001*_****_1010", translate_STY3},
-        {"STDY", "10*0_**1*_****_1***", translate_STDY},
-        {"STZ2", "1001_001*_****_0001", translate_STZ2},
-        {"STZ3", "1001_001*_****_0010", translate_STZ3},
-        {"STDZ", "10*0_**1*_****_0***", translate_STDZ},
-        {"STS", "1001_001*_****_0000__****_****_****_****", translate_STS},
-        {"SUB", "0001_10**_****_****", translate_SUB},
-        {"SUBI", "0101_****_****_****", translate_SUBI},
-        {"SWAP", "1001_010*_****_0010", translate_SWAP},
-        {"WDR", "1001_0101_1010_1000", translate_WDR},
-        {"XCH", "1001_001*_****_0100", translate_XCH},
-    };
-    avr_decoder_init(instructions,
-        sizeof(instructions) / sizeof(instructions[0]));
-
 #define AVR_REG_OFFS(x) offsetof(CPUAVRState, x)
     cpu_pc = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(pc_w), "pc");
     cpu_Cf = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(sregC), "Cf");
@@ -2826,6 +3427,10 @@ void avr_cpu_tcg_init(void)
     cpu_Hf = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(sregH), "Hf");
     cpu_Tf = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(sregT), "Tf");
     cpu_If = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(sregI), "If");
+    cpu_cc_op = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(cc_op), "cc_op");
+    cpu_cc_r = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(cc_r), "cc_r");
+    cpu_cc_rd = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(cc_rd), "cc_rd");
+    cpu_cc_rr = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(cc_rr), "cc_rr");
     cpu_rampD = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(rampD), "rampD");
     cpu_rampX = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(rampX), "rampX");
     cpu_rampY = tcg_global_mem_new_i32(cpu_env, AVR_REG_OFFS(rampY), "rampY");
@@ -2842,13 +3447,52 @@ void avr_cpu_tcg_init(void)
     }
 }
 
+static AVRInsnId decode_insn(DisasContext *ctx, uint32_t opcode,
+                             uint32_t *length)
+{
+    if (ctx->flat_decoder) {
+        return avr_decode_flat(opcode, length);
+    } else {
+        return avr_decode(opcode, length);
+    }
+}
+
+/*
+ *  avr-gcc saves and restores call-saved registers in function prologues
+ *  and epilogues with runs of PUSH and POP.  Return how many of the
+ *  instructions from pc on can be translated together, see gen_push_run().
+ */
+static unsigned decode_stack_run(DisasContext *ctx, target_ulong pc,
+                                 AVRInsnId insn)
+{
+    unsigned count = 1;
+    uint32_t length;
+
+    while (count < 4 &&
+           decode_insn(ctx, cpu_lduw_code(ctx->env, (pc + count) * 2),
+                       &length) == insn) {
+        count++;
+    }
+    /* The accesses are 16 or 32 bit wide */
+    return count == 3 ? 2 : count;
+}
+
 static void decode_opc(DisasContext *ctx, InstInfo *inst)
 {
+    AVRInsnId insn;
+
     /* PC points to words.  */
     inst->opcode = cpu_ldl_code(ctx->env, inst->cpc * 2);
     inst->length = 0;
-    inst->translate = avr_decode(inst->opcode, &inst->length);
+    insn = decode_insn(ctx, inst->opcode, &inst->length);
     assert(inst->length > 0); /* Check length was set */
+    if (insn == AVR_INSN_ILLEGAL) {
+        error_report("Illegal AVR instruction");
+        exit(1);
+    }
+    inst->insn = insn;
+    inst->translate = avr_translators[insn];
+    inst->cycles = ctx->env->insn_cycles[insn];
 
     if (inst->length == 16) {
         inst->npc = inst->cpc + 1;
@@ -2861,6 +3505,55 @@ static void decode_opc(DisasContext *ctx, InstInfo *inst)
         inst->opcode = (inst->opcode << 16)
                      | (inst->opcode >> 16);
     }
+
+    inst->count = 1;
+    if (ctx->fuse_stack && (insn == AVR_INSN_PUSH || insn == AVR_INSN_POP)) {
+        inst->count = decode_stack_run(ctx, inst->cpc, insn);
+        inst->npc = inst->cpc + inst->count;
+        inst->cycles *= inst->count;
+    }
+}
+
+/*
+ *  Under icount, devices may only read the virtual clock from the last
+ *  instruction of a TB, which runs with can_do_io set, so that the clock is
+ *  exact.  Instructions whose address is known here to be a device's are
+ *  translated that way.  LD, ST and the stack accesses only find out at run
+ *  time, they go through cpu_io_recompile() like MMIO accesses through the
+ *  TLB do, see avr_io_read(), and come back here with CF_LAST_IO.
+ */
+static bool avr_insn_does_io(DisasContext *ctx, InstInfo *inst)
+{
+    CPUState *cs = CPU(avr_env_get_cpu(ctx->env));
+    uint32_t opcode = inst->opcode;
+
+    if (!(tb_cflags(ctx->tb) & CF_USE_ICOUNT)) {
+        return false;
+    }
+
+    switch (inst->insn) {
+    case AVR_INSN_IN:
+        /* Ports 0x38 and up are CPU registers, see helper_inb() */
+        return IN_Imm(opcode) < 0x38;
+    case AVR_INSN_OUT:
+        return OUT_Imm(opcode) < 0x38;
+    case AVR_INSN_SBI:
+    case AVR_INSN_CBI:
+    case AVR_INSN_SBIC:
+    case AVR_INSN_SBIS:
+        return true;
+    case AVR_INSN_LDS:
+        /* With RAMPD the address is only known at run time */
+        return !avr_feature(ctx->env, AVR_FEATURE_RAMPD) &&
+               LDS_Imm(opcode) >= NO_CPU_REGISTERS &&
+               !avr_cpu_data_is_ram(cs, LDS_Imm(opcode), 1);
+    case AVR_INSN_STS:
+        return !avr_feature(ctx->env, AVR_FEATURE_RAMPD) &&
+               STS_Imm(opcode) >= NO_CPU_REGISTERS &&
+               !avr_cpu_data_is_ram(cs, STS_Imm(opcode), 1);
+    default:
+        return false;
+    }
 }
 
 void gen_intermediate_code(CPUState *cs, struct TranslationBlock *tb,
@@ -2873,21 +3566,49 @@ void gen_intermediate_code(CPUState *cs, struct TranslationBlock *tb,
         .memidx = 0,
         .bstate = BS_NONE,
         .singlestep = cs->singlestep_enabled,
+        .cc_op = (tb->flags & TB_FLAGS_CC_OP_MASK) >> TB_FLAGS_CC_OP_SHIFT,
+        .flat_decoder = AVR_CPU(cs)->flat_decoder,
+        .idle_loop = (tb_cflags(tb) & CF_USE_ICOUNT) && !cs->singlestep_enabled,
+        /* Breakpoints and single stepping need each instruction on its own */
+        .fuse_stack = !cs->singlestep_enabled &&
+                      QTAILQ_EMPTY(&cs->breakpoints),
+        .coverage = AVR_CPU(cs)->coverage,
     };
     target_ulong pc_start = tb->pc / 2;
     int num_insns = 0;
+    /*
+     * With icount, the TB is charged AVR clock cycles rather than
+     * instructions.  cpu_exec_nocache() asks for a TB that fits in the
+     * budget left, max_insns is then that budget in cycles.  Otherwise it
+     * limits instructions, e.g. to the one with CF_LAST_IO.
+     */
+    bool use_cycles = tb_cflags(tb) & CF_USE_ICOUNT;
+    int max_cycles = (tb_cflags(tb) & CF_NOCACHE) ? max_insns : INT_MAX;
+    int num_cycles = 0;
+    int cycles_before[TCG_MAX_INSNS];
+    TCGOp *insn_start[TCG_MAX_INSNS];
+    TCGOp *overrun = NULL;
+    int i;
     target_ulong cpc;
     target_ulong npc;
 
     if (tb->flags & TB_FLAGS_FULL_ACCESS) {
         /*
-         * This flag is set by ST/LD instruction we will regenerate it ONLY
-         * with mem/cpu memory access instead of mem access
+         * This flag is set when a stack access made by CALL, RET and friends
+         * hit the first page of the data space, regenerate the instruction
+         * with mem/cpu memory access instead of mem access. LD/ST and friends
+         * handle that page themselves, see gen_data_load().
          */
         max_insns = 1;
     }
 
     gen_tb_start(tb);
+    if (use_cycles && (tb_cflags(tb) & CF_NOCACHE)) {
+        overrun = gen_icount_overrun();
+    }
+    if (ctx.coverage) {
+        gen_coverage(&ctx, pc_start);
+    }
 
     /* decode first instruction */
     ctx.inst[0].cpc = pc_start;
@@ -2902,7 +3623,11 @@ void gen_intermediate_code(CPUState *cs, struct TranslationBlock *tb,
         decode_opc(&ctx, &ctx.inst[1]);
 
         /* translate current instruction */
-        tcg_gen_insn_start(cpc);
+        tcg_gen_insn_start(cpc, 0);
+        insn_start[num_insns] = tcg_last_op();
+        cycles_before[num_insns] = num_cycles;
+        num_cycles += ctx.inst[0].cycles +
+                      avr_insn_taken_cycles(&ctx.inst[0], &ctx.inst[1]);
         num_insns++;
 
         /*
@@ -2919,27 +3644,71 @@ void gen_intermediate_code(CPUState *cs, struct TranslationBlock *tb,
             goto done_generating;
         }
 
+        avr_idle_insn(&ctx, &ctx.inst[0]);
+        ctx.io = avr_insn_does_io(&ctx, &ctx.inst[0]) ||
+                 (num_insns == max_insns && (tb_cflags(tb) & CF_LAST_IO));
+        if (ctx.io) {
+            gen_io_start();
+        }
         if (ctx.inst[0].translate) {
             ctx.bstate = ctx.inst[0].translate(&ctx, ctx.inst[0].opcode);
         }
+        if (ctx.io && ctx.bstate == BS_NONE) {
+            /* End the TB after the access, see avr_insn_does_io() */
+            ctx.bstate = BS_STOP;
+        }
+
+        if (ctx.irq_shadow) {
+            break; /* gen_goto_tb() leaves for the main loop */
+        }
+        if (avr_insn_is_sei(&ctx.inst[0]) && !ctx.singlestep) {
+            /*
+             * The instruction after SEI goes into this TB whatever the
+             * limits below, there is room for it, see the check before SEI.
+             * If SEI started the TB it may overrun the icount budget, see
+             * gen_icount_overrun().
+             */
+            ctx.irq_shadow = true;
+            ctx.inst[0] = ctx.inst[1];
+            continue;
+        }
 
         if (num_insns >= max_insns) {
             break; /* max translated instructions limit reached */
         }
+        if (use_cycles &&
+            num_cycles + ctx.inst[1].cycles +
+            avr_insn_taken_cycles(&ctx.inst[1], NULL) > max_cycles) {
+            break; /* icount budget used up */
+        }
         if (ctx.singlestep) {
             break; /* single step */
         }
-        if ((cpc & (TARGET_PAGE_SIZE - 1)) == 0) {
-            break; /* page boundary */
+        if ((ctx.inst[1].npc * 2 - 1) / TARGET_PAGE_SIZE
+                > (pc_start * 2) / TARGET_PAGE_SIZE + 1) {
+            /*
+             * Flash is only written by SPM, so TBs may run across page
+             * boundaries, but the TB core tracks at most two pages per TB.
+             */
+            break;
+        }
+        if (avr_insn_is_sei(&ctx.inst[1])) {
+            InstInfo shadow = { .cpc = ctx.inst[1].npc };
+
+            decode_opc(&ctx, &shadow);
+            if (num_insns + 2 > TCG_MAX_INSNS ||
+                (shadow.npc * 2 - 1) / TARGET_PAGE_SIZE
+                    > (pc_start * 2) / TARGET_PAGE_SIZE + 1 ||
+                (use_cycles &&
+                 num_cycles + ctx.inst[1].cycles + shadow.cycles +
+                 avr_insn_taken_cycles(&shadow, NULL) > max_cycles)) {
+                break; /* no room for SEI and the instruction after it */
+            }
         }
 
         ctx.inst[0] = ctx.inst[1]; /* make next inst curr */
     } while (ctx.bstate == BS_NONE && !tcg_op_buf_full());
 
-    if (tb->cflags & CF_LAST_IO) {
-        gen_io_end();
-    }
-
     if (ctx.singlestep) {
         if (ctx.bstate == BS_STOP || ctx.bstate == BS_NONE) {
             tcg_gen_movi_tl(cpu_pc, npc);
@@ -2962,10 +3731,36 @@ void gen_intermediate_code(CPUState *cs, struct TranslationBlock *tb,
     }
 
 done_generating:
-    gen_tb_end(tb, num_insns);
+    /*
+     * Each insn_start records how much of the charge is left from that
+     * instruction on, so cpu_restore_state() can refund the instructions
+     * that didn't run.
+     */
+    for (i = 0; i < num_insns; i++) {
+        tcg_set_insn_start_param(insn_start[i], 1,
+                                 num_cycles - cycles_before[i]);
+    }
+    if (overrun) {
+        /* Only what went in whatever the budget may overrun it */
+        assert(num_cycles <= max_cycles || num_insns <= 2);
+        tcg_set_insn_param(overrun, 1, MAX(num_cycles - max_cycles, 0));
+        num_cycles = MIN(num_cycles, max_cycles);
+    }
+    gen_tb_end(tb, num_cycles);
 
     tb->size = (npc - pc_start) * 2;
     tb->icount = num_insns;
+
+#ifdef DEBUG_DISAS
+    if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
+        && qemu_log_in_addr_range(tb->pc)) {
+        qemu_log_lock();
+        qemu_log("IN: %s\n", lookup_symbol(tb->pc));
+        log_target_disas(cs, tb->pc, tb->size);
+        qemu_log("\n");
+        qemu_log_unlock();
+    }
+#endif
 }
 
 void restore_state_to_opc(CPUAVRState *env, TranslationBlock *tb,
@@ -2978,6 +3773,7 @@ void avr_cpu_dump_state(CPUState *cs, FILE *f, int flags)
 {
     AVRCPU *cpu = AVR_CPU(cs);
     CPUAVRState *env = &cpu->env;
+    uint8_t sreg = cpu_get_sreg(env);
     int i;
 
     qemu_fprintf(f, "\n");
@@ -2992,14 +3788,14 @@ void avr_cpu_dump_state(CPUState *cs, FILE *f, int flags)
     qemu_fprintf(f, "Y:       %02x%02x\n", env->r[29], env->r[28]);
     qemu_fprintf(f, "Z:       %02x%02x\n", env->r[31], env->r[30]);
     qemu_fprintf(f, "SREG:    [ %c %c %c %c %c %c %c %c ]\n",
-                        env->sregI ? 'I' : '-',
-                        env->sregT ? 'T' : '-',
-                        env->sregH ? 'H' : '-',
-                        env->sregS ? 'S' : '-',
-                        env->sregV ? 'V' : '-',
-                        env->sregN ? '-' : 'N', /* Zf has negative logic */
-                        env->sregZ ? 'Z' : '-',
-                        env->sregC ? 'I' : '-');
+                        sreg & (1 << SREG_I) ? 'I' : '-',
+                        sreg & (1 << SREG_T) ? 'T' : '-',
+                        sreg & (1 << SREG_H) ? 'H' : '-',
+                        sreg & (1 << SREG_S) ? 'S' : '-',
+                        sreg & (1 << SREG_V) ? 'V' : '-',
+                        sreg & (1 << SREG_N) ? 'N' : '-',
+                        sreg & (1 << SREG_Z) ? 'Z' : '-',
+                        sreg & (1 << SREG_C) ? 'C' : '-');
 
     qemu_fprintf(f, "\n");
     for (i = 0; i < ARRAY_SIZE(env->r); i++) {
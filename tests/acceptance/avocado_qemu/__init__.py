@@ -23,12 +23,16 @@ def is_readable_executable_file(path):
     return os.path.isfile(path) and os.access(path, os.R_OK | os.X_OK)
 
 
-def pick_default_qemu_bin():
+def pick_default_qemu_bin(arch=None):
     """
     Picks the path of a QEMU binary, starting either in the current working
     directory or in the source tree root directory.
+
+    :param arch: the target architecture of the binary, by default the
+                 host's
     """
-    arch = os.uname()[4]
+    if arch is None:
+        arch = os.uname()[4]
     qemu_bin_relative_path = os.path.join("%s-softmmu" % arch,
                                           "qemu-system-%s" % arch)
     if is_readable_executable_file(qemu_bin_relative_path):
@@ -41,10 +45,13 @@ def pick_default_qemu_bin():
 
 
 class Test(avocado.Test):
+    #: Target architecture of the default QEMU binary, None for the host's
+    qemu_arch = None
+
     def setUp(self):
         self._vms = {}
-        self.qemu_bin = self.params.get('qemu_bin',
-                                        default=pick_default_qemu_bin())
+        default_qemu_bin = pick_default_qemu_bin(arch=self.qemu_arch)
+        self.qemu_bin = self.params.get('qemu_bin', default=default_qemu_bin)
         if self.qemu_bin is None:
             self.cancel("No QEMU binary defined or found in the source tree")
 
@@ -0,0 +1,327 @@
+# AVR firmware for functional tests of the sample board
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# later.  See the COPYING file in the top-level directory.
+
+import os
+import time
+
+from . import Test
+
+
+# ATmega2560 registers, IO space addresses as for IN and OUT
+SPL = 0x3d
+SPH = 0x3e
+SREG = 0x3f
+PINA = 0x00
+PORTA = 0x02
+
+TIFR1 = 0x16
+
+# Data space addresses, as for LDS and STS
+TIMSK1 = 0x6f
+TCCR1B = 0x81
+TCNT1L = 0x84
+TCNT1H = 0x85
+OCR1AL = 0x88
+OCR1AH = 0x89
+UCSR0A = 0xc0
+UCSR0B = 0xc1
+UDR0 = 0xc6
+
+TIMER1_COMPA_IRQ = 16
+
+# Flash layout of the images, in bytes
+HEX_DIGITS = 0x100
+CODE = 0x400
+
+
+class AVRAssembler(object):
+    """
+    Just enough of an AVR assembler for the workloads below.  Code starts
+    at CODE, the reset vector jumps to the "main" label and interrupt
+    vectors to the labels given to image().
+    """
+
+    def __init__(self):
+        self.words = []
+        self.labels = {}
+        self.fixups = []
+        self.unique = 0
+
+    def here(self):
+        return CODE // 2 + len(self.words)
+
+    def label(self, name=None):
+        if name is None:
+            name = '.L%d' % self.unique
+            self.unique += 1
+        self.labels[name] = self.here()
+        return name
+
+    def emit(self, *words):
+        self.words.extend(words)
+
+    def _rk(self, op, d, k):
+        assert 16 <= d < 32 and 0 <= k < 256
+        self.emit(op | (k & 0xf0) << 4 | (d & 0xf) << 4 | (k & 0xf))
+
+    def _rr(self, op, d, r):
+        self.emit(op | (r & 0x10) << 5 | d << 4 | (r & 0xf))
+
+    def _iw(self, op, d, k):
+        assert d in (24, 26, 28, 30) and 0 <= k < 64
+        self.emit(op | (k & 0x30) << 2 | (d - 24) // 2 << 4 | (k & 0xf))
+
+    def ldi(self, d, k):
+        self._rk(0xe000, d, k)
+
+    def cpi(self, d, k):
+        self._rk(0x3000, d, k)
+
+    def andi(self, d, k):
+        self._rk(0x7000, d, k)
+
+    def add(self, d, r):
+        self._rr(0x0c00, d, r)
+
+    def adc(self, d, r):
+        self._rr(0x1c00, d, r)
+
+    def sbc(self, d, r):
+        self._rr(0x0800, d, r)
+
+    def and_(self, d, r):
+        self._rr(0x2000, d, r)
+
+    def eor(self, d, r):
+        self._rr(0x2400, d, r)
+
+    def mov(self, d, r):
+        self._rr(0x2c00, d, r)
+
+    def lsl(self, d):
+        self.add(d, d)
+
+    def rol(self, d):
+        self.adc(d, d)
+
+    def swap(self, d):
+        self.emit(0x9402 | d << 4)
+
+    def dec(self, d):
+        self.emit(0x940a | d << 4)
+
+    def adiw(self, d, k):
+        self._iw(0x9600, d, k)
+
+    def sbiw(self, d, k):
+        self._iw(0x9700, d, k)
+
+    def in_(self, d, a):
+        self.emit(0xb000 | (a & 0x30) << 5 | d << 4 | (a & 0xf))
+
+    def out(self, a, r):
+        self.emit(0xb800 | (a & 0x30) << 5 | r << 4 | (a & 0xf))
+
+    def lds(self, d, k):
+        self.emit(0x9000 | d << 4, k)
+
+    def sts(self, k, r):
+        self.emit(0x9200 | r << 4, k)
+
+    def ld_x(self, d):
+        self.emit(0x900c | d << 4)
+
+    def st_x_inc(self, r):
+        self.emit(0x920d | r << 4)
+
+    def lpm_z(self, d):
+        self.emit(0x9004 | d << 4)
+
+    def lpm_z_inc(self, d):
+        self.emit(0x9005 | d << 4)
+
+    def push(self, r):
+        self.emit(0x920f | r << 4)
+
+    def pop(self, d):
+        self.emit(0x900f | d << 4)
+
+    def sbrc(self, r, b):
+        self.emit(0xfc00 | r << 4 | b)
+
+    def sbrs(self, r, b):
+        self.emit(0xfe00 | r << 4 | b)
+
+    def sei(self):
+        self.emit(0x9478)
+
+    def cli(self):
+        self.emit(0x94f8)
+
+    def sleep(self):
+        self.emit(0x9588)
+
+    def reti(self):
+        self.emit(0x9518)
+
+    def brne(self, label):
+        self.fixups.append(('branch', len(self.words), label))
+        self.emit(0xf401)
+
+    def rjmp(self, label):
+        self.fixups.append(('rjmp', len(self.words), label))
+        self.emit(0xc000)
+
+    def image(self, vectors=None, data=None):
+        """
+        Returns the flash image, with @vectors mapping IRQ numbers to the
+        labels of their handlers and @data byte addresses to tables
+        """
+        for kind, pos, label in self.fixups:
+            offset = self.labels[label] - (CODE // 2 + pos + 1)
+            if kind == 'branch':
+                assert -64 <= offset < 64
+                self.words[pos] |= (offset & 0x7f) << 3
+            else:
+                assert -2048 <= offset < 2048
+                self.words[pos] |= offset & 0xfff
+
+        image = bytearray(CODE + 2 * len(self.words))
+        for addr, table in (data or {}).items():
+            assert addr + len(table) <= CODE
+            image[addr:addr + len(table)] = table
+
+        # JMP to each handler, vector n + 1 is IRQ n
+        vectors = dict(vectors or {})
+        vectors[-1] = 'main'
+        for irq, label in vectors.items():
+            addr = (irq + 1) * 4
+            target = self.labels[label]
+            image[addr:addr + 4] = bytes((0x0c, 0x94, target & 0xff,
+                                          target >> 8))
+
+        for i, word in enumerate(self.words):
+            image[CODE + 2 * i:CODE + 2 * i + 2] = bytes((word & 0xff,
+                                                          word >> 8))
+        return bytes(image)
+
+
+class AVRTest(Test):
+    """
+    Runs firmware built with AVRAssembler on the sample board, with its
+    first USART as the console
+    """
+
+    qemu_arch = 'avr'
+
+    #
+    # Firmware building blocks, all of them clobber r17 and r18
+    #
+
+    def start(self, asm):
+        asm.label('main')
+        asm.ldi(18, 0xff)
+        asm.out(SPL, 18)
+        asm.ldi(18, 0x21)
+        asm.out(SPH, 18)
+        asm.ldi(18, 0x08)           # TXEN
+        asm.sts(UCSR0B, 18)
+
+    def putc(self, asm, char):
+        asm.ldi(18, ord(char))
+        asm.sts(UDR0, 18)
+
+    def put_hex(self, asm, reg):
+        """
+        Writes @reg as two hex digits, clobbers Z.  The image needs
+        "0123456789abcdef" at HEX_DIGITS.
+        """
+        asm.mov(30, reg)
+        asm.swap(30)
+        asm.andi(30, 0x0f)
+        asm.ldi(31, HEX_DIGITS >> 8)
+        asm.lpm_z(18)
+        asm.sts(UDR0, 18)
+        asm.mov(30, reg)
+        asm.andi(30, 0x0f)
+        asm.ldi(31, HEX_DIGITS >> 8)
+        asm.lpm_z(18)
+        asm.sts(UDR0, 18)
+
+    def end_line(self, asm):
+        """
+        The USART model sends what it has when its FIFO is full, or when the
+        last character would have been shifted out.  Follow markers with a
+        FIFO's worth of newlines so they show up right away.
+        """
+        asm.ldi(18, ord('\n'))
+        asm.ldi(17, 16)
+        loop = asm.label()
+        asm.sts(UDR0, 18)
+        asm.dec(17)
+        asm.brne(loop)
+
+    def finish(self, asm):
+        asm.cli()
+        halt = asm.label()
+        asm.sleep()
+        asm.rjmp(halt)
+
+    #
+    # Running and measuring
+    #
+
+    def read_until(self, console, marker):
+        """
+        Reads the console up to @marker, returns what came before it.
+        Fails the test if QEMU exits first.
+        """
+        data = []
+        while True:
+            # Whatever QEMU wrote before it exited is read first
+            running = self.vm.is_running()
+            chunk = console.read()
+            if not chunk:
+                if not running:
+                    exitcode = self.vm.exitcode()
+                    self.vm.shutdown()
+                    self.fail('QEMU exited with %s before writing %r: %s' %
+                              (exitcode, marker, self.vm.get_log()))
+                time.sleep(0.001)
+                continue
+            end = chunk.find(marker)
+            if end >= 0:
+                console.seek(end + len(marker) - len(chunk), os.SEEK_CUR)
+                data.append(chunk[:end])
+                return b''.join(data)
+            data.append(chunk)
+
+    def hmp(self, command):
+        return self.vm.command('human-monitor-command', command_line=command)
+
+    def run_firmware(self, image, *args):
+        """
+        Runs @image, with QEMU arguments @args, until it writes "D" and a
+        line after it.  Returns the seconds between the "S" and the "D", and
+        the line.
+        """
+        firmware = os.path.join(self.workdir, 'firmware.bin')
+        with open(firmware, 'wb') as f:
+            f.write(image)
+        console_path = os.path.join(self.workdir, 'console.log')
+
+        self.vm.set_machine('sample')
+        self.vm.add_args('-bios', firmware,
+                         '-chardev', 'file,id=console,path=%s' % console_path,
+                         '-serial', 'chardev:console', *args)
+        self.vm.launch()
+
+        with open(console_path, 'rb', buffering=0) as console:
+            self.read_until(console, b'S')
+            start = time.time()
+            self.read_until(console, b'D')
+            elapsed = time.time() - start
+            line = self.read_until(console, b'\n')
+        return elapsed, line.decode('ascii')
@@ -0,0 +1,323 @@
+# Benchmarks of AVR firmware workloads
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# later.  See the COPYING file in the top-level directory.
+
+import json
+import re
+
+from avocado_qemu.avr import AVRAssembler, AVRTest
+from avocado_qemu.avr import SREG, PINA, PORTA, TIMSK1, TCCR1B, TCNT1L
+from avocado_qemu.avr import OCR1AL, OCR1AH, UCSR0A, TIMER1_COMPA_IRQ
+from avocado_qemu.avr import HEX_DIGITS
+
+
+SBOX = 0x200
+
+
+def aes_sbox():
+    """The AES S-box, as a table to look up with LPM"""
+    sbox = [0x63] * 256
+    p = q = 1
+    while True:
+        # p times 3, q divided by 3, in GF(2^8)
+        p = (p ^ (p << 1) ^ (0x1b if p & 0x80 else 0)) & 0xff
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xff
+        if q & 0x80:
+            q ^= 0x09
+        x = q
+        for i in range(1, 5):
+            x ^= ((q << i) | (q >> (8 - i))) & 0xff
+        sbox[p] = x ^ 0x63
+        if p == 1:
+            return bytes(sbox)
+
+
+def crc16_ccitt(data):
+    crc = 0xffff
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = (crc << 1) ^ (0x1021 if crc & 0x8000 else 0)
+            crc &= 0xffff
+    return crc
+
+
+class AVRBenchmark(AVRTest):
+    """
+    Runs firmware workloads typical of AVR devices on the sample board and
+    reports how fast they were emulated, together with the translation
+    statistics of "info jit".  The results are logged and left in the
+    whiteboard as JSON, for comparing a build against an earlier one.
+
+    Each workload is timed from an "S" to a "D" the firmware writes to the
+    USART.  The "scale" parameter (1 to 15, 10 by default) multiplies the
+    work done in between.
+
+    :avocado: enable
+    :avocado: tags=arch:avr
+    :avocado: tags=machine:sample
+    """
+
+    timeout = 300
+
+    def setUp(self):
+        super(AVRBenchmark, self).setUp()
+        self.scale = int(self.params.get('scale', default=10))
+        if not 1 <= self.scale <= 15:
+            self.cancel("scale must be between 1 and 15")
+
+    #
+    # Firmware building blocks
+    #
+
+    def repeat(self, asm, inner, body, body_insns):
+        """
+        Runs @body, which takes @body_insns instructions and mustn't touch
+        r16, r24 or r25, @inner times @scale.  Returns the number of
+        instructions executed.
+        """
+        assert 0 < inner < 0x10000
+        asm.ldi(16, self.scale)
+        outer_loop = asm.label()
+        asm.ldi(24, inner & 0xff)
+        asm.ldi(25, inner >> 8)
+        inner_loop = asm.label()
+        body(asm)
+        asm.sbiw(24, 1)
+        asm.brne(inner_loop)
+        asm.dec(16)
+        asm.brne(outer_loop)
+        return 1 + self.scale * (4 + inner * (body_insns + 2))
+
+    #
+    # Measuring
+    #
+
+    def report(self, name, elapsed, insns=None, **results):
+        """Logs and records the results of workload @name"""
+        results['seconds'] = round(elapsed, 6)
+        if insns is not None:
+            results['instructions'] = insns
+            results['mips'] = round(insns / elapsed / 1e6, 3)
+
+        jit = self.hmp('info jit')
+        for key in ('TB count', 'TB avg insns', 'TB flush count',
+                    'TB invalidate count'):
+            m = re.search(r'^%s\s+([\d.]+)' % key, jit, re.MULTILINE)
+            if m:
+                value = m.group(1)
+                results[key.lower().replace(' ', '_')] = \
+                    float(value) if '.' in value else int(value)
+
+        # Only with --enable-profiler.  This is a static count, of the calls
+        # in the code translated rather than of the calls made.
+        opcount = self.hmp('info opcount')
+        m = re.search(r'^call (\d+)$', opcount, re.MULTILINE)
+        if m:
+            results['helper_calls_translated'] = int(m.group(1))
+
+        for key, value in sorted(results.items()):
+            self.log.info('%s: %s %s', name, key, value)
+        self.whiteboard = json.dumps({name: results}, sort_keys=True)
+
+    #
+    # Workloads
+    #
+
+    def test_crc(self):
+        """
+        CRC-16/CCITT of the 256 bytes of the AES S-box read with LPM, 200
+        times, bit by bit without branches.  The last CRC is checked.
+        """
+        def body(asm):
+            asm.ldi(22, 0xff)               # 5
+            asm.ldi(23, 0xff)
+            asm.ldi(30, SBOX & 0xff)
+            asm.ldi(31, SBOX >> 8)
+            asm.ldi(17, 0)
+            byte = asm.label()              # 256 * 85
+            asm.lpm_z_inc(18)
+            asm.eor(23, 18)
+            asm.ldi(19, 8)
+            bit = asm.label()               # 8 * 10
+            asm.lsl(22)
+            asm.rol(23)
+            asm.sbc(26, 26)
+            asm.mov(27, 26)
+            asm.and_(26, 20)
+            asm.and_(27, 21)
+            asm.eor(22, 26)
+            asm.eor(23, 27)
+            asm.dec(19)
+            asm.brne(bit)
+            asm.dec(17)
+            asm.brne(byte)
+
+        asm = AVRAssembler()
+        self.start(asm)
+        asm.ldi(20, 0x21)
+        asm.ldi(21, 0x10)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        insns = self.repeat(asm, 200, body, 5 + 256 * 85)
+        self.putc(asm, 'D')
+        self.put_hex(asm, 23)
+        self.put_hex(asm, 22)
+        self.end_line(asm)
+        self.finish(asm)
+
+        sbox = aes_sbox()
+        image = asm.image(data={HEX_DIGITS: b'0123456789abcdef',
+                                SBOX: sbox})
+        elapsed, crc = self.run_firmware(image)
+        self.assertEqual(crc, '%04x' % crc16_ccitt(sbox))
+        self.report('crc', elapsed, insns)
+
+    def test_aes(self):
+        """
+        The byte operations of an AES round on a 16 byte state in SRAM:
+        S-box lookup with LPM, adding a key byte and multiplying by 3 in
+        GF(2^8), 20000 rounds.
+        """
+        def body(asm):
+            asm.ldi(26, 0x00)               # 4
+            asm.ldi(27, 0x02)
+            asm.ldi(31, SBOX >> 8)
+            asm.ldi(17, 16)
+            byte = asm.label()              # 16 * 14
+            asm.ld_x(18)
+            asm.mov(30, 18)
+            asm.lpm_z(18)
+            asm.eor(18, 19)
+            asm.mov(20, 18)
+            asm.lsl(20)
+            asm.sbc(21, 21)
+            asm.andi(21, 0x1b)
+            asm.eor(20, 21)
+            asm.eor(18, 20)
+            asm.add(19, 18)
+            asm.st_x_inc(18)
+            asm.dec(17)
+            asm.brne(byte)
+
+        asm = AVRAssembler()
+        self.start(asm)
+        asm.ldi(19, 0)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        insns = self.repeat(asm, 20000, body, 4 + 16 * 14)
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(data={SBOX: aes_sbox()})
+        elapsed, _ = self.run_firmware(image)
+        self.report('aes', elapsed, insns)
+
+    def test_usart_printf(self):
+        """
+        Formats the loop counter as "n=XXXX\\n" out of the USART, 10000
+        lines.  Characters go to UDR0 back to back, the model doesn't make
+        the firmware wait for the baud rate once its FIFO is full.
+        """
+        def body(asm):
+            self.putc(asm, 'n')             # 2 + 2 + 11 + 11 + 2
+            self.putc(asm, '=')
+            self.put_hex(asm, 25)
+            self.put_hex(asm, 24)
+            self.putc(asm, '\n')
+
+        asm = AVRAssembler()
+        self.start(asm)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        insns = self.repeat(asm, 10000, body, 28)
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(data={HEX_DIGITS: b'0123456789abcdef'})
+        elapsed, _ = self.run_firmware(image)
+        self.report('usart_printf', elapsed, insns,
+                    characters=self.scale * 10000 * 7)
+
+    def test_timer_isr(self):
+        """
+        Timer 1 in CTC mode interrupts every 160 clocks while the main loop
+        waits for the handler to have run 4096 times the scale.  How many
+        instructions that takes depends on how fast the host is, so this
+        reports interrupts per second instead of MIPS.
+        """
+        asm = AVRAssembler()
+        asm.label('timer1_compa')
+        asm.push(18)
+        asm.in_(18, SREG)
+        asm.adiw(28, 1)
+        asm.out(SREG, 18)
+        asm.pop(18)
+        asm.reti()
+
+        self.start(asm)
+        asm.ldi(18, 0)
+        asm.sts(OCR1AH, 18)
+        asm.ldi(18, 159)
+        asm.sts(OCR1AL, 18)
+        asm.ldi(18, 0x02)               # OCIE1A
+        asm.sts(TIMSK1, 18)
+        asm.ldi(28, 0)
+        asm.ldi(29, 0)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        asm.sei()
+        asm.ldi(18, 0x09)               # WGM12 | CS10
+        asm.sts(TCCR1B, 18)
+        wait = asm.label()
+        asm.cpi(29, self.scale * 16)
+        asm.brne(wait)
+        asm.cli()
+        asm.ldi(18, 0)
+        asm.sts(TCCR1B, 18)
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(vectors={TIMER1_COMPA_IRQ: 'timer1_compa'})
+        elapsed, _ = self.run_firmware(image)
+
+        count = self.vm.command('qom-get', path='/machine/intc',
+                                property='irq-count')[TIMER1_COMPA_IRQ]
+        latency = self.vm.command('qom-get', path='/machine/intc',
+                                  property='irq-latency-ns')
+        interrupts = self.scale * 4096
+        self.assertGreaterEqual(count, interrupts)
+        self.report('timer_isr', elapsed, interrupts=interrupts,
+                    interrupts_per_second=round(interrupts / elapsed),
+                    avg_latency_ns=latency[TIMER1_COMPA_IRQ] // count)
+
+    def test_io_poll(self):
+        """
+        Polls GPIO, timer and USART registers and echoes the pins to the
+        port, 50000 times, so most instructions go to a peripheral.
+        """
+        def body(asm):
+            asm.in_(18, PINA)               # 5
+            asm.lds(19, TCNT1L)
+            asm.lds(20, UCSR0A)
+            asm.out(PORTA, 18)
+            asm.eor(18, 19)
+
+        asm = AVRAssembler()
+        self.start(asm)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        insns = self.repeat(asm, 50000, body, 5)
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        elapsed, _ = self.run_firmware(asm.image())
+        self.report('io_poll', elapsed, insns)
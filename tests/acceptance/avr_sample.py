@@ -0,0 +1,148 @@
+# Functional tests of the AVR CPU and devices on the sample board
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or
+# later.  See the COPYING file in the top-level directory.
+
+from avocado_qemu.avr import AVRAssembler, AVRTest
+from avocado_qemu.avr import TIFR1, TIMSK1, TCCR1B, TCNT1L, TCNT1H
+from avocado_qemu.avr import OCR1AL, OCR1AH, TIMER1_COMPA_IRQ, HEX_DIGITS
+
+
+class AVRSample(AVRTest):
+    """
+    Runs small firmware images on the sample board and checks what they
+    write to the USART
+
+    :avocado: enable
+    :avocado: tags=arch:avr
+    :avocado: tags=machine:sample
+    """
+
+    timeout = 60
+
+    def test_poll_timer_flag(self):
+        """
+        Polls TOV1 with the timer 1 interrupts disabled, under icount with
+        one unit per clock cycle.  Nothing in the loop raises an interrupt,
+        so skipping the virtual time spent in it would miss the overflow,
+        TCNT1 just after the loop shows how long ago it happened.
+        """
+        asm = AVRAssembler()
+        self.start(asm)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        asm.ldi(18, 0x01)               # CS10, normal mode
+        asm.sts(TCCR1B, 18)
+        self.putc(asm, 'D')
+        for _ in range(4):
+            asm.ldi(18, 0x01)           # clear TOV1
+            asm.out(TIFR1, 18)
+            poll = asm.label()
+            asm.in_(18, TIFR1)
+            asm.sbrs(18, 0)
+            asm.rjmp(poll)
+            asm.lds(22, TCNT1L)
+            asm.lds(23, TCNT1H)
+            self.put_hex(asm, 23)
+            self.put_hex(asm, 22)
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(data={HEX_DIGITS: b'0123456789abcdef'})
+        _, line = self.run_firmware(image, '-icount', 'shift=6')
+        counts = [int(line[i:i + 4], 16) for i in range(0, 16, 4)]
+        # The loop takes 5 cycles, LDS 2 more
+        for count in counts:
+            self.assertLess(count, 16)
+
+    def test_sei_sleep(self):
+        """
+        Waits for an interrupt with SEI and SLEEP while it is already
+        pending.  The instruction after SEI runs before the interrupt is
+        taken, so the handler returns after SLEEP.  The handler stops the
+        timer, had it run before SLEEP the CPU would never wake up again.
+        """
+        asm = AVRAssembler()
+        asm.label('timer1_compa')
+        asm.push(18)
+        asm.ldi(18, 0)
+        asm.sts(TCCR1B, 18)
+        asm.pop(18)
+        asm.reti()
+
+        self.start(asm)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        asm.ldi(18, 0)
+        asm.sts(OCR1AH, 18)
+        asm.ldi(18, 99)
+        asm.sts(OCR1AL, 18)
+        asm.ldi(18, 0x02)               # OCIE1A
+        asm.sts(TIMSK1, 18)
+        asm.ldi(18, 0x09)               # WGM12 | CS10
+        asm.sts(TCCR1B, 18)
+        poll = asm.label()
+        asm.in_(18, TIFR1)
+        asm.sbrs(18, 1)                 # OCF1A
+        asm.rjmp(poll)
+        asm.sei()
+        asm.sleep()
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(vectors={TIMER1_COMPA_IRQ: 'timer1_compa'})
+        self.run_firmware(image)
+        count = self.vm.command('qom-get', path='/machine/intc',
+                                property='irq-count')[TIMER1_COMPA_IRQ]
+        self.assertEqual(count, 1)
+
+    def test_timer_flag_ack(self):
+        """
+        Entering the timer 1 compare A vector clears OCF1A, so disabling
+        the interrupt and enabling it again after it was taken doesn't
+        raise it again
+        """
+        asm = AVRAssembler()
+        asm.label('timer1_compa')
+        asm.push(18)
+        asm.ldi(18, 0)
+        asm.sts(TCCR1B, 18)
+        asm.ldi(28, 1)
+        asm.pop(18)
+        asm.reti()
+
+        self.start(asm)
+        self.putc(asm, 'S')
+        self.end_line(asm)
+        asm.ldi(28, 0)
+        asm.ldi(18, 0)
+        asm.sts(OCR1AH, 18)
+        asm.ldi(18, 99)
+        asm.sts(OCR1AL, 18)
+        asm.ldi(18, 0x02)               # OCIE1A
+        asm.sts(TIMSK1, 18)
+        asm.ldi(18, 0x01)               # CS10, normal mode
+        asm.sts(TCCR1B, 18)
+        asm.sei()
+        wait = asm.label()
+        asm.cpi(28, 1)
+        asm.brne(wait)
+        asm.ldi(18, 0)
+        asm.sts(TIMSK1, 18)
+        asm.ldi(18, 0x02)
+        asm.sts(TIMSK1, 18)
+        asm.ldi(24, 0)
+        asm.ldi(25, 4)
+        delay = asm.label()
+        asm.sbiw(24, 1)
+        asm.brne(delay)
+        self.putc(asm, 'D')
+        self.end_line(asm)
+        self.finish(asm)
+
+        image = asm.image(vectors={TIMER1_COMPA_IRQ: 'timer1_compa'})
+        self.run_firmware(image)
+        count = self.vm.command('qom-get', path='/machine/intc',
+                                property='irq-count')[TIMER1_COMPA_IRQ]
+        self.assertEqual(count, 1)
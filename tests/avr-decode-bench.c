@@ -0,0 +1,223 @@
+/*
+ * AVR instruction decoder benchmark
+ *
+ * Compares the decoding tree and flat table decoders in target/avr/decode.c
+ * on either a raw flash image or a synthetic instruction mix.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "../target/avr/decode.c"
+
+/*
+ * Rough static instruction mix of avr-gcc -Os output, used when no flash
+ * image is given. Opcodes are representative encodings, only the first
+ * word of 32 bit instructions is listed.
+ */
+static const struct {
+    uint16_t opcode;
+    unsigned weight;
+} synthetic_mix[] = {
+    { 0xe080, 14 }, /* LDI r24, 0x00 */
+    { 0x2f80, 5 },  /* MOV r24, r16 */
+    { 0x01fc, 5 },  /* MOVW r30, r24 */
+    { 0x8180, 5 },  /* LDD r24, Z+0 */
+    { 0x8389, 5 },  /* STD Y+1, r24 */
+    { 0x9180, 3 },  /* LDS r24, k */
+    { 0x9380, 3 },  /* STS k, r24 */
+    { 0x918d, 2 },  /* LD r24, X+ */
+    { 0x938d, 2 },  /* ST X+, r24 */
+    { 0x9001, 2 },  /* LD r0, Z+ */
+    { 0x930f, 4 },  /* PUSH r16 */
+    { 0x910f, 4 },  /* POP r16 */
+    { 0x0f88, 3 },  /* ADD r24, r24 */
+    { 0x1f99, 3 },  /* ADC r25, r25 */
+    { 0x1b80, 2 },  /* SUB r24, r16 */
+    { 0x0b91, 2 },  /* SBC r25, r17 */
+    { 0x1780, 3 },  /* CP r24, r16 */
+    { 0x0791, 2 },  /* CPC r25, r17 */
+    { 0x3080, 3 },  /* CPI r24, 0x00 */
+    { 0x5081, 2 },  /* SUBI r24, 0x01 */
+    { 0x7080, 2 },  /* ANDI r24, 0x00 */
+    { 0x6080, 1 },  /* ORI r24, 0x00 */
+    { 0x2788, 2 },  /* EOR r24, r24 */
+    { 0x9601, 2 },  /* ADIW r24, 1 */
+    { 0xf409, 4 },  /* BRNE .+2 */
+    { 0xf009, 3 },  /* BREQ .+2 */
+    { 0xc000, 3 },  /* RJMP .+0 */
+    { 0xd000, 2 },  /* RCALL .+0 */
+    { 0x940e, 3 },  /* CALL k */
+    { 0x9508, 2 },  /* RET */
+    { 0xfd80, 1 },  /* SBRC r24, 0 */
+    { 0x9586, 1 },  /* LSR r24 */
+    { 0xb780, 1 },  /* IN r24, 0x30 */
+    { 0xbf80, 1 },  /* OUT 0x30, r24 */
+    { 0x9a28, 1 },  /* SBI 0x05, 0 */
+    { 0x9b48, 1 },  /* SBIS 0x09, 0 */
+};
+
+static const char commands_string[] =
+    " -f = raw flash image to take the instruction mix from\n"
+    " -n = number of instructions in the synthetic mix\n"
+    " -r = number of passes over the instructions";
+
+static uint16_t *words;
+static size_t n_words = 1 << 16;
+static unsigned int repeat = 1000;
+static const char *image;
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void load_synthetic(void)
+{
+    unsigned total = 0;
+    uint64_t r = 1;
+    size_t i, j;
+
+    for (j = 0; j < ARRAY_SIZE(synthetic_mix); j++) {
+        total += synthetic_mix[j].weight;
+    }
+    words = g_new(uint16_t, n_words + 1);
+    for (i = 0; i < n_words; i++) {
+        unsigned pick;
+
+        r = xorshift64star(r);
+        pick = r % total;
+        for (j = 0; pick >= synthetic_mix[j].weight; j++) {
+            pick -= synthetic_mix[j].weight;
+        }
+        words[i] = synthetic_mix[j].opcode;
+    }
+    words[n_words] = 0;
+}
+
+static void load_image(void)
+{
+    gchar *contents;
+    gsize length;
+    GError *err = NULL;
+    size_t i;
+
+    if (!g_file_get_contents(image, &contents, &length, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        exit(1);
+    }
+    n_words = length / 2;
+    words = g_new0(uint16_t, n_words + 1);
+    for (i = 0; i < n_words; i++) {
+        words[i] = lduw_le_p(contents + i * 2);
+    }
+    g_free(contents);
+}
+
+static void check_decoders(void)
+{
+    uint32_t opcode;
+
+    for (opcode = 0; opcode <= 0xffff; opcode++) {
+        uint32_t tree_length, flat_length;
+        AVRInsnId tree = avr_decode(opcode, &tree_length);
+        AVRInsnId flat = avr_decode_flat(opcode, &flat_length);
+
+        if (tree != flat || tree_length != flat_length) {
+            fprintf(stderr, "decoders disagree on opcode 0x%04x\n", opcode);
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Walk the instructions the way the translator does, so 32 bit instructions
+ * consume their operand word.
+ */
+static double run(AVRInsnId (*decode)(const uint32_t, uint32_t *const),
+                  uint64_t *insns)
+{
+    int64_t start = g_get_monotonic_time();
+    uint64_t sum = 0;
+    unsigned int pass;
+    size_t i;
+
+    *insns = 0;
+    for (pass = 0; pass < repeat; pass++) {
+        for (i = 0; i < n_words; ) {
+            uint32_t opcode = words[i] | (words[i + 1] << 16);
+            uint32_t length;
+
+            sum += decode(opcode, &length);
+            i += length / 16;
+            (*insns)++;
+        }
+    }
+    /* Don't let the compiler discard the lookups */
+    if (sum == UINT64_MAX) {
+        printf("\n");
+    }
+    return (g_get_monotonic_time() - start) / 1e6;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hf:n:r:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'f':
+            image = optarg;
+            break;
+        case 'n':
+            n_words = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t insns;
+    double tree, flat;
+
+    parse_args(argc, argv);
+    check_decoders();
+    if (image) {
+        load_image();
+    } else {
+        load_synthetic();
+    }
+
+    tree = run(avr_decode, &insns);
+    flat = run(avr_decode_flat, &insns);
+
+    printf("Parameters:\n");
+    printf(" instructions:      %s\n", image ? image : "synthetic mix");
+    printf(" words:             %zu\n", n_words);
+    printf(" passes:            %u\n", repeat);
+    printf("Results:\n");
+    printf(" tree:              %.2f Mdecodes/s\n", insns / tree / 1e6);
+    printf(" flat:              %.2f Mdecodes/s\n", insns / flat / 1e6);
+    return 0;
+}